@@ -1,9 +1,28 @@
+// Build: gcc -O2 -pthread ta_simulation.c -o ta_simulation -lm
+#define _GNU_SOURCE // sched_setaffinity and the CPU_* macros
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h> // For sleep()
-#include <time.h>   // For srand()
+#include <time.h>   // For time(), nanosleep() and clock_gettime()
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h> // Peak RSS of threaded mode
+#include <limits.h>       // PTHREAD_STACK_MIN
+#include <sys/mman.h> // Fiber stacks
+#include <ucontext.h>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/perf_event.h> // Hardware counters for --sharing-benchmark
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 // --- Configuration ---
 #define NUM_STUDENTS 10       // Total number of students to simulate
@@ -12,146 +31,6409 @@
 #define TA_HELP_MAX_SECONDS 3 // Maximum time TA spends helping a student
 #define STUDENT_ARRIVAL_MIN_SECONDS 0 // Min time before next student "arrives"
 #define STUDENT_ARRIVAL_MAX_SECONDS 2 // Max time before next student "arrives"
+#define NUM_TAS 1                     // TAs sharing the waiting room
+#define MAX_PRIORITY_CLASSES 8        // Class 0 is the most urgent
+#define MAX_BATCH_SIZE 32             // Most students in one group consultation
+#define MAX_TOPICS 16                 // Question topics for skill-based routing
+#define MAX_SKILLED_TAS 64            // TAs per eligibility bitmask
+#define MAX_OFFICES 16                // Offices in a network
+#define OPTIMISM_CONSULTATIONS 10     // Default optimism window, in the longest mean consultation
+#define DEFAULT_SPIN_BUDGET_US 50     // --ta-wait adaptive: polling before the TA sleeps
+#define MAX_PINNED_CPUS 256           // CPUs in a --pin-tas or --pin-workers list
+#define FIBER_DEFAULT_STACK_KB 64     // Stack per fiber under --student-model fibers
+#define CACHE_LINE 64                 // Bytes; hot shared fields are aligned to this to avoid false sharing
+#define ENGINE_VERSION 5              // Bump whenever virtual-time results change for the same inputs (invalidates cached results)
+
+enum distribution {
+    DIST_UNIFORM,     // Legacy: whole seconds drawn uniformly from [min, max]
+    DIST_EXPONENTIAL, // Memoryless with the configured mean (arrivals form a Poisson process)
+};
+
+enum topology {
+    TOPOLOGY_SHARED, // One waiting room that every TA calls from
+    TOPOLOGY_PER_TA, // Each TA owns a share of the chairs; students pick a TA on arrival
+};
+
+enum routing {
+    ROUTING_JSQ,     // Join the shortest queue (waiting plus in service)
+    ROUTING_P2C,     // Power of two choices: the shorter of two random queues
+    ROUTING_RANDOM,  // One random queue
+};
+
+enum network_engine {
+    NETWORK_SEQUENTIAL,   // One shared event calendar
+    NETWORK_CONSERVATIVE, // Offices on several threads, synchronised in windows of the travel time
+    NETWORK_OPTIMISTIC,   // Offices on several threads, speculating and rolling back (Time Warp)
+};
+
+// Pending-event set of the virtual-time engine; every kind pops events in the same order
+enum calendar_kind {
+    CALENDAR_BINARY_HEAP,  // Implicit binary heap in one array
+    CALENDAR_PAIRING_HEAP, // Heap-ordered tree of linked nodes, restructured lazily on pop
+    CALENDAR_QUEUE,        // Brown's calendar queue: a year of sorted day lists, resized with the queue
+    CALENDAR_LADDER_QUEUE, // Tang, Goh and Thng's ladder queue: unsorted top, bucketed rungs, sorted bottom
+};
+
+enum student_model {
+    STUDENTS_THREADS,    // One kernel thread per student, paced in real time
+    STUDENTS_COROUTINES, // One stackless coroutine per student on a single thread, in simulated time
+    STUDENTS_FIBERS,     // One fiber per student and TA on a few worker threads, paced in real time
+};
+
+enum ta_wait_policy {
+    TA_WAIT_BLOCK,    // Sleep in the semaphore straight away
+    TA_WAIT_SPIN,     // Poll the semaphore and never sleep
+    TA_WAIT_ADAPTIVE, // Poll for the spin budget, then sleep
+};
+
+enum skill_policy {
+    SKILL_LONGEST_IDLE, // The eligible TA who has been idle longest
+    SKILL_WEIGHTED,     // A random eligible idle TA, in proportion to their speed on the topic
+};
+
+// One office of a network: its own TAs and chairs, and optionally its own service time
+struct office_spec {
+    int num_tas;
+    int max_chairs;
+    double service_mean; // > 0: exponential consultations with this mean; 0: the base service distribution
+};
+
+// The defaults above can be overridden on the command line (see usage())
+struct sim_config {
+    int num_students;
+    int max_chairs;
+    int help_min_seconds;
+    int help_max_seconds;
+    int arrival_min_seconds;
+    int arrival_max_seconds;
+    int num_tas;
+    int arrival_dist;       // DIST_UNIFORM: each student's arrival offset from opening; DIST_EXPONENTIAL: gap since the previous student
+    double arrival_mean;    // Mean interarrival gap when exponential
+    int service_dist;
+    double service_mean;    // Mean consultation length when exponential
+    uint64_t seed;          // Base seed; every student's streams are derived from it
+    int virtual_time;       // 1: discrete-event engine in simulated time, 0: real threads and sleep()
+    int replications;       // Independent runs (virtual-time mode only)
+    int antithetic;         // Pair every replication with its antithetic twin (U -> 1-U)
+    int compare_chairs;     // > 0: rerun each replication with this many chairs on the same streams
+    double time_scale;      // Threaded mode: real seconds slept per simulated second
+    int analytic;           // Answer from the M/M/c/K closed form when both distributions are exponential
+    int validate;           // Simulate and report the deviation from the M/M/c/K closed form
+    int optimize;           // Search for the cheapest (TAs, chairs) meeting the SLA below
+    double sla_p95_wait;    // Seconds
+    double sla_balk_pct;    // Percent of arriving students
+    int search_tas;         // Largest TA count considered
+    int search_chairs;      // Largest chair count considered
+    double ta_cost;         // Cost of one TA relative to one chair
+    double chair_cost;
+    int jobs;               // Worker threads for parallel replications
+    const char* cache_dir;  // Directory of cached replication results (NULL: no cache)
+    int priority_classes;   // Students are drawn into classes 0 (most urgent) .. priority_classes-1
+    double class_weights[MAX_PRIORITY_CLASSES]; // Relative frequency of each class
+    double aging_rate;      // Classes a waiting student climbs per second of waiting
+    double patience_mean;   // Mean (exponential) time a seated student waits before giving up; 0: forever
+    int topology;
+    int routing;            // How students pick a TA under TOPOLOGY_PER_TA
+    int quiet;              // Threaded mode: skip the per-event narrative (it serialises threads on stdout)
+    int work_stealing;      // Per-TA queues: an idle TA with an empty queue takes a student from a busy TA's queue
+    int batch_size;         // Most waiting students a TA calls into one group consultation
+    double batch_growth;    // Extra session length per additional student, as a fraction of a single consultation
+    double closed_horizon;  // > 0: closed population of num_students, simulated for this many seconds
+    double think_mean;      // Closed population: mean (exponential) time between a student's visits
+    int population_sweep;   // Closed population: report throughput for population sizes up to num_students
+    double wake_setup;      // Time a sleeping TA needs before the first consultation after waking up
+    double stay_awake;      // A TA idle for longer than this falls asleep (0: as soon as the office is empty)
+    double break_every;     // > 0: each TA takes a break this often (staggered across TAs)
+    double break_length;    // Length of each break
+    int num_topics;         // > 1: students bring a question topic and TAs only take topics they know
+    int skill_policy;       // Which idle eligible TA a newly seated student goes to
+    double skill_speed[MAX_SKILLED_TAS][MAX_TOPICS]; // Service speed of each TA on each topic; 0: not eligible
+    uint64_t topic_tas[MAX_TOPICS];      // Eligibility bitmask of TAs per topic, precomputed from skill_speed
+    uint64_t ta_topics[MAX_SKILLED_TAS]; // And of topics per TA
+    int num_offices;        // > 0: a network of offices; students arrive at office 0
+    struct office_spec offices[MAX_OFFICES];
+    double office_routing[MAX_OFFICES][MAX_OFFICES]; // Chance of moving on from office i to j after a consultation; the rest leave
+    double travel_time;     // Walk from one office to the next
+    int network_threads;    // > 1: simulate the offices on this many threads
+    int network_engine;     // How those threads synchronise: NETWORK_CONSERVATIVE or NETWORK_OPTIMISTIC
+    int network_benchmark;  // Also run every engine on the same network and compare
+    double optimism_window; // Optimistic engine: how far past the GVT an office may run ahead (derived from the model unless given)
+    int calendar;           // enum calendar_kind; changes the speed of a run, never its results
+    int calendar_benchmark; // Time every calendar on the hold model instead of simulating
+    int arena_stats;        // Report how replication memory was allocated
+    int sharing_benchmark;  // Time shared, falsely shared and padded counters instead of simulating
+    int student_model;      // Threaded mode: enum student_model
+    int fiber_workers;      // STUDENTS_FIBERS: worker threads (0: online CPUs)
+    int fiber_stack_kb;     // STUDENTS_FIBERS: stack per fiber
+    int thread_stack_kb;    // STUDENTS_THREADS: stack per thread (0: the system default)
+    int thread_guard_kb;    // STUDENTS_THREADS: guard below each stack (-1: the system default)
+    int max_student_threads; // STUDENTS_THREADS: student threads alive at once (0: unlimited)
+    int pin_ta_cpus[MAX_PINNED_CPUS];     // TA thread i runs on pin_ta_cpus[i % num_pin_ta_cpus]
+    int num_pin_ta_cpus;                  // 0: TAs float
+    int pin_worker_cpus[MAX_PINNED_CPUS]; // The same for fiber and replication workers
+    int num_pin_worker_cpus;
+    int handoff_benchmark;  // Time the student-to-TA handoff per thread placement instead of simulating
+    int ta_wait;            // Threaded mode: enum ta_wait_policy of a TA waiting for a student
+    double spin_budget_us;  // TA_WAIT_ADAPTIVE: how long to poll before sleeping
+};
+
+struct sim_config config = {
+    .num_students = NUM_STUDENTS,
+    .max_chairs = MAX_CHAIRS,
+    .help_min_seconds = TA_HELP_MIN_SECONDS,
+    .help_max_seconds = TA_HELP_MAX_SECONDS,
+    .arrival_min_seconds = STUDENT_ARRIVAL_MIN_SECONDS,
+    .arrival_max_seconds = STUDENT_ARRIVAL_MAX_SECONDS,
+    .num_tas = NUM_TAS,
+    .arrival_dist = DIST_UNIFORM,
+    .arrival_mean = 1.0,
+    .service_dist = DIST_UNIFORM,
+    .service_mean = 2.0,
+    .seed = 0,
+    .virtual_time = 0,
+    .replications = 1,
+    .antithetic = 0,
+    .compare_chairs = 0,
+    .time_scale = 1.0,
+    .analytic = 0,
+    .validate = 0,
+    .optimize = 0,
+    .sla_p95_wait = 5.0,
+    .sla_balk_pct = 5.0,
+    .search_tas = 8,
+    .search_chairs = 20,
+    .ta_cost = 10.0,
+    .chair_cost = 1.0,
+    .jobs = 0,
+    .cache_dir = NULL,
+    .priority_classes = 1,
+    .class_weights = { 1, 1, 1, 1, 1, 1, 1, 1 },
+    .aging_rate = 0.0,
+    .patience_mean = 0.0,
+    .topology = TOPOLOGY_SHARED,
+    .routing = ROUTING_JSQ,
+    .quiet = 0,
+    .work_stealing = 0,
+    .batch_size = 1,
+    .batch_growth = 0.25,
+    .closed_horizon = 0.0,
+    .think_mean = 30.0,
+    .population_sweep = 0,
+    .wake_setup = 0.0,
+    .stay_awake = 0.0,
+    .break_every = 0.0,
+    .break_length = 0.0,
+    .num_topics = 1,
+    .skill_policy = SKILL_LONGEST_IDLE,
+    .num_offices = 0,
+    .travel_time = 0.0,
+    .network_threads = 1,
+    .network_engine = NETWORK_CONSERVATIVE,
+    .network_benchmark = 0,
+    .optimism_window = 0.0,
+    .calendar = CALENDAR_BINARY_HEAP,
+    .calendar_benchmark = 0,
+    .arena_stats = 0,
+    .sharing_benchmark = 0,
+    .student_model = STUDENTS_THREADS,
+    .fiber_workers = 0,
+    .fiber_stack_kb = FIBER_DEFAULT_STACK_KB,
+    .thread_stack_kb = 0,
+    .thread_guard_kb = -1,
+    .max_student_threads = 0,
+    .num_pin_ta_cpus = 0,
+    .num_pin_worker_cpus = 0,
+    .handoff_benchmark = 0,
+    .ta_wait = TA_WAIT_BLOCK,
+    .spin_budget_us = DEFAULT_SPIN_BUDGET_US,
+};
+
+// Threaded-mode narrative of what each TA and student is doing
+#define narrate(...) do { if (!config.quiet) printf(__VA_ARGS__); } while (0)
+
+// --- Arena Allocation ---
+// A virtual-time replication takes everything it needs (its office's per-student and
+// per-TA arrays, waiting rooms and calendar) from its thread's arena by bumping a
+// pointer, and hands it all back at once with arena_reset when the replication ends.
+// The blocks are kept, and a reset that finds more than one merges them into a single
+// block with room to spare, so from the second replication on a thread normally runs
+// without calling malloc at all. Passing a NULL arena falls back to the C heap.
+#define ARENA_MIN_BLOCK (64 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size, used;
+    max_align_t data[];
+};
+
+struct arena {
+    struct arena_block* head; // Block being filled; the ones it has outgrown follow
+    void* last;               // Latest allocation, which arena_grow can extend in place
+    size_t in_use, peak;      // Bytes handed out since the last reset
+    long allocations;         // Requests served since the counters were last flushed
+    long block_mallocs;
+    long steady_mallocs;      // Blocks taken from malloc after the first reset
+    int resets;
+};
+
+// Totals over every arena, flushed on each reset
+long arena_total_resets, arena_total_allocations, arena_total_block_mallocs, arena_total_steady_mallocs;
+
+_Thread_local struct arena replication_arena;
+
+struct arena_block* arena_new_block(struct arena* arena, size_t bytes, struct arena_block* next) {
+    struct arena_block* block = malloc(sizeof(struct arena_block) + bytes);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = next;
+    block->size = bytes;
+    block->used = 0;
+    arena->block_mallocs++;
+    if (arena->resets > 0) arena->steady_mallocs++;
+    return block;
+}
+
+void* arena_alloc(struct arena* arena, size_t bytes) {
+    if (arena == NULL) {
+        return malloc(bytes);
+    }
+    bytes = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    struct arena_block* block = arena->head;
+    if (block == NULL || block->size - block->used < bytes) {
+        size_t size = block != NULL ? 2 * block->size : ARENA_MIN_BLOCK;
+        block = arena_new_block(arena, size > bytes ? size : bytes, block);
+        if (block == NULL) {
+            return NULL;
+        }
+        arena->head = block;
+    }
+    void* p = (char*)block->data + block->used;
+    block->used += bytes;
+    arena->last = p;
+    arena->in_use += bytes;
+    if (arena->in_use > arena->peak) arena->peak = arena->in_use;
+    arena->allocations++;
+    return p;
+}
+
+void* arena_calloc(struct arena* arena, size_t count, size_t size) {
+    if (arena == NULL) {
+        return calloc(count, size);
+    }
+    void* p = arena_alloc(arena, count * size);
+    if (p != NULL) memset(p, 0, count * size);
+    return p;
+}
+
+// realloc for arena memory: the latest allocation grows in place when its block has
+// room, anything else is copied and its old space stays unused until the reset
+void* arena_grow(struct arena* arena, void* p, size_t old_bytes, size_t bytes) {
+    if (arena == NULL) {
+        return realloc(p, bytes);
+    }
+    struct arena_block* block = arena->head;
+    if (p != NULL && p == arena->last) {
+        size_t offset = (char*)p - (char*)block->data;
+        size_t rounded = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+        if (rounded <= block->size - offset) {
+            arena->in_use += offset + rounded - block->used;
+            if (arena->in_use > arena->peak) arena->peak = arena->in_use;
+            block->used = offset + rounded;
+            return p;
+        }
+    }
+    void* grown = arena_alloc(arena, bytes);
+    if (grown != NULL && p != NULL) memcpy(grown, p, old_bytes < bytes ? old_bytes : bytes);
+    return grown;
+}
+
+// free for memory that may have come from an arena, where it is only reclaimed by the reset
+void arena_release(struct arena* arena, void* p) {
+    if (arena == NULL) {
+        free(p);
+    }
+}
+
+void arena_flush_counters(struct arena* arena) {
+    __atomic_fetch_add(&arena_total_allocations, arena->allocations, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&arena_total_block_mallocs, arena->block_mallocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&arena_total_steady_mallocs, arena->steady_mallocs, __ATOMIC_RELAXED);
+    arena->allocations = arena->block_mallocs = arena->steady_mallocs = 0;
+}
+
+// Frees everything allocated since the last reset at once
+void arena_reset(struct arena* arena) {
+    if (arena->head != NULL && arena->head->next != NULL) {
+        size_t size = 2 * arena->peak;
+        while (arena->head != NULL) {
+            struct arena_block* next = arena->head->next;
+            free(arena->head);
+            arena->head = next;
+        }
+        arena->head = arena_new_block(arena, size > ARENA_MIN_BLOCK ? size : ARENA_MIN_BLOCK, NULL);
+    } else if (arena->head != NULL) {
+        arena->head->used = 0;
+    }
+    arena->last = NULL;
+    arena->in_use = arena->peak = 0;
+    arena->resets++;
+    __atomic_fetch_add(&arena_total_resets, 1, __ATOMIC_RELAXED);
+    arena_flush_counters(arena);
+}
+
+void arena_destroy(struct arena* arena) {
+    while (arena->head != NULL) {
+        struct arena_block* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena_flush_counters(arena);
+    memset(arena, 0, sizeof(*arena));
+}
+
+void print_arena_summary(void) {
+    printf("Replication arenas: %ld replication(s), %ld allocation(s) served, %ld block(s) from malloc, "
+           "%ld after each thread's first replication\n", arena_total_resets, arena_total_allocations,
+           arena_total_block_mallocs, arena_total_steady_mallocs);
+}
+
+// --- Waiting Room ---
+// Seated students are kept in a binary min-heap so the TA picks the next student
+// in O(log n). A student of class k seated at time s has, at time t, effective
+// priority k - aging_rate * (t - s); comparing two students at the same t reduces
+// to comparing k + aging_rate * s, so the heap key never changes while they wait.
+// Ties go to whoever sat down first, which makes one class without aging plain FIFO.
+//
+// A student who gives up is only marked as abandoned (O(1)) and their chair is
+// freed at once; the TA skips such entries when popping. The heap has room for
+// twice the chairs and is compacted when the stale entries fill it up, so the
+// clean-up is amortised O(1) per abandonment. A returning student (closed
+// population) may still have a stale entry from an earlier visit, so an entry is
+// only live if it is also the student's latest one.
+enum seat_status { SEAT_NONE, SEAT_WAITING, SEAT_CALLED, SEAT_ABANDONED };
+
+struct waiting_entry {
+    double key;
+    uint64_t seq;       // Seating order
+    int student;
+    int priority_class;
+    double seated_at;
+};
+
+struct waiting_room {
+    struct waiting_entry* heap;
+    int size;           // Entries in the heap, including abandoned ones
+    int capacity;
+    int occupied;       // Chairs actually taken
+    uint64_t next_seq;
+    unsigned char* status; // enum seat_status, indexed by student id
+    uint64_t* latest_seq;  // Seq of each student's most recent entry
+    struct arena* arena;   // Where the arrays live (NULL: the heap)
+};
+
+int waiting_room_init(struct waiting_room* room, int chairs, int num_students, struct arena* arena) {
+    room->capacity = chairs > 0 ? 2 * chairs : 1;
+    room->heap = arena_alloc(arena, room->capacity * sizeof(struct waiting_entry));
+    room->status = arena_calloc(arena, num_students + 1, 1);
+    room->latest_seq = arena_alloc(arena, (num_students + 1) * sizeof(uint64_t));
+    room->arena = arena;
+    room->size = 0;
+    room->occupied = 0;
+    room->next_seq = 0;
+    return room->heap == NULL || room->status == NULL || room->latest_seq == NULL ? -1 : 0;
+}
+
+void waiting_room_free(struct waiting_room* room) {
+    arena_release(room->arena, room->heap);
+    arena_release(room->arena, room->status);
+    arena_release(room->arena, room->latest_seq);
+}
+
+int waiting_entry_live(const struct waiting_room* room, const struct waiting_entry* entry) {
+    return room->status[entry->student] == SEAT_WAITING && room->latest_seq[entry->student] == entry->seq;
+}
+
+int waiting_entry_before(const struct waiting_entry* a, const struct waiting_entry* b) {
+    if (a->key != b->key) return a->key < b->key;
+    return a->seq < b->seq;
+}
+
+void waiting_room_sift_down(struct waiting_room* room, int i) {
+    struct waiting_entry entry = room->heap[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= room->size) break;
+        if (child + 1 < room->size && waiting_entry_before(&room->heap[child + 1], &room->heap[child])) child++;
+        if (!waiting_entry_before(&room->heap[child], &entry)) break;
+        room->heap[i] = room->heap[child];
+        i = child;
+    }
+    room->heap[i] = entry;
+}
+
+// Drops abandoned entries and rebuilds the heap bottom-up in O(n)
+void waiting_room_compact(struct waiting_room* room) {
+    int kept = 0;
+    for (int i = 0; i < room->size; i++) {
+        if (waiting_entry_live(room, &room->heap[i])) room->heap[kept++] = room->heap[i];
+    }
+    room->size = kept;
+    for (int i = kept / 2 - 1; i >= 0; i--) {
+        waiting_room_sift_down(room, i);
+    }
+}
+
+void waiting_room_push(struct waiting_room* room, int student, int priority_class, double seated_at, double aging_rate) {
+    if (room->size == room->capacity) {
+        waiting_room_compact(room);
+    }
+    struct waiting_entry entry = { priority_class + aging_rate * seated_at, room->next_seq++, student, priority_class,
+                                   seated_at };
+    int i = room->size++;
+    while (i > 0 && waiting_entry_before(&entry, &room->heap[(i - 1) / 2])) {
+        room->heap[i] = room->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    room->heap[i] = entry;
+    room->status[student] = SEAT_WAITING;
+    room->latest_seq[student] = entry.seq;
+    room->occupied++;
+}
+
+// Removes the most urgent student who is still waiting; returns 0 if there is none
+int waiting_room_pop(struct waiting_room* room, struct waiting_entry* out) {
+    while (room->size > 0) {
+        *out = room->heap[0];
+        room->heap[0] = room->heap[--room->size];
+        if (room->size > 0) {
+            waiting_room_sift_down(room, 0);
+        }
+        if (waiting_entry_live(room, out)) {
+            room->status[out->student] = SEAT_CALLED;
+            room->occupied--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The most urgent student still waiting, left in place; returns 0 if there is none
+int waiting_room_peek(struct waiting_room* room, struct waiting_entry* out) {
+    while (room->size > 0 && !waiting_entry_live(room, &room->heap[0])) {
+        room->heap[0] = room->heap[--room->size];
+        if (room->size > 0) {
+            waiting_room_sift_down(room, 0);
+        }
+    }
+    if (room->size == 0) {
+        return 0;
+    }
+    *out = room->heap[0];
+    return 1;
+}
+
+// Gives up the student's chair; returns 0 if the TA has already called them
+int waiting_room_abandon(struct waiting_room* room, int student) {
+    if (room->status[student] != SEAT_WAITING) {
+        return 0;
+    }
+    room->status[student] = SEAT_ABANDONED;
+    room->occupied--;
+    return 1;
+}
+
+// Skill-based routing keeps one room per topic (sharing the chairs). A TA who
+// becomes free calls the most urgent student among the topics in its bitmask;
+// seating order breaks ties across rooms, since each room numbers its own seats.
+int best_topic_for_ta(const uint64_t* ta_topics, int ta, struct waiting_room* rooms) {
+    int best = -1;
+    struct waiting_entry head, best_head;
+    for (uint64_t mask = ta_topics[ta]; mask != 0; mask &= mask - 1) {
+        int topic = __builtin_ctzll(mask);
+        if (!waiting_room_peek(&rooms[topic], &head)) {
+            continue;
+        }
+        if (best < 0 || head.key < best_head.key || (head.key == best_head.key && head.seated_at < best_head.seated_at)) {
+            best = topic;
+            best_head = head;
+        }
+    }
+    return best;
+}
+
+// --- CPU Placement ---
+// --pin-tas and --pin-workers fix threads to CPUs with sched_setaffinity, so a TA
+// stays on the core whose caches hold the queue and semaphores it last touched
+// instead of migrating between handoffs. NUMA nodes come from sysfs. Memory that
+// a pinned TA owns is first touched from the TA's CPU, so the kernel places its
+// pages on the TA's node.
+#define MAX_NUMA_NODES 64
+
+// Parses a CPU list such as "0-3,8"; returns how many CPUs it names, or -1 if malformed
+int parse_cpu_list(const char* text, int* cpus, int max) {
+    int n = 0;
+    const char* p = text;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (n == max) return -1;
+            cpus[n++] = (int)cpu;
+        }
+        p = end;
+        if (*p == ',') p++;
+        else if (*p != '\0' && *p != '\n') return -1;
+    }
+    return n > 0 ? n : -1;
+}
+
+// NUMA node of a CPU according to sysfs; 0 where the kernel exposes none
+int cpu_node(int cpu) {
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        char path[64], line[1024];
+        int cpus[CPU_SETSIZE], n = -1;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) continue;
+        if (fgets(line, sizeof(line), file) != NULL) n = parse_cpu_list(line, cpus, CPU_SETSIZE);
+        fclose(file);
+        for (int i = 0; i < n; i++) {
+            if (cpus[i] == cpu) return node;
+        }
+    }
+    return 0;
+}
+
+// Pins the calling thread to cpu (-1 leaves it free); returns 0 on success
+int pin_self(int cpu) {
+    if (cpu < 0) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Failed to pin a thread to CPU %d: %s\n", cpu, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// CPU of the index-th thread under a pin list, round robin; -1 when the list is empty
+int pinned_cpu(const int* cpus, int n, int index) {
+    return n > 0 ? cpus[index % n] : -1;
+}
+
+void print_pinning(const char* what, const int* cpus, int n, int threads) {
+    printf("%s pinned to CPU", what);
+    for (int i = 0; i < threads; i++) {
+        int cpu = pinned_cpu(cpus, n, i);
+        printf("%s %d (node %d)", i ? "," : "", cpu, cpu_node(cpu));
+    }
+    printf("\n");
+}
+
+// --- Fibers ---
+// With --student-model fibers every student and TA of threaded mode runs as a
+// fiber: a ucontext with a small mmap'd stack, multiplexed over a few worker
+// threads. Each worker runs fibers from its own run queue, oldest first, and when
+// it runs dry steals the newest fiber from another worker's. The office's
+// semaphores and count_mutex (office_sem and office_mutex below) park the fiber
+// rather than the thread when it has to wait, and sleep_simulated parks it on a
+// timer, so student_thread_func and ta_thread_func run unchanged on top of them.
+// A fiber that parks while holding a lock hands the lock to its worker, which
+// unlocks it only once the fiber's context has been saved: no one can resume a
+// fiber that is still running.
+#define FIBER_IDLE_WAIT 0.01     // Longest an idle worker sleeps before looking for work again (seconds)
+#define FIBER_TIMER_BATCH 64     // Timers fired per pass, so a burst cannot starve the run queue
+#define FIBER_SPAWN_LEAD 1.0     // Simulated seconds before their arrival that student fibers are created
+
+struct fiber_sem;
+
+struct fiber {
+    ucontext_t context;
+    char* stack;                  // mmap'd; its lowest page is a guard
+    size_t stack_bytes;
+    int index;                    // In fiber_runtime.all, and the timer heap's reference to it
+    int daemon;                   // Not waited for (the TAs, who never leave)
+    void* (*start)(void*);
+    void* arg;
+    struct fiber* next;           // In a semaphore's wait list, or the free list
+    struct fiber* prev;
+    struct fiber_sem* waiting_on; // Semaphore of a timed wait still in progress (atomic)
+    uint64_t timer;               // Handle of the timer that may wake this fiber, 0: none (atomic)
+    int timed_out;
+};
+
+struct fiber_sem {
+    pthread_mutex_t lock;
+    int count;
+    struct fiber* head;           // Parked fibers, first come first served
+    struct fiber* tail;
+};
+
+struct fiber_timer {
+    double at;                    // CLOCK_MONOTONIC seconds
+    uint64_t handle;
+    int fiber;
+};
+
+struct fiber_worker {
+    pthread_mutex_t lock;         // Protects the run queue
+    struct fiber** queue;         // Ring of runnable fibers
+    int head, count, capacity;
+    pthread_t thread;
+    ucontext_t scheduler;
+    struct fiber* current;
+    pthread_mutex_t* release;     // Unlocked once the current fiber has switched out
+    struct fiber* finished;       // Recycled once the current fiber has switched out
+    long runs;
+    long steals;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct fiber_runtime {
+    pthread_mutex_t lock;         // Protects everything below but the workers' run queues
+    pthread_cond_t wake;          // Idle workers sleep here
+    pthread_cond_t done;          // The spawning thread waits here for the last student
+    struct fiber_timer* timers;   // Min-heap on at; cancelled timers stay until they expire
+    int num_timers, timers_capacity;
+    uint64_t next_handle;
+    struct fiber** all;
+    int num_fibers, all_capacity;
+    struct fiber* free_list;
+    int live;                     // Fibers not yet finished
+    int live_waited;              // Of which non-daemon
+    int peak_live;
+    int stopping;
+    size_t stack_bytes;
+    struct fiber_worker* workers;
+    int num_workers;
+    int idle;                     // Workers asleep on wake (atomic)
+    int next_worker;              // Round robin for fibers readied from outside a worker (atomic)
+    long parks;                   // Context switches away from a fiber that had to wait (atomic)
+};
+
+struct fiber_runtime fibers;
+int fiber_mode;                             // The office's semaphores, mutex and sleeps are fiber-aware
+_Thread_local struct fiber_worker* this_worker; // NULL off the workers
+
+// A fiber can resume on a different worker than it parked on, so the compiler
+// must not cache the thread-local across the switch: read it out of line only
+__attribute__((noinline)) struct fiber_worker* fiber_worker_self(void) {
+    __asm__ volatile("");
+    return this_worker;
+}
+
+struct fiber* fiber_current(void) {
+    struct fiber_worker* worker = fiber_worker_self();
+    return worker != NULL ? worker->current : NULL;
+}
+
+double fiber_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Timer heap, under fibers.lock; returns the new timer's handle or 0 if out of memory
+uint64_t fiber_timer_push(double at, int fiber) {
+    if (fibers.num_timers == fibers.timers_capacity) {
+        int capacity = fibers.timers_capacity > 0 ? 2 * fibers.timers_capacity : 256;
+        struct fiber_timer* grown = realloc(fibers.timers, capacity * sizeof(struct fiber_timer));
+        if (grown == NULL) {
+            return 0;
+        }
+        fibers.timers = grown;
+        fibers.timers_capacity = capacity;
+    }
+    struct fiber_timer timer = { at, ++fibers.next_handle, fiber };
+    int i = fibers.num_timers++;
+    while (i > 0 && fibers.timers[(i - 1) / 2].at > at) {
+        fibers.timers[i] = fibers.timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    fibers.timers[i] = timer;
+    return timer.handle;
+}
+
+void fiber_timer_pop(struct fiber_timer* out) {
+    *out = fibers.timers[0];
+    struct fiber_timer last = fibers.timers[--fibers.num_timers];
+    int i = 0;
+    while (2 * i + 1 < fibers.num_timers) {
+        int child = 2 * i + 1;
+        if (child + 1 < fibers.num_timers && fibers.timers[child + 1].at < fibers.timers[child].at) child++;
+        if (fibers.timers[child].at >= last.at) break;
+        fibers.timers[i] = fibers.timers[child];
+        i = child;
+    }
+    fibers.timers[i] = last;
+}
+
+// Makes a fiber runnable on the calling worker, or round robin from outside the runtime
+void fiber_ready(struct fiber* fiber) {
+    struct fiber_worker* worker = fiber_worker_self();
+    if (worker == NULL) {
+        worker = &fibers.workers[__atomic_fetch_add(&fibers.next_worker, 1, __ATOMIC_RELAXED) % fibers.num_workers];
+    }
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->capacity) {
+        int capacity = worker->capacity > 0 ? 2 * worker->capacity : 64;
+        struct fiber** queue = malloc(capacity * sizeof(struct fiber*));
+        if (queue == NULL) {
+            perror("Failed to grow a fiber run queue");
+            exit(1);
+        }
+        for (int i = 0; i < worker->count; i++) {
+            queue[i] = worker->queue[(worker->head + i) % worker->capacity];
+        }
+        free(worker->queue);
+        worker->queue = queue;
+        worker->head = 0;
+        worker->capacity = capacity;
+    }
+    worker->queue[(worker->head + worker->count) % worker->capacity] = fiber;
+    __atomic_store_n(&worker->count, worker->count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&worker->lock);
+    if (__atomic_load_n(&fibers.idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&fibers.lock);
+        pthread_cond_signal(&fibers.wake);
+        pthread_mutex_unlock(&fibers.lock);
+    }
+}
+
+// The owner takes its oldest runnable fiber; a thief takes the newest, whose
+// stack is least likely to be warm in the victim's cache
+struct fiber* fiber_take(struct fiber_worker* worker, int steal) {
+    if (__atomic_load_n(&worker->count, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+    struct fiber* fiber = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        if (steal) {
+            fiber = worker->queue[(worker->head + worker->count - 1) % worker->capacity];
+        } else {
+            fiber = worker->queue[worker->head];
+            worker->head = (worker->head + 1) % worker->capacity;
+        }
+        __atomic_store_n(&worker->count, worker->count - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return fiber;
+}
+
+// Switches from the current fiber back to its worker, which unlocks release
+// (if any) once the switch is complete. Returns when someone readies the fiber.
+void fiber_park(pthread_mutex_t* release) {
+    struct fiber_worker* worker = fiber_worker_self();
+    struct fiber* fiber = worker->current;
+    worker->release = release;
+    __atomic_add_fetch(&fibers.parks, 1, __ATOMIC_RELAXED);
+    swapcontext(&fiber->context, &worker->scheduler);
+}
+
+void fiber_sem_unlink(struct fiber_sem* sem, struct fiber* fiber) {
+    if (fiber->prev != NULL) fiber->prev->next = fiber->next;
+    else sem->head = fiber->next;
+    if (fiber->next != NULL) fiber->next->prev = fiber->prev;
+    else sem->tail = fiber->prev;
+    fiber->next = fiber->prev = NULL;
+}
+
+void fiber_sem_append(struct fiber_sem* sem, struct fiber* fiber) {
+    fiber->next = NULL;
+    fiber->prev = sem->tail;
+    if (sem->tail != NULL) sem->tail->next = fiber;
+    else sem->head = fiber;
+    sem->tail = fiber;
+}
+
+// A timer came due: wake its fiber unless a post (or an earlier timer) already has
+void fiber_timer_expired(struct fiber* fiber, uint64_t handle) {
+    struct fiber_sem* sem = __atomic_load_n(&fiber->waiting_on, __ATOMIC_ACQUIRE);
+    if (sem != NULL) {
+        pthread_mutex_lock(&sem->lock);
+        int expired = fiber->waiting_on == sem && fiber->timer == handle;
+        if (expired) {
+            fiber_sem_unlink(sem, fiber);
+            fiber->timed_out = 1;
+            __atomic_store_n(&fiber->waiting_on, NULL, __ATOMIC_RELEASE);
+            __atomic_store_n(&fiber->timer, 0, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&sem->lock);
+        if (expired) {
+            fiber_ready(fiber);
+        }
+        return;
+    }
+    if (__atomic_compare_exchange_n(&fiber->timer, &handle, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        fiber_ready(fiber); // A sleep
+    }
+}
+
+// Fires the timers that are due; returns how many there were
+int fiber_fire_timers(void) {
+    struct fiber* due[FIBER_TIMER_BATCH];
+    uint64_t handles[FIBER_TIMER_BATCH];
+    int n = 0;
+    double now = fiber_clock();
+    pthread_mutex_lock(&fibers.lock);
+    while (n < FIBER_TIMER_BATCH && fibers.num_timers > 0 && fibers.timers[0].at <= now) {
+        struct fiber_timer timer;
+        fiber_timer_pop(&timer);
+        due[n] = fibers.all[timer.fiber];
+        handles[n++] = timer.handle;
+    }
+    pthread_mutex_unlock(&fibers.lock);
+    // The semaphore locks come before fibers.lock, so the fibers are woken after releasing it
+    for (int i = 0; i < n; i++) {
+        fiber_timer_expired(due[i], handles[i]);
+    }
+    return n;
+}
+
+// Sleeps until a fiber is readied or a timer comes due; returns 0 once the runtime is stopping
+int fiber_worker_idle(void) {
+    pthread_mutex_lock(&fibers.lock);
+    __atomic_add_fetch(&fibers.idle, 1, __ATOMIC_SEQ_CST);
+    int work = 0;
+    for (int w = 0; w < fibers.num_workers; w++) {
+        work |= __atomic_load_n(&fibers.workers[w].count, __ATOMIC_SEQ_CST) > 0; // Readied before we counted as idle
+    }
+    if (!work && !fibers.stopping) {
+        double wait = FIBER_IDLE_WAIT;
+        if (fibers.num_timers > 0 && fibers.timers[0].at - fiber_clock() < wait) {
+            wait = fibers.timers[0].at - fiber_clock();
+        }
+        if (wait > 0.0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)(wait * 1e9);
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&fibers.wake, &fibers.lock, &deadline);
+        }
+    }
+    __atomic_sub_fetch(&fibers.idle, 1, __ATOMIC_SEQ_CST);
+    int running = !fibers.stopping;
+    pthread_mutex_unlock(&fibers.lock);
+    return running;
+}
+
+void fiber_recycle(struct fiber* fiber) {
+    pthread_mutex_lock(&fibers.lock);
+    fiber->next = fibers.free_list;
+    fibers.free_list = fiber;
+    fibers.live--;
+    if (!fiber->daemon && --fibers.live_waited == 0) {
+        pthread_cond_broadcast(&fibers.done);
+    }
+    pthread_mutex_unlock(&fibers.lock);
+}
+
+void* fiber_worker_func(void* arg) {
+    struct fiber_worker* worker = arg;
+    this_worker = worker;
+    int self = (int)(worker - fibers.workers);
+    pin_self(pinned_cpu(config.pin_worker_cpus, config.num_pin_worker_cpus, self));
+    while (1) {
+        struct fiber* fiber = fiber_take(worker, 0);
+        for (int i = 1; fiber == NULL && i < fibers.num_workers; i++) {
+            fiber = fiber_take(&fibers.workers[(self + i) % fibers.num_workers], 1);
+            if (fiber != NULL) worker->steals++;
+        }
+        // Timers are checked whenever the worker runs dry, and every so often when it does not
+        if (fiber == NULL || worker->runs % FIBER_TIMER_BATCH == 0) {
+            if (fiber_fire_timers() > 0 && fiber == NULL) {
+                continue;
+            }
+        }
+        if (fiber == NULL) {
+            if (!fiber_worker_idle()) break;
+            continue;
+        }
+        worker->runs++;
+        worker->current = fiber;
+        swapcontext(&worker->scheduler, &fiber->context);
+        worker->current = NULL;
+        if (worker->release != NULL) {
+            pthread_mutex_unlock(worker->release);
+            worker->release = NULL;
+        }
+        if (worker->finished != NULL) {
+            fiber_recycle(worker->finished);
+            worker->finished = NULL;
+        }
+    }
+    return NULL;
+}
+
+void fiber_trampoline(void) {
+    struct fiber* fiber = fiber_current();
+    fiber->start(fiber->arg);
+    struct fiber_worker* worker = fiber_worker_self(); // Not necessarily the one it started on
+    worker->finished = fiber;
+    setcontext(&worker->scheduler);
+}
+
+// Starts a fiber running start(arg); its stack comes from the free list when a finished fiber left one
+int fiber_spawn(void* (*start)(void*), void* arg, int daemon) {
+    pthread_mutex_lock(&fibers.lock);
+    struct fiber* fiber = fibers.free_list;
+    if (fiber != NULL) {
+        fibers.free_list = fiber->next;
+    } else {
+        if (fibers.num_fibers == fibers.all_capacity) {
+            int capacity = fibers.all_capacity > 0 ? 2 * fibers.all_capacity : 256;
+            struct fiber** grown = realloc(fibers.all, capacity * sizeof(struct fiber*));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&fibers.lock);
+                return -1;
+            }
+            fibers.all = grown;
+            fibers.all_capacity = capacity;
+        }
+        fiber = calloc(1, sizeof(struct fiber));
+        char* stack = fiber != NULL ? mmap(NULL, fibers.stack_bytes, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) : MAP_FAILED;
+        if (stack == MAP_FAILED) {
+            free(fiber);
+            pthread_mutex_unlock(&fibers.lock);
+            return -1;
+        }
+        mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE); // Overflowing the stack faults instead of corrupting
+        fiber->stack = stack;
+        fiber->stack_bytes = fibers.stack_bytes;
+        fiber->index = fibers.num_fibers;
+        fibers.all[fibers.num_fibers++] = fiber;
+    }
+    fibers.live++;
+    fibers.live_waited += !daemon;
+    if (fibers.live > fibers.peak_live) fibers.peak_live = fibers.live;
+    pthread_mutex_unlock(&fibers.lock);
+
+    fiber->start = start;
+    fiber->arg = arg;
+    fiber->daemon = daemon;
+    fiber->next = fiber->prev = NULL;
+    fiber->waiting_on = NULL;
+    fiber->timer = 0;
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = fiber->stack_bytes;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_trampoline, 0);
+    fiber_ready(fiber);
+    return 0;
+}
+
+int fiber_runtime_start(int workers, size_t stack_bytes) {
+    memset(&fibers, 0, sizeof(fibers));
+    pthread_mutex_init(&fibers.lock, NULL);
+    pthread_cond_init(&fibers.wake, NULL);
+    pthread_cond_init(&fibers.done, NULL);
+    fibers.stack_bytes = stack_bytes;
+    fibers.num_workers = workers;
+    fibers.workers = aligned_alloc(CACHE_LINE, workers * sizeof(struct fiber_worker));
+    if (fibers.workers == NULL) {
+        return -1;
+    }
+    memset(fibers.workers, 0, workers * sizeof(struct fiber_worker));
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_init(&fibers.workers[w].lock, NULL);
+    }
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&fibers.workers[w].thread, NULL, fiber_worker_func, &fibers.workers[w]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Blocks the calling thread (not a fiber) until every non-daemon fiber has finished
+void fiber_runtime_wait(void) {
+    pthread_mutex_lock(&fibers.lock);
+    while (fibers.live_waited > 0) {
+        pthread_cond_wait(&fibers.done, &fibers.lock);
+    }
+    pthread_mutex_unlock(&fibers.lock);
+}
+
+// Stops the workers; daemon fibers still parked never run again
+void fiber_runtime_stop(void) {
+    pthread_mutex_lock(&fibers.lock);
+    fibers.stopping = 1;
+    pthread_cond_broadcast(&fibers.wake);
+    pthread_mutex_unlock(&fibers.lock);
+    for (int w = 0; w < fibers.num_workers; w++) {
+        pthread_join(fibers.workers[w].thread, NULL);
+    }
+}
+
+void fiber_runtime_free(void) {
+    for (int i = 0; i < fibers.num_fibers; i++) {
+        munmap(fibers.all[i]->stack, fibers.all[i]->stack_bytes);
+        free(fibers.all[i]);
+    }
+    for (int w = 0; w < fibers.num_workers; w++) {
+        pthread_mutex_destroy(&fibers.workers[w].lock);
+        free(fibers.workers[w].queue);
+    }
+    free(fibers.workers);
+    free(fibers.all);
+    free(fibers.timers);
+    pthread_cond_destroy(&fibers.wake);
+    pthread_cond_destroy(&fibers.done);
+    pthread_mutex_destroy(&fibers.lock);
+}
+
+void print_fiber_summary(void) {
+    long runs = 0, steals = 0;
+    for (int w = 0; w < fibers.num_workers; w++) {
+        runs += fibers.workers[w].runs;
+        steals += fibers.workers[w].steals;
+    }
+    printf("Fibers: %d workers, %zu KB stacks, %d created, at most %d alive (%.1f MB of stack reserved)\n",
+           fibers.num_workers, fibers.stack_bytes / 1024, fibers.num_fibers, fibers.peak_live,
+           fibers.num_fibers * (double)fibers.stack_bytes / (1024 * 1024));
+    printf("Fiber switches: %ld resumed, %ld parked, %ld stolen by idle workers\n", runs, fibers.parks, steals);
+}
+
+void fiber_sem_init(struct fiber_sem* sem, int value) {
+    pthread_mutex_init(&sem->lock, NULL);
+    sem->count = value;
+    sem->head = sem->tail = NULL;
+}
+
+void fiber_sem_wait(struct fiber_sem* sem) {
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count > 0) {
+        sem->count--;
+        pthread_mutex_unlock(&sem->lock);
+        return;
+    }
+    fiber_sem_append(sem, fiber_current());
+    fiber_park(&sem->lock); // The post that wakes us has taken the count for us
+}
+
+int fiber_sem_trywait(struct fiber_sem* sem) {
+    pthread_mutex_lock(&sem->lock);
+    int taken = sem->count > 0;
+    sem->count -= taken;
+    pthread_mutex_unlock(&sem->lock);
+    return taken;
+}
+
+// Returns 1 if the semaphore was taken, 0 if seconds passed first
+int fiber_sem_timedwait(struct fiber_sem* sem, double seconds) {
+    struct fiber* fiber = fiber_current();
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count > 0 || seconds <= 0.0) {
+        int taken = sem->count > 0;
+        sem->count -= taken;
+        pthread_mutex_unlock(&sem->lock);
+        return taken;
+    }
+    fiber_sem_append(sem, fiber);
+    fiber->timed_out = 0;
+    __atomic_store_n(&fiber->waiting_on, sem, __ATOMIC_RELEASE);
+    // The timer cannot be handled before we park: expiring it takes the semaphore's lock
+    pthread_mutex_lock(&fibers.lock);
+    uint64_t handle = fiber_timer_push(fiber_clock() + seconds, fiber->index);
+    pthread_mutex_unlock(&fibers.lock);
+    if (handle == 0) {
+        perror("Failed to arm a fiber timer");
+        exit(1);
+    }
+    __atomic_store_n(&fiber->timer, handle, __ATOMIC_RELEASE);
+    fiber_park(&sem->lock);
+    return !fiber->timed_out;
+}
+
+void fiber_sem_post(struct fiber_sem* sem) {
+    pthread_mutex_lock(&sem->lock);
+    struct fiber* fiber = sem->head;
+    if (fiber != NULL) {
+        fiber_sem_unlink(sem, fiber);
+        __atomic_store_n(&fiber->waiting_on, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&fiber->timer, 0, __ATOMIC_RELEASE); // Its timer, if any, is now stale
+    } else {
+        sem->count++;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    if (fiber != NULL) {
+        fiber_ready(fiber);
+    }
+}
+
+void fiber_sleep(double seconds) {
+    struct fiber* fiber = fiber_current();
+    pthread_mutex_lock(&fibers.lock); // Held until we have parked, so the timer cannot fire early
+    uint64_t handle = fiber_timer_push(fiber_clock() + seconds, fiber->index);
+    if (handle == 0) {
+        perror("Failed to arm a fiber timer");
+        exit(1);
+    }
+    __atomic_store_n(&fiber->timer, handle, __ATOMIC_RELEASE);
+    fiber_park(&fibers.lock);
+}
+
+// Threaded mode's semaphores and mutex: the kernel's, or a fiber's under --student-model fibers
+struct office_sem {
+    sem_t sem;
+    struct fiber_sem fiber;
+};
+
+struct office_mutex {
+    pthread_mutex_t mutex;
+    struct fiber_sem fiber;
+};
+
+void office_sem_init(struct office_sem* sem, unsigned value) {
+    if (fiber_mode) fiber_sem_init(&sem->fiber, value);
+    else sem_init(&sem->sem, 0, value); // 0: shared between threads
+}
+
+void office_sem_wait(struct office_sem* sem) {
+    if (fiber_mode) fiber_sem_wait(&sem->fiber);
+    else sem_wait(&sem->sem);
+}
+
+// 0 if taken, like sem_trywait
+int office_sem_trywait(struct office_sem* sem) {
+    if (fiber_mode) return fiber_sem_trywait(&sem->fiber) ? 0 : -1;
+    return sem_trywait(&sem->sem);
+}
+
+// Like sem_timedwait against a CLOCK_REALTIME deadline: 0 if taken, else -1 with errno set
+int office_sem_timedwait(struct office_sem* sem, const struct timespec* deadline) {
+    if (!fiber_mode) {
+        return sem_timedwait(&sem->sem, deadline);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double seconds = (deadline->tv_sec - now.tv_sec) + (deadline->tv_nsec - now.tv_nsec) / 1e9;
+    if (fiber_sem_timedwait(&sem->fiber, seconds)) {
+        return 0;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+void office_sem_post(struct office_sem* sem) {
+    if (fiber_mode) fiber_sem_post(&sem->fiber);
+    else sem_post(&sem->sem);
+}
+
+void office_sem_destroy(struct office_sem* sem) {
+    if (fiber_mode) pthread_mutex_destroy(&sem->fiber.lock);
+    else sem_destroy(&sem->sem);
+}
+
+void office_mutex_init(struct office_mutex* mutex) {
+    if (fiber_mode) fiber_sem_init(&mutex->fiber, 1);
+    else pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void office_mutex_lock(struct office_mutex* mutex) {
+    if (fiber_mode) fiber_sem_wait(&mutex->fiber);
+    else pthread_mutex_lock(&mutex->mutex);
+}
+
+void office_mutex_unlock(struct office_mutex* mutex) {
+    if (fiber_mode) fiber_sem_post(&mutex->fiber);
+    else pthread_mutex_unlock(&mutex->mutex);
+}
+
+void office_mutex_destroy(struct office_mutex* mutex) {
+    if (fiber_mode) pthread_mutex_destroy(&mutex->fiber.lock);
+    else pthread_mutex_destroy(&mutex->mutex);
+}
+
+// --- Per-TA Queues ---
+// With TOPOLOGY_PER_TA in threaded mode every TA owns a bounded lock-free MPMC
+// queue (Vyukov's sequence-numbered ring), so arriving students and TAs never
+// contend on count_mutex. Chairs are reserved with an atomic counter, and a
+// student who gives up flips their seat status with a CAS; the TA discards such
+// entries when it dequeues them.
+struct mpmc_cell {
+    size_t sequence;
+    int student;
+};
+
+struct mpmc_queue {
+    struct mpmc_cell* cells;
+    size_t mask;
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+};
+
+int mpmc_queue_init(struct mpmc_queue* queue, size_t min_capacity) {
+    size_t capacity = 2;
+    while (capacity < min_capacity) capacity <<= 1;
+    queue->cells = malloc(capacity * sizeof(struct mpmc_cell));
+    if (queue->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        queue->cells[i].sequence = i;
+    }
+    queue->mask = capacity - 1;
+    queue->enqueue_pos = queue->dequeue_pos = 0;
+    return 0;
+}
+
+int mpmc_queue_push(struct mpmc_queue* queue, int student) {
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        struct mpmc_cell* cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->student = student;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Full
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int mpmc_queue_pop(struct mpmc_queue* queue, int* student) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        struct mpmc_cell* cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *student = cell->student;
+                __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Empty
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+struct ta_queue {
+    struct mpmc_queue queue;
+    int chairs;
+    int occupied __attribute__((aligned(CACHE_LINE))); // Chairs taken (atomic)
+    int busy;                                  // TA is consulting (atomic)
+    struct office_sem student_present_sem;     // Per-TA student_present_for_ta_sem
+};
+
+struct ta_queue* ta_queues;         // One per TA under TOPOLOGY_PER_TA
+unsigned char* seat_status;         // enum seat_status per student, updated with CAS under TOPOLOGY_PER_TA
+
+// Work stealing: since students are the producers, the per-TA ring cannot be a
+// true Chase-Lev deque (whose owner alone pushes). The ring is multi-consumer
+// instead, so a thief claims the victim's head slot with the same CAS the owner
+// uses and the race on the last waiting student is settled by that CAS. Victims
+// are the busy TAs with the most students waiting.
+int steal_student(int thief, int* student_id, int* victim) {
+    while (1) {
+        int best = -1, best_waiting = 0;
+        for (int t = 0; t < config.num_tas; t++) {
+            int waiting = __atomic_load_n(&ta_queues[t].occupied, __ATOMIC_ACQUIRE);
+            if (t != thief && waiting > best_waiting) {
+                best = t;
+                best_waiting = waiting;
+            }
+        }
+        if (best < 0) {
+            return 0;
+        }
+        if (mpmc_queue_pop(&ta_queues[best].queue, student_id)) {
+            *victim = best;
+            return 1;
+        }
+        // Lost the race for the last entry (or only abandoned seats counted): rescan
+        if (__atomic_load_n(&ta_queues[best].occupied, __ATOMIC_ACQUIRE) == best_waiting) {
+            return 0;
+        }
+    }
+}
+
+// Wakes an idle TA with an empty queue so it can steal a student who just queued behind a busy TA
+void wake_idle_thief(int busy_ta) {
+    for (int t = 0; t < config.num_tas; t++) {
+        if (t != busy_ta && !__atomic_load_n(&ta_queues[t].busy, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ta_queues[t].occupied, __ATOMIC_ACQUIRE) == 0) {
+            office_sem_post(&ta_queues[t].student_present_sem);
+            return;
+        }
+    }
+}
 
 // --- Semaphores and Mutex ---
-sem_t waiting_room_chairs_sem;      // Limits students in waiting chairs 
-sem_t student_present_for_ta_sem; // Student signals TA they are ready/present 
-sem_t ta_ready_for_student_sem;     // TA signals they are ready for the specific student
-sem_t consultation_finished_sem;  // TA signals consultation with current student is over
+// The shared state every student and the TAs hammer is laid out a cache line apart,
+// so a student posting the TA's semaphore does not take away the line holding the
+// lock another student is spinning on. The counters only ever touched under
+// count_mutex share its line: whoever holds the lock has it already.
+struct office_sync {
+    struct office_mutex count_mutex __attribute__((aligned(CACHE_LINE))); // Protects the two below and waiting_room
+    int num_students_in_chairs;   // Counter for students currently in chairs
+    int wait_series_len;          // Entries in wait_series (atomic under TOPOLOGY_PER_TA)
+    struct office_sem waiting_room_chairs_sem __attribute__((aligned(CACHE_LINE)));    // Limits students in waiting chairs
+    struct office_sem student_present_for_ta_sem __attribute__((aligned(CACHE_LINE))); // Student signals TA they are ready/present
+};
+
+struct office_sync sync_state;
+struct office_sem* ta_ready_for_student_sem;    // One per student: TA signals they are ready for that specific student
+struct office_sem* consultation_finished_sem; // One per student: TA signals consultation with that student is over
+
+struct waiting_room waiting_room;   // Seated students in the order the TA will call them
+struct waiting_room* topic_rooms;   // Skill-based routing: one room per topic instead of waiting_room
+struct office_sem* ta_wake_sem;                 // Skill-based routing: a student handed to an idle TA wakes that TA
+int* skill_busy;                    // Skill-based routing: TAs not waiting for a hand-off (protected by count_mutex)
+double* skill_idle_since;           // Skill-based routing: when each waiting TA became idle
+
+// --- Statistics ---
+struct timespec simulation_start;   // Reference point for all recorded timestamps
+double* wait_series;                // Chair-to-TA wait of each served student, in the order they were called
+int* wait_series_class;             // Priority class of each entry in wait_series
+int* wait_series_topic;             // Question topic of each entry in wait_series
+
+// Per-TA counters, each TA's on cache lines of its own. Only the TA writes its shard,
+// so a relaxed store does instead of a locked add, and readers sum the shards.
+struct ta_counters {
+    int wakeups;        // Sessions that started with the TA asleep
+    int breaks;
+    int steals;         // Students taken from another TA's queue
+    int spun;           // Waits for a student that ended while polling (--ta-wait)
+    int parked;         // Waits for a student that ended asleep in the semaphore
+    int batch_sessions[MAX_BATCH_SIZE + 1]; // Consultations held with each group size
+} __attribute__((aligned(CACHE_LINE)));
+
+struct ta_counters* ta_counters; // One per TA
+
+void ta_counter_add(int* counter, int n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Totals over every TA so far
+struct ta_counters ta_counters_sum(void) {
+    struct ta_counters total = { 0 };
+    for (int ta = 0; ta < config.num_tas; ta++) {
+        const struct ta_counters* shard = &ta_counters[ta];
+        total.wakeups += __atomic_load_n(&shard->wakeups, __ATOMIC_RELAXED);
+        total.breaks += __atomic_load_n(&shard->breaks, __ATOMIC_RELAXED);
+        total.steals += __atomic_load_n(&shard->steals, __ATOMIC_RELAXED);
+        total.spun += __atomic_load_n(&shard->spun, __ATOMIC_RELAXED);
+        total.parked += __atomic_load_n(&shard->parked, __ATOMIC_RELAXED);
+        for (int k = 0; k <= MAX_BATCH_SIZE; k++) {
+            total.batch_sessions[k] += __atomic_load_n(&shard->batch_sessions[k], __ATOMIC_RELAXED);
+        }
+    }
+    return total;
+}
+
+// --- Student Table ---
+// Threaded mode: what happened to each student, as one array per field indexed by
+// id (a struct of arrays), allocated once before the threads start. Each student
+// thread writes only its own entries, so no lock is needed, and the end-of-run
+// reports read after the threads are joined: each pass streams through just the
+// fields it needs. Times are simulated seconds since the office opened.
+enum student_state {
+    STUDENT_EXPECTED,   // Not arrived yet
+    STUDENT_WAITING,    // In a chair
+    STUDENT_CONSULTING,
+    STUDENT_SERVED,
+    STUDENT_BALKED,     // Found every chair taken
+    STUDENT_ABANDONED,  // Gave up waiting
+};
+
+struct student_table {
+    double* arrival;      // Drawn arrival time
+    double* seated;
+    double* called;
+    double* finished;     // Left the office, whichever way
+    unsigned char* state; // enum student_state
+};
+
+#define STUDENT_TABLE_BYTES (4 * sizeof(double) + sizeof(unsigned char)) // Per student
+
+struct student_table students;
+
+int student_table_init(struct student_table* table, int num_students) {
+    table->arrival = calloc(num_students + 1, sizeof(double));
+    table->seated = calloc(num_students + 1, sizeof(double));
+    table->called = calloc(num_students + 1, sizeof(double));
+    table->finished = calloc(num_students + 1, sizeof(double));
+    table->state = calloc(num_students + 1, 1);
+    return table->arrival == NULL || table->seated == NULL || table->called == NULL || table->finished == NULL ||
+           table->state == NULL ? -1 : 0;
+}
+
+void student_table_free(struct student_table* table) {
+    free(table->arrival);
+    free(table->seated);
+    free(table->called);
+    free(table->finished);
+    free(table->state);
+}
+
+// --- Random Number Streams ---
+// Every student owns one stream for its arrival and one for its service time, so
+// the demand a student brings does not depend on how many draws other students
+// (or a different chair count) consumed first. Two configurations run with the
+// same seed therefore see identical demand (common random numbers).
+enum stream_kind { ARRIVAL_STREAM = 1, SERVICE_STREAM = 2, CLASS_STREAM = 3, PATIENCE_STREAM = 4, ROUTING_STREAM = 5,
+                   THINK_STREAM = 6, TOPIC_STREAM = 7, NETWORK_STREAM = 8, HOLD_STREAM = 9 };
+
+struct rng_stream {
+    uint64_t state;
+    int antithetic; // Return 1-U instead of U
+};
+
+// SplitMix64 finaliser: a cheap bijective mix used both to derive stream seeds and as the generator
+uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_stream_init(struct rng_stream* stream, uint64_t seed, int kind, int student_id, int antithetic) {
+    stream->state = mix64(mix64(seed + (uint64_t)kind) ^ (uint64_t)student_id);
+    stream->antithetic = antithetic;
+}
+
+// Uniform on the open interval (0, 1)
+double rng_uniform(struct rng_stream* stream) {
+    stream->state += 0x9E3779B97F4A7C15ULL;
+    double u = ((mix64(stream->state) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    return stream->antithetic ? 1.0 - u : u;
+}
+
+// Generates a random number between min and max (inclusive)
+int rng_uniform_int(struct rng_stream* stream, int min, int max) {
+    if (min > max) {
+        int temp = min;
+        min = max;
+        max = temp;
+    }
+    int value = min + (int)(rng_uniform(stream) * (max - min + 1));
+    return value > max ? max : value;
+}
+
+double rng_exponential(struct rng_stream* stream, double mean) {
+    return -mean * log(rng_uniform(stream));
+}
+
+// Fills times[1..num_students] with every student's arrival time
+void draw_arrival_times(const struct sim_config* cfg, uint64_t seed, int antithetic, double* times) {
+    double clock = 0.0;
+    for (int id = 1; id <= cfg->num_students; id++) {
+        struct rng_stream arrival_stream;
+        rng_stream_init(&arrival_stream, seed, ARRIVAL_STREAM, id, antithetic);
+        if (cfg->arrival_dist == DIST_EXPONENTIAL) {
+            clock += rng_exponential(&arrival_stream, cfg->arrival_mean);
+            times[id] = clock;
+        } else {
+            times[id] = rng_uniform_int(&arrival_stream, cfg->arrival_min_seconds, cfg->arrival_max_seconds);
+        }
+    }
+}
+
+double draw_service_time(const struct sim_config* cfg, uint64_t seed, int antithetic, int student_id) {
+    struct rng_stream service_stream;
+    rng_stream_init(&service_stream, seed, SERVICE_STREAM, student_id, antithetic);
+    if (cfg->service_dist == DIST_EXPONENTIAL) {
+        return rng_exponential(&service_stream, cfg->service_mean);
+    }
+    return rng_uniform_int(&service_stream, cfg->help_min_seconds, cfg->help_max_seconds);
+}
+
+double mean_service_time(const struct sim_config* cfg) {
+    if (cfg->service_dist == DIST_EXPONENTIAL) {
+        return cfg->service_mean;
+    }
+    return (cfg->help_min_seconds + cfg->help_max_seconds) / 2.0;
+}
+
+// Group consultations: a session with k students lasts the first student's
+// consultation stretched by batch_growth for every additional student, so with
+// batch_growth < 1 a TA serves k students in less time than k sessions would take
+double batch_session_factor(const struct sim_config* cfg, int k) {
+    return 1.0 + cfg->batch_growth * (k - 1);
+}
+
+double batch_session_time(const struct sim_config* cfg, uint64_t seed, int antithetic, int leader, int k) {
+    return draw_service_time(cfg, seed, antithetic, leader) * batch_session_factor(cfg, k);
+}
+
+// Most students per second of session time a TA can achieve with any allowed batch size
+double batch_speedup(const struct sim_config* cfg) {
+    double best = 1.0;
+    for (int k = 2; k <= cfg->batch_size; k++) {
+        if (k / batch_session_factor(cfg, k) > best) best = k / batch_session_factor(cfg, k);
+    }
+    return best;
+}
+
+int draw_priority_class(const struct sim_config* cfg, uint64_t seed, int antithetic, int student_id) {
+    if (cfg->priority_classes <= 1) {
+        return 0;
+    }
+    struct rng_stream class_stream;
+    rng_stream_init(&class_stream, seed, CLASS_STREAM, student_id, antithetic);
+    double total = 0.0;
+    for (int k = 0; k < cfg->priority_classes; k++) total += cfg->class_weights[k];
+    double u = rng_uniform(&class_stream) * total;
+    for (int k = 0; k < cfg->priority_classes - 1; k++) {
+        if (u < cfg->class_weights[k]) return k;
+        u -= cfg->class_weights[k];
+    }
+    return cfg->priority_classes - 1;
+}
+
+// How long a seated student is willing to wait for the TA; 0 means forever
+double draw_patience(const struct sim_config* cfg, uint64_t seed, int antithetic, int student_id) {
+    if (cfg->patience_mean <= 0.0) {
+        return 0.0;
+    }
+    struct rng_stream patience_stream;
+    rng_stream_init(&patience_stream, seed, PATIENCE_STREAM, student_id, antithetic);
+    return rng_exponential(&patience_stream, cfg->patience_mean);
+}
+
+// Question topic a student brings; 0 when skill-based routing is off
+int draw_topic(const struct sim_config* cfg, uint64_t seed, int antithetic, int student_id) {
+    if (cfg->num_topics <= 1) {
+        return 0;
+    }
+    struct rng_stream topic_stream;
+    rng_stream_init(&topic_stream, seed, TOPIC_STREAM, student_id, antithetic);
+    return rng_uniform_int(&topic_stream, 0, cfg->num_topics - 1);
+}
+
+// A TA's session on a topic, scaled by the TA's speed on it
+double skilled_session_time(const struct sim_config* cfg, uint64_t seed, int antithetic, int leader, int k, int ta) {
+    double session = batch_session_time(cfg, seed, antithetic, leader, k);
+    if (cfg->num_topics <= 1) {
+        return session;
+    }
+    return session / cfg->skill_speed[ta][draw_topic(cfg, seed, antithetic, leader)];
+}
+
+// Chairs owned by queue q: the whole room when shared, otherwise an even split across TAs
+int chairs_for_queue(const struct sim_config* cfg, int max_chairs, int queue) {
+    if (cfg->topology == TOPOLOGY_SHARED) {
+        return max_chairs;
+    }
+    return max_chairs / cfg->num_tas + (queue < max_chairs % cfg->num_tas);
+}
+
+// Picks one of n queues for a student. lengths[i] counts students waiting or in
+// service at queue i and full[i] marks queues without a free chair. Returns -1
+// when the chosen queue is full (the student balks).
+int route_to_queue(int routing, struct rng_stream* routing_stream, const int* lengths, const int* full, int n) {
+    int choice = -1;
+    if (routing == ROUTING_JSQ) {
+        for (int i = 0; i < n; i++) {
+            if (!full[i] && (choice < 0 || lengths[i] < lengths[choice])) choice = i;
+        }
+        return choice;
+    }
+    choice = rng_uniform_int(routing_stream, 0, n - 1);
+    if (routing == ROUTING_P2C && n > 1) {
+        int other = rng_uniform_int(routing_stream, 0, n - 2);
+        if (other >= choice) other++; // Two distinct queues
+        if (lengths[other] < lengths[choice]) choice = other;
+    }
+    return full[choice] ? -1 : choice;
+}
+
+// Skill-based routing: picks the idle TA eligible for the topic by the configured
+// policy, walking the topic's eligibility bitmask. busy[t] marks TAs that cannot
+// take a student now. Returns -1 if every eligible TA is busy.
+int pick_skilled_ta(const struct sim_config* cfg, int topic, const int* busy, const double* idle_since,
+                    struct rng_stream* stream) {
+    int choice = -1;
+    double total_speed = 0.0;
+    uint64_t present = cfg->num_tas >= MAX_SKILLED_TAS ? ~0ULL : (1ULL << cfg->num_tas) - 1;
+    for (uint64_t mask = cfg->topic_tas[topic] & present; mask != 0; mask &= mask - 1) {
+        int ta = __builtin_ctzll(mask);
+        if (busy[ta]) {
+            continue;
+        }
+        if (cfg->skill_policy == SKILL_LONGEST_IDLE) {
+            if (choice < 0 || idle_since[ta] < idle_since[choice]) choice = ta;
+        } else {
+            // Weighted reservoir sampling: keeps each TA with probability speed / total so far
+            total_speed += cfg->skill_speed[ta][topic];
+            if (rng_uniform(stream) * total_speed < cfg->skill_speed[ta][topic]) choice = ta;
+        }
+    }
+    return choice;
+}
+
+// Seed of replication r; configurations compared under CRN share it
+uint64_t replication_seed(uint64_t base_seed, int replication) {
+    return mix64(base_seed ^ mix64((uint64_t)replication + 1));
+}
+
+// Closed population: seed of a student's visit v (visit 0 uses the replication seed itself)
+uint64_t visit_seed(uint64_t seed, int visit) {
+    return visit == 0 ? seed : mix64(seed + 0x9E3779B97F4A7C15ULL * (uint64_t)visit);
+}
+
+// Closed population: how long a student studies before the next visit
+double draw_think_time(const struct sim_config* cfg, uint64_t seed, int antithetic, int student_id) {
+    struct rng_stream think_stream;
+    rng_stream_init(&think_stream, seed, THINK_STREAM, student_id, antithetic);
+    return rng_exponential(&think_stream, cfg->think_mean);
+}
+
+// --- Utility Function ---
+// Seconds elapsed since the simulation started
+double elapsed_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - simulation_start.tv_sec) + (now.tv_nsec - simulation_start.tv_nsec) / 1e9;
+}
+
+// Sleeps for the given simulated duration, stretched by --time-scale
+void sleep_simulated(double seconds) {
+    double real = seconds * config.time_scale;
+    if (fiber_mode && fiber_current() != NULL) {
+        fiber_sleep(real); // Park the fiber, not its worker
+        return;
+    }
+    struct timespec duration;
+    duration.tv_sec = (time_t)real;
+    duration.tv_nsec = (long)((real - duration.tv_sec) * 1e9);
+    while (nanosleep(&duration, &duration) != 0) {
+        // Interrupted by a signal: sleep for the remainder
+    }
+}
+
+// --- Warm-up Detection ---
+#define MSER_BATCH_SIZE 5 // MSER-5: the series is averaged in batches of 5 before truncation
+
+// The waiting room starts empty, so the first students wait less than they would
+// in steady state. MSER-5 averages the series into batches of 5 and picks the
+// truncation point d (in batches, at most half of them) that minimises
+//     MSER(d) = sum_{j>d} (Z_j - mean_d)^2 / (k - d)^2
+// Returns the number of raw observations to discard as warm-up.
+int mser5_truncation(const double* series, int n) {
+    int k = n / MSER_BATCH_SIZE; // Number of complete batches (a partial tail batch is ignored)
+    if (k < 2) {
+        return 0; // Too short to tell transient from noise
+    }
+
+    double* batch_means = malloc(k * sizeof(double));
+    if (batch_means == NULL) {
+        perror("Failed to allocate memory for MSER batches");
+        return 0;
+    }
+    for (int j = 0; j < k; j++) {
+        double sum = 0.0;
+        for (int i = 0; i < MSER_BATCH_SIZE; i++) {
+            sum += series[j * MSER_BATCH_SIZE + i];
+        }
+        batch_means[j] = sum / MSER_BATCH_SIZE;
+    }
+
+    // Sweep d from the end so the suffix sums are accumulated in one pass
+    double suffix_sum = 0.0, suffix_sum_sq = 0.0;
+    double best_mser = -1.0;
+    int best_d = 0;
+    for (int d = k - 1; d >= 0; d--) {
+        suffix_sum += batch_means[d];
+        suffix_sum_sq += batch_means[d] * batch_means[d];
+        if (d > k / 2) {
+            continue; // Never truncate more than half of the run
+        }
+        int m = k - d;
+        double sse = suffix_sum_sq - suffix_sum * suffix_sum / m;
+        double mser = (sse < 0.0 ? 0.0 : sse) / ((double)m * m);
+        if (best_mser < 0.0 || mser <= best_mser) { // "<=" keeps the earliest minimum
+            best_mser = mser;
+            best_d = d;
+        }
+    }
+
+    free(batch_means);
+    return best_d * MSER_BATCH_SIZE;
+}
+
+double mean_of(const double* values, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += values[i];
+    }
+    return n > 0 ? sum / n : 0.0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile (p in [0, 1]); sorts a private copy
+double percentile_of(const double* values, int n, double p) {
+    if (n == 0) {
+        return 0.0;
+    }
+    double* sorted = malloc(n * sizeof(double));
+    if (sorted == NULL) {
+        perror("Failed to allocate memory for percentile");
+        return 0.0;
+    }
+    memcpy(sorted, values, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    int rank = (int)ceil(p * n) - 1;
+    double value = sorted[rank < 0 ? 0 : rank];
+    free(sorted);
+    return value;
+}
+
+// Sample mean and 95% confidence half-width (Student t)
+void mean_and_half_width(const double* values, int n, double* mean, double* half_width) {
+    static const double t_975[] = { 0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+                                    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+                                    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045 };
+    *mean = mean_of(values, n);
+    *half_width = 0.0;
+    if (n < 2) {
+        return;
+    }
+    double sum_sq = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum_sq += (values[i] - *mean) * (values[i] - *mean);
+    }
+    int df = n - 1;
+    double t = df < 30 ? t_975[df] : 1.96;
+    *half_width = t * sqrt(sum_sq / df / n);
+}
+
+// Steady-state wait percentiles of each group (priority class or question topic) of students
+void print_wait_breakdown(const double* series, const int* groups, int num_groups, int n, int warmup,
+                          const char* title, const char* group_name) {
+    double* group_waits = malloc(n * sizeof(double));
+    if (group_waits == NULL) {
+        perror("Failed to allocate memory for per-group statistics");
+        return;
+    }
+    printf("Steady-state wait by %s:\n", title);
+    printf("  %5s %8s %10s %10s %10s %10s\n", group_name, "served", "mean (s)", "p50 (s)", "p95 (s)", "p99 (s)");
+    for (int k = 0; k < num_groups; k++) {
+        int count = 0;
+        for (int i = warmup; i < n; i++) {
+            if (groups[i] == k) group_waits[count++] = series[i];
+        }
+        printf("  %5d %8d %10.3f %10.3f %10.3f %10.3f\n", k, count, mean_of(group_waits, count),
+               percentile_of(group_waits, count, 0.50), percentile_of(group_waits, count, 0.95),
+               percentile_of(group_waits, count, 0.99));
+    }
+    free(group_waits);
+}
+
+// classes may be NULL when every student is in class 0, and topics when skill-based routing is off
+void print_wait_statistics(const double* series, const int* classes, int num_classes, const int* topics,
+                           int num_topics, int n) {
+    int warmup = mser5_truncation(series, n);
+
+    printf("\n--- Waiting Time Statistics ---\n");
+    printf("Students served: %d\n", n);
+    if (n == 0) {
+        return;
+    }
+    printf("Mean wait (all students):     %.3f s\n", mean_of(series, n));
+    printf("Warm-up truncated (MSER-5):   %d student(s)\n", warmup);
+    printf("Mean wait (steady state):     %.3f s over %d student(s)\n",
+           mean_of(series + warmup, n - warmup), n - warmup);
+
+    if (classes != NULL && num_classes > 1) {
+        print_wait_breakdown(series, classes, num_classes, n, warmup, "priority class", "class");
+    }
+    if (topics != NULL && num_topics > 1) {
+        print_wait_breakdown(series, topics, num_topics, n, warmup, "question topic", "topic");
+    }
+}
+
+// --- TA Thread Function ---
+// A TA waiting for a student sleeps in a semaphore, and the futex wake that gets it
+// going again costs microseconds. --ta-wait spin and adaptive poll the semaphore
+// instead, with a pause-instruction backoff between polls; adaptive sleeps after
+// the spin budget. Once the backoff is at its cap each poll also yields the CPU,
+// so a student sharing it still gets to post.
+#define SPIN_MAX_PAUSES 64 // Most pause instructions between two polls
+
+// Tells the core this is a spin loop: saves power and leaves the pipeline to a sibling hyperthread
+void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// Takes sem under the wait policy; returns 1 if the caller ended up asleep in it
+int office_sem_wait_polling(struct office_sem* sem, int policy, double budget_us) {
+    if (policy == TA_WAIT_BLOCK) {
+        office_sem_wait(sem);
+        return 1;
+    }
+    double give_up = policy == TA_WAIT_ADAPTIVE ? elapsed_seconds() + budget_us / 1e6 : INFINITY;
+    int pauses = 1;
+    while (office_sem_trywait(sem) != 0) {
+        if (pauses < SPIN_MAX_PAUSES) {
+            for (int i = 0; i < pauses; i++) cpu_relax();
+            pauses *= 2;
+            continue;
+        }
+        if (elapsed_seconds() >= give_up) {
+            office_sem_wait(sem);
+            return 1;
+        }
+        for (int i = 0; i < pauses; i++) cpu_relax();
+        sched_yield();
+    }
+    return 0;
+}
+
+// A TA with nobody to call waits for the next student to post sem
+void ta_wait_for_student(int ta, struct office_sem* sem) {
+    int slept = office_sem_wait_polling(sem, config.ta_wait, config.spin_budget_us);
+    ta_counter_add(slept ? &ta_counters[ta].parked : &ta_counters[ta].spun, 1);
+}
+
+// Sleeping TAs and breaks. A TA idle for longer than stay_awake falls asleep and
+// needs wake_setup seconds before the next consultation. TA t's breaks fall due at
+// break_every * (k + 1 + t / num_tas), staggered so the TAs do not all leave at
+// once, and last break_length. A break never interrupts a consultation: one that
+// falls due during a session starts when the session ends.
+double first_break(const struct sim_config* cfg, int ta) {
+    return cfg->break_every * (1.0 + (double)ta / cfg->num_tas);
+}
+
+// Threaded mode: takes the TA's break if one has fallen due. busy: the TA has just
+// finished a session, so the break starts now; otherwise the TA was idle and the
+// break started on schedule. A TA comes back from a break awake.
+void ta_take_due_break(int ta, double* next_break, double* idle_since, int busy) {
+    double now = elapsed_seconds() / config.time_scale;
+    if (config.break_every <= 0.0 || now < *next_break) {
+        return;
+    }
+    while (!busy && *next_break + config.break_every <= now) {
+        *next_break += config.break_every; // Breaks missed while idle were taken in full
+    }
+    double start = busy ? now : *next_break, end = start + config.break_length;
+    while (*next_break <= start) {
+        *next_break += config.break_every;
+    }
+    ta_counter_add(&ta_counters[ta].breaks, 1);
+    if (end > now) {
+        narrate("TA %d: On a break for %.3g seconds.\n", ta, end - now);
+        sleep_simulated(end - now);
+    }
+    *idle_since = end;
+}
+
+// Threaded mode: a TA who blocked waiting for a student (rather than finding one
+// already there) and was idle for longer than stay_awake is asleep and pays the setup time
+void ta_wake_up(int ta, double* idle_since, int blocked) {
+    if (blocked && elapsed_seconds() / config.time_scale - *idle_since > config.stay_awake) {
+        ta_counter_add(&ta_counters[ta].wakeups, 1);
+        if (config.wake_setup > 0.0) {
+            narrate("TA %d: Waking up (%.3g seconds).\n", ta, config.wake_setup);
+            sleep_simulated(config.wake_setup);
+        }
+    }
+    *idle_since = elapsed_seconds() / config.time_scale; // Awake now, even if the student has already left
+}
+
+// TOPOLOGY_PER_TA: reserves a popped student for this TA, failing if they already gave up
+int claim_seat(int ta, int queue, int student_id) {
+    unsigned char expected = SEAT_WAITING;
+    if (!__atomic_compare_exchange_n(&seat_status[student_id], &expected, SEAT_CALLED, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        return 0; // The student has already given up and left
+    }
+    __atomic_store_n(&ta_queues[ta].busy, 1, __ATOMIC_RELEASE); // Count as busy before the chair is freed
+    __atomic_sub_fetch(&ta_queues[queue].occupied, 1, __ATOMIC_RELEASE);
+    narrate("TA %d: Calling in student %d.\n", ta, student_id);
+    office_sem_post(&ta_ready_for_student_sem[student_id]);
+    return 1;
+}
+
+// TOPOLOGY_PER_TA: the TA only ever calls students from its own lock-free queue
+void ta_serve_own_queue(int ta) {
+    struct ta_queue* own = &ta_queues[ta];
+    double idle_since = 0.0, next_break = first_break(&config, ta);
+    narrate("TA %d: Office is open! Ready for students.\n", ta);
+
+    while (1) {
+        narrate("TA %d: Checking for students or going to sleep...\n", ta);
+        int student_id, queue = ta, blocked = 0;
+        // Own queue empty: serve a student already waiting behind a busy TA before
+        // sleeping. wake_idle_thief only covers students who join a queue later.
+        if (office_sem_trywait(&own->student_present_sem) != 0 &&
+            !(config.work_stealing && steal_student(ta, &student_id, &queue))) {
+            blocked = 1;
+            ta_wait_for_student(ta, &own->student_present_sem); // Wait for a student to join this TA's queue
+        }
+
+        __atomic_store_n(&own->busy, 1, __ATOMIC_RELEASE); // Unavailable while on a break or waking up
+        ta_take_due_break(ta, &next_break, &idle_since, 0);
+        ta_wake_up(ta, &idle_since, blocked);
+        __atomic_store_n(&own->busy, 0, __ATOMIC_RELEASE);
+
+        if (queue == ta && !mpmc_queue_pop(&own->queue, &student_id) &&
+            !(config.work_stealing && steal_student(ta, &student_id, &queue))) {
+            continue;
+        }
+        if (!claim_seat(ta, queue, student_id)) {
+            continue;
+        }
+        if (queue != ta) {
+            ta_counter_add(&ta_counters[ta].steals, 1);
+            narrate("TA %d: Own queue empty. Took student %d from TA %d's queue.\n", ta, student_id, queue);
+        }
+
+        // Group consultation: call more students from the same queue. Students in
+        // our own queue each posted once, so each one called takes one more post.
+        int group[MAX_BATCH_SIZE], k = 0;
+        group[k++] = student_id;
+        while (k < config.batch_size && (queue != ta || office_sem_trywait(&own->student_present_sem) == 0) &&
+               mpmc_queue_pop(&ta_queues[queue].queue, &student_id)) {
+            if (claim_seat(ta, queue, student_id)) {
+                group[k++] = student_id;
+            }
+        }
+        ta_counter_add(&ta_counters[ta].batch_sessions[k], 1);
+
+        double help_duration = batch_session_time(&config, config.seed, config.antithetic, group[0], k);
+        narrate("TA %d: Helping %d student(s), led by student %d, for %.3g seconds...\n", ta, k, group[0],
+                help_duration);
+        sleep_simulated(help_duration);
+
+        for (int i = 0; i < k; i++) {
+            narrate("TA %d: Finished helping student %d.\n", ta, group[i]);
+            office_sem_post(&consultation_finished_sem[group[i]]);
+        }
+        idle_since = elapsed_seconds() / config.time_scale;
+        ta_take_due_break(ta, &next_break, &idle_since, 1);
+        __atomic_store_n(&own->busy, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Skill-based routing: the TA calls the most urgent students among the topics it
+// knows, and otherwise sleeps until a student of one of them is handed to it
+void ta_serve_by_skill(int ta) {
+    double idle_since = 0.0, next_break = first_break(&config, ta);
+    narrate("TA %d: Office is open! Ready for students.\n", ta);
+
+    while (1) {
+        int blocked = 0;
+        office_mutex_lock(&sync_state.count_mutex);
+        while (best_topic_for_ta(config.ta_topics, ta, topic_rooms) < 0) {
+            skill_busy[ta] = 0; // Newly seated students of our topics may be handed to us
+            skill_idle_since[ta] = idle_since;
+            office_mutex_unlock(&sync_state.count_mutex);
+            narrate("TA %d: No student I can help. Going to sleep...\n", ta);
+            ta_wait_for_student(ta, &ta_wake_sem[ta]);
+            blocked = 1;
+            office_mutex_lock(&sync_state.count_mutex);
+        }
+        skill_busy[ta] = 1;
+        office_mutex_unlock(&sync_state.count_mutex);
+
+        ta_take_due_break(ta, &next_break, &idle_since, 0);
+        ta_wake_up(ta, &idle_since, blocked);
+
+        // Group consultations stay within one topic
+        struct waiting_entry next;
+        int group[MAX_BATCH_SIZE], k = 0;
+        office_mutex_lock(&sync_state.count_mutex);
+        int topic = best_topic_for_ta(config.ta_topics, ta, topic_rooms);
+        while (topic >= 0 && k < config.batch_size && waiting_room_pop(&topic_rooms[topic], &next)) {
+            group[k++] = next.student;
+            narrate("TA %d: Calling in student %d (topic %d).\n", ta, next.student, topic);
+            office_sem_post(&ta_ready_for_student_sem[next.student]);
+        }
+        office_mutex_unlock(&sync_state.count_mutex);
+        if (k == 0) {
+            continue; // The student has already given up and left
+        }
+        ta_counter_add(&ta_counters[ta].batch_sessions[k], 1);
+
+        double help_duration = skilled_session_time(&config, config.seed, config.antithetic, group[0], k, ta);
+        narrate("TA %d: Helping %d student(s) with topic %d for %.3g seconds...\n", ta, k, topic, help_duration);
+        sleep_simulated(help_duration);
+
+        for (int i = 0; i < k; i++) {
+            narrate("TA %d: Finished helping student %d.\n", ta, group[i]);
+            office_sem_post(&consultation_finished_sem[group[i]]);
+        }
+        idle_since = elapsed_seconds() / config.time_scale;
+        ta_take_due_break(ta, &next_break, &idle_since, 1);
+    }
+}
+
+void* ta_thread_func(void* arg) {
+    if (config.topology == TOPOLOGY_PER_TA) {
+        ta_serve_own_queue((int)(intptr_t)arg);
+        return NULL;
+    }
+    if (config.num_topics > 1) {
+        ta_serve_by_skill((int)(intptr_t)arg);
+        return NULL;
+    }
+    int ta = (int)(intptr_t)arg;
+    double idle_since = 0.0, next_break = first_break(&config, ta);
+    narrate("TA: Office is open! Ready for students.\n");
+
+    while (1) { // TA works indefinitely (or until all students are processed if we add such logic)
+        narrate("TA: Checking for students or going to sleep...\n");
+        int blocked = office_sem_trywait(&sync_state.student_present_for_ta_sem) != 0;
+        if (blocked) {
+            ta_wait_for_student(ta, &sync_state.student_present_for_ta_sem); // Wait for a student to be present 
+        }
+        ta_take_due_break(ta, &next_break, &idle_since, 0);
+        ta_wake_up(ta, &idle_since, blocked);
+
+        // A student is present and has taken a chair (and signaled). Pick the most urgent ones.
+        struct waiting_entry next;
+        int group[MAX_BATCH_SIZE], k = 0;
+        office_mutex_lock(&sync_state.count_mutex);
+        // Every seated student posted once, so each extra student called consumes one more post
+        while (k < config.batch_size && (k == 0 || office_sem_trywait(&sync_state.student_present_for_ta_sem) == 0) &&
+               waiting_room_pop(&waiting_room, &next)) {
+            group[k++] = next.student;
+            narrate("TA: A student is present. Calling in student %d (class %d).\n", next.student, next.priority_class);
+            office_sem_post(&ta_ready_for_student_sem[next.student]); // Signal to the specific student that TA is ready 
+        }
+        office_mutex_unlock(&sync_state.count_mutex);
+        if (k == 0) {
+            continue; // The student who signalled has already given up and left
+        }
+        ta_counter_add(&ta_counters[ta].batch_sessions[k], 1);
+
+        double help_duration = batch_session_time(&config, config.seed, config.antithetic, group[0], k);
+        narrate("TA: Helping %d student(s), led by student %d, for %.3g seconds...\n", k, group[0], help_duration);
+        sleep_simulated(help_duration);
+
+        for (int i = 0; i < k; i++) {
+            narrate("TA: Finished helping student %d.\n", group[i]);
+            office_sem_post(&consultation_finished_sem[group[i]]); // Signal that consultation for this student is over
+        }                                                   // TA will loop and wait for the next student 
+        idle_since = elapsed_seconds() / config.time_scale;
+        ta_take_due_break(ta, &next_break, &idle_since, 1);
+    }
+    return NULL;
+}
+
+// --- Student Thread Function ---
+// Waits for the TA to call this student. With a patience limit, returns 0 if
+// patience ran out first (the student may still have been called meanwhile).
+int wait_for_call(int student_id, double patience) {
+    if (patience <= 0.0) {
+        office_sem_wait(&ta_ready_for_student_sem[student_id]); // Wait for TA to be free and call this specific student 
+        return 1;
+    }
+
+    // Wait for the TA, but only until patience runs out
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    double real_patience = patience * config.time_scale;
+    deadline.tv_sec += (time_t)real_patience;
+    deadline.tv_nsec += (long)((real_patience - (time_t)real_patience) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int rc;
+    while ((rc = office_sem_timedwait(&ta_ready_for_student_sem[student_id], &deadline)) != 0 && errno == EINTR) {
+        // Interrupted by a signal: keep waiting
+    }
+    return rc == 0;
+}
+
+void record_abandonment(int student_id, double patience) {
+    students.finished[student_id] = elapsed_seconds() / config.time_scale;
+    students.state[student_id] = STUDENT_ABANDONED;
+    narrate("Student %d: Waited %.3g seconds without being called. Giving up.\n", student_id, patience);
+}
+
+// TOPOLOGY_PER_TA: pick a TA by the routing policy and queue for that TA only
+void student_visit_own_queue(int student_id) {
+    int lengths[config.num_tas], full[config.num_tas];
+    for (int t = 0; t < config.num_tas; t++) {
+        int occupied = __atomic_load_n(&ta_queues[t].occupied, __ATOMIC_ACQUIRE);
+        lengths[t] = occupied + __atomic_load_n(&ta_queues[t].busy, __ATOMIC_ACQUIRE);
+        full[t] = occupied >= ta_queues[t].chairs;
+    }
+    struct rng_stream routing_stream;
+    rng_stream_init(&routing_stream, config.seed, ROUTING_STREAM, student_id, config.antithetic);
+    int ta = route_to_queue(config.routing, &routing_stream, lengths, full, config.num_tas);
+
+    struct ta_queue* queue = ta >= 0 ? &ta_queues[ta] : NULL;
+    if (queue == NULL || __atomic_add_fetch(&queue->occupied, 1, __ATOMIC_ACQ_REL) > queue->chairs) {
+        if (queue != NULL) __atomic_sub_fetch(&queue->occupied, 1, __ATOMIC_RELEASE); // Lost the last chair to another student
+        students.finished[student_id] = elapsed_seconds() / config.time_scale;
+        students.state[student_id] = STUDENT_BALKED;
+        narrate("Student %d: No chairs available. Leaving and will come back later.\n", student_id);
+        return;
+    }
+
+    students.seated[student_id] = elapsed_seconds() / config.time_scale;
+    students.state[student_id] = STUDENT_WAITING;
+    __atomic_store_n(&seat_status[student_id], SEAT_WAITING, __ATOMIC_RELEASE);
+    mpmc_queue_push(&queue->queue, student_id); // Cannot fail: the ring holds every student
+    narrate("Student %d: Took a chair in TA %d's queue.\n", student_id, ta);
+    office_sem_post(&queue->student_present_sem);
+    if (config.work_stealing && __atomic_load_n(&queue->busy, __ATOMIC_ACQUIRE)) {
+        wake_idle_thief(ta);
+    }
+
+    double patience = draw_patience(&config, config.seed, config.antithetic, student_id);
+    if (!wait_for_call(student_id, patience)) {
+        unsigned char expected = SEAT_WAITING;
+        if (__atomic_compare_exchange_n(&seat_status[student_id], &expected, SEAT_ABANDONED, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&queue->occupied, 1, __ATOMIC_RELEASE);
+            record_abandonment(student_id, patience);
+            return;
+        }
+        office_sem_wait(&ta_ready_for_student_sem[student_id]); // Called just as patience ran out
+    }
+
+    students.called[student_id] = elapsed_seconds() / config.time_scale;
+    students.state[student_id] = STUDENT_CONSULTING;
+    int slot = __atomic_fetch_add(&sync_state.wait_series_len, 1, __ATOMIC_RELAXED);
+    wait_series_class[slot] = 0;
+    wait_series_topic[slot] = 0;
+    wait_series[slot] = students.called[student_id] - students.seated[student_id];
+
+    narrate("Student %d: Consulting with TA %d.\n", student_id, ta);
+    office_sem_wait(&consultation_finished_sem[student_id]);
+    students.finished[student_id] = elapsed_seconds() / config.time_scale;
+    students.state[student_id] = STUDENT_SERVED;
+    narrate("Student %d: Consultation finished. Leaving the office.\n", student_id);
+}
+
+void* student_thread_func(void* arg) {
+    int student_id = (int)(intptr_t)arg;
+
+    // Simulate random arrival time
+    double until_arrival = students.arrival[student_id] - elapsed_seconds() / config.time_scale;
+    if (until_arrival > 0.0) {
+        sleep_simulated(until_arrival);
+    }
+    narrate("Student %d: Arrived at TA's office.\n", student_id);
+
+    if (config.topology == TOPOLOGY_PER_TA) {
+        student_visit_own_queue(student_id);
+        return NULL;
+    }
+
+    office_mutex_lock(&sync_state.count_mutex);
+    if (sync_state.num_students_in_chairs < config.max_chairs) { // Check if there's a chair available
+        sync_state.num_students_in_chairs++;
+        office_sem_wait(&sync_state.waiting_room_chairs_sem); // Take one of the available chair slots
+        students.seated[student_id] = elapsed_seconds() / config.time_scale;
+        students.state[student_id] = STUDENT_WAITING;
+        int priority_class = draw_priority_class(&config, config.seed, config.antithetic, student_id);
+        int topic = draw_topic(&config, config.seed, config.antithetic, student_id);
+        struct waiting_room* room = config.num_topics > 1 ? &topic_rooms[topic] : &waiting_room;
+        waiting_room_push(room, student_id, priority_class, students.seated[student_id], config.aging_rate);
+        narrate("Student %d: Took a chair. (Waiting students in chairs: %d)\n", student_id, sync_state.num_students_in_chairs);
+        if (config.num_topics > 1) {
+            // Skill-based routing: hand the student to an idle TA who knows the topic
+            struct rng_stream routing_stream;
+            rng_stream_init(&routing_stream, config.seed, ROUTING_STREAM, student_id, config.antithetic);
+            int ta = pick_skilled_ta(&config, topic, skill_busy, skill_idle_since, &routing_stream);
+            if (ta >= 0) {
+                skill_busy[ta] = 1;
+                narrate("Student %d: Waking TA %d for topic %d.\n", student_id, ta, topic);
+                office_sem_post(&ta_wake_sem[ta]);
+            }
+        }
+        office_mutex_unlock(&sync_state.count_mutex);
+
+        if (config.num_topics <= 1) {
+            narrate("Student %d: Informing TA they are ready.\n", student_id);
+            office_sem_post(&sync_state.student_present_for_ta_sem); // Announce presence to TA / Wake TA 
+        }
+
+        double patience = draw_patience(&config, config.seed, config.antithetic, student_id);
+        if (!wait_for_call(student_id, patience)) {
+            office_mutex_lock(&sync_state.count_mutex);
+            int gave_up = waiting_room_abandon(room, student_id);
+            if (gave_up) {
+                sync_state.num_students_in_chairs--;
+            }
+            office_mutex_unlock(&sync_state.count_mutex);
+            if (gave_up) {
+                office_sem_post(&sync_state.waiting_room_chairs_sem); // Free up the chair slot
+                record_abandonment(student_id, patience);
+                return NULL;
+            }
+            // The TA called this student just as patience ran out: the call is already posted
+            office_sem_wait(&ta_ready_for_student_sem[student_id]);
+        }
+
+        // Student is now with TA, so they leave their chair.
+        office_sem_post(&sync_state.waiting_room_chairs_sem); // Free up the chair slot
+
+        students.called[student_id] = elapsed_seconds() / config.time_scale;
+        students.state[student_id] = STUDENT_CONSULTING;
+        office_mutex_lock(&sync_state.count_mutex);
+        sync_state.num_students_in_chairs--;
+        wait_series_class[sync_state.wait_series_len] = priority_class;
+        wait_series_topic[sync_state.wait_series_len] = topic;
+        wait_series[sync_state.wait_series_len++] = students.called[student_id] - students.seated[student_id];
+        office_mutex_unlock(&sync_state.count_mutex);
+
+        narrate("Student %d: Consulting with TA.\n", student_id);
+        office_sem_wait(&consultation_finished_sem[student_id]); // Wait for TA to finish this consultation
+        students.finished[student_id] = elapsed_seconds() / config.time_scale;
+        students.state[student_id] = STUDENT_SERVED;
+
+        narrate("Student %d: Consultation finished. Leaving the office.\n", student_id);
+
+    } else {
+        // No chairs available 
+        office_mutex_unlock(&sync_state.count_mutex);
+        students.finished[student_id] = elapsed_seconds() / config.time_scale;
+        students.state[student_id] = STUDENT_BALKED;
+        narrate("Student %d: No chairs available. Leaving and will come back later.\n", student_id);
+    }
+
+    return NULL;
+}
+
+// --- Virtual-Time Engine ---
+// Replays the same office rules as the threads above (take a chair if one is free,
+// leave the chair when the TA calls, otherwise leave) in simulated time, so runs
+// take microseconds and are exactly reproducible from their seed.
+enum event_type {
+    EVENT_SERVICE_DONE = 0, // Ordered first on ties: the TA calls the next student before a newcomer looks for a chair
+    EVENT_ARRIVAL = 1,
+    EVENT_RENEGE = 2,       // A seated student's patience runs out (cancellable)
+    EVENT_BREAK_START = 3,  // A TA's break falls due (the event's student field holds the TA)
+    EVENT_BREAK_END = 4,
+};
+
+struct event {
+    double time;
+    int type;
+    int student;
+    uint64_t seq; // Insertion order, breaks remaining ties deterministically
+    int office;   // Office the event belongs to when several share one calendar
+};
+
+// Calendars other than the binary heap link their events through a pool of nodes,
+// numbered from 1 so that 0 can mean none
+struct event_node {
+    struct event ev;
+    int next;  // Pairing heap: next sibling; calendar and ladder queues: next in the same list
+    int child; // Pairing heap: first child
+};
+
+#define CALENDAR_MIN_DAYS 4   // Calendar queue: fewest days in a year (a power of two)
+#define LADDER_MAX_RUNGS 8
+#define LADDER_THRESHOLD 50   // A ladder bucket holding more events than this is split into a new rung instead of sorted
+
+struct ladder_rung {
+    double start, width;
+    int buckets;
+    int current;   // Buckets before this one have been emptied
+    int* head;     // Unsorted list of each bucket
+    int* count;
+    int capacity;
+};
+
+// Every kind keeps size and next_seq; a zeroed queue is an empty one of kind 0 (binary heap)
+struct event_queue {
+    int kind;           // enum calendar_kind
+    int size;
+    uint64_t next_seq;
+    struct event* heap; // Binary heap on event_before; ladder queue: its bottom, sorted latest first
+    int capacity;
+    struct event_node* nodes;
+    int node_count, node_capacity, free_node;
+    int root;           // Pairing heap
+    int* days;          // Calendar queue: sorted list of each day of the year
+    int num_days, days_capacity;
+    double day_width;
+    int64_t today;      // Day number the next pop starts looking from
+    int resizing;
+    int top, top_count; // Ladder queue: events after top_start, unsorted
+    double top_start, top_min, top_max;
+    struct ladder_rung rungs[LADDER_MAX_RUNGS];
+    int num_rungs;
+    int bottom;         // Events in the sorted bottom
+    struct arena* arena; // Where the arrays live (NULL: the heap)
+};
+
+int event_before(const struct event* a, const struct event* b) {
+    if (a->time != b->time) return a->time < b->time;
+    if (a->type != b->type) return a->type < b->type;
+    // Simultaneous arrivals in student order: a student walking in from another office may be
+    // inserted in a different order by the parallel network engine, but must be seen in the same one
+    if (a->type == EVENT_ARRIVAL && a->student != b->student) return a->student < b->student;
+    return a->seq < b->seq;
+}
+
+int compare_events_latest_first(const void* a, const void* b) {
+    return event_before(b, a) ? -1 : event_before(a, b);
+}
+
+void event_queue_reserve(struct event_queue* queue, int size) {
+    if (size > queue->capacity) {
+        int old_capacity = queue->capacity;
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        if (queue->capacity < size) queue->capacity = size;
+        queue->heap = arena_grow(queue->arena, queue->heap, old_capacity * sizeof(struct event),
+                                 queue->capacity * sizeof(struct event));
+        if (queue->heap == NULL) {
+            perror("Failed to grow event queue");
+            exit(1);
+        }
+    }
+}
+
+int event_node_new(struct event_queue* queue, const struct event* ev) {
+    int n = queue->free_node;
+    if (n != 0) {
+        queue->free_node = queue->nodes[n].next;
+    } else {
+        if (queue->node_count + 1 >= queue->node_capacity) {
+            queue->node_capacity = queue->node_capacity ? queue->node_capacity * 2 : 64;
+            queue->nodes = arena_grow(queue->arena, queue->nodes, (queue->node_count + 1) * sizeof(struct event_node),
+                                      queue->node_capacity * sizeof(struct event_node));
+            if (queue->nodes == NULL) {
+                perror("Failed to grow event queue");
+                exit(1);
+            }
+        }
+        n = ++queue->node_count;
+    }
+    queue->nodes[n] = (struct event_node){ *ev, 0, 0 };
+    return n;
+}
+
+void event_node_release(struct event_queue* queue, int n) {
+    queue->nodes[n].next = queue->free_node;
+    queue->free_node = n;
+}
+
+// Binary heap: O(log n) push and pop. The new event is already counted in size.
+void binary_heap_push(struct event_queue* queue, const struct event* ev) {
+    event_queue_reserve(queue, queue->size);
+    int i = queue->size - 1;
+    while (i > 0 && event_before(ev, &queue->heap[(i - 1) / 2])) {
+        queue->heap[i] = queue->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->heap[i] = *ev;
+}
+
+// The popped event is already discounted from size
+void binary_heap_pop(struct event_queue* queue, struct event* out) {
+    *out = queue->heap[0];
+    struct event last = queue->heap[queue->size];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= queue->size) break;
+        if (child + 1 < queue->size && event_before(&queue->heap[child + 1], &queue->heap[child])) child++;
+        if (!event_before(&queue->heap[child], &last)) break;
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    queue->heap[i] = last;
+}
+
+// Pairing heap: O(1) push, O(log n) amortised pop
+int pairing_meld(struct event_node* nodes, int a, int b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    if (event_before(&nodes[b].ev, &nodes[a].ev)) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    nodes[b].next = nodes[a].child;
+    nodes[a].child = b;
+    return a;
+}
+
+void pairing_heap_push(struct event_queue* queue, const struct event* ev) {
+    int n = event_node_new(queue, ev);
+    queue->root = pairing_meld(queue->nodes, queue->root, n);
+}
+
+void pairing_heap_pop(struct event_queue* queue, struct event* out) {
+    struct event_node* nodes = queue->nodes;
+    int root = queue->root, pairs = 0, heap = 0;
+    *out = nodes[root].ev;
+    // Two passes over the children: meld them in pairs from the left, then the pairs into one from the right
+    for (int c = nodes[root].child; c != 0;) {
+        int a = c, b = nodes[a].next;
+        c = b != 0 ? nodes[b].next : 0;
+        nodes[a].next = 0;
+        if (b != 0) nodes[b].next = 0;
+        int pair = pairing_meld(nodes, a, b);
+        nodes[pair].next = pairs;
+        pairs = pair;
+    }
+    while (pairs != 0) {
+        int next = nodes[pairs].next;
+        nodes[pairs].next = 0;
+        heap = pairing_meld(nodes, heap, pairs);
+        pairs = next;
+    }
+    queue->root = heap;
+    event_node_release(queue, root);
+}
+
+// Calendar queue: event times fall on numbered days of day_width; day d is kept in list
+// d mod num_days, sorted. Pop looks at the lists from today onwards for an event due that
+// day, and after a whole year without one jumps straight to the earliest. The year is
+// doubled or halved as the queue grows or shrinks, with a day width re-estimated from
+// the earliest events, so both operations take O(1) expected time.
+int64_t calendar_day_number(const struct event_queue* queue, double time) {
+    return (int64_t)floor(fmax(fmin(time / queue->day_width, 4e18), -4e18));
+}
+
+void calendar_insert(struct event_queue* queue, int n) {
+    const struct event* ev = &queue->nodes[n].ev;
+    int* link = &queue->days[calendar_day_number(queue, ev->time) & (queue->num_days - 1)];
+    while (*link != 0 && !event_before(ev, &queue->nodes[*link].ev)) {
+        link = &queue->nodes[*link].next;
+    }
+    queue->nodes[n].next = *link;
+    *link = n;
+}
+
+// Node of the earliest event; moves today up to its day
+int calendar_find(struct event_queue* queue) {
+    int64_t day = queue->today;
+    for (int k = 0; k < queue->num_days; k++, day++) {
+        int head = queue->days[day & (queue->num_days - 1)];
+        if (head != 0 && calendar_day_number(queue, queue->nodes[head].ev.time) <= day) {
+            queue->today = day;
+            return head;
+        }
+    }
+    int earliest = 0;
+    for (int d = 0; d < queue->num_days; d++) {
+        int head = queue->days[d];
+        if (head != 0 && (earliest == 0 || event_before(&queue->nodes[head].ev, &queue->nodes[earliest].ev))) {
+            earliest = head;
+        }
+    }
+    queue->today = calendar_day_number(queue, queue->nodes[earliest].ev.time);
+    return earliest;
+}
+
+void calendar_queue_pop(struct event_queue* queue, struct event* out);
+void calendar_queue_push(struct event_queue* queue, const struct event* ev);
+
+void calendar_queue_resize(struct event_queue* queue, int num_days) {
+    // Brown's width: three times the mean gap between the earliest events, leaving out gaps over twice the mean
+    struct event sample[25];
+    int samples = queue->size < 25 ? queue->size : 25;
+    queue->resizing = 1;
+    for (int k = 0; k < samples; k++) calendar_queue_pop(queue, &sample[k]);
+    for (int k = 0; k < samples; k++) calendar_queue_push(queue, &sample[k]);
+    queue->resizing = 0;
+    double mean = samples > 1 ? (sample[samples - 1].time - sample[0].time) / (samples - 1) : 0.0, gaps = 0.0;
+    int kept = 0;
+    for (int k = 1; k < samples; k++) {
+        double gap = sample[k].time - sample[k - 1].time;
+        if (gap <= 2.0 * mean) {
+            gaps += gap;
+            kept++;
+        }
+    }
+    // Chain every event into one list so the day array can be reused in place
+    int all = 0, tail = 0;
+    for (int d = 0; d < queue->num_days; d++) {
+        if (queue->days[d] == 0) continue;
+        if (tail == 0) all = queue->days[d]; else queue->nodes[tail].next = queue->days[d];
+        for (tail = queue->days[d]; queue->nodes[tail].next != 0; tail = queue->nodes[tail].next) {}
+    }
+    if (num_days > queue->days_capacity) {
+        arena_release(queue->arena, queue->days);
+        queue->days = arena_alloc(queue->arena, num_days * sizeof(int));
+        if (queue->days == NULL) {
+            perror("Failed to grow event queue");
+            exit(1);
+        }
+        queue->days_capacity = num_days;
+    }
+    memset(queue->days, 0, num_days * sizeof(int));
+    queue->num_days = num_days;
+    if (gaps > 0.0 && isfinite(gaps)) queue->day_width = 3.0 * gaps / kept;
+    for (int n = all, next; n != 0; n = next) {
+        next = queue->nodes[n].next;
+        calendar_insert(queue, n);
+    }
+    queue->today = samples > 0 ? calendar_day_number(queue, sample[0].time) : 0;
+}
+
+void calendar_queue_push(struct event_queue* queue, const struct event* ev) {
+    if (queue->num_days == 0) {
+        queue->days = arena_calloc(queue->arena, CALENDAR_MIN_DAYS, sizeof(int));
+        if (queue->days == NULL) {
+            perror("Failed to grow event queue");
+            exit(1);
+        }
+        queue->num_days = queue->days_capacity = CALENDAR_MIN_DAYS;
+        queue->day_width = 1.0;
+        queue->today = calendar_day_number(queue, ev->time);
+    }
+    calendar_insert(queue, event_node_new(queue, ev));
+    int64_t day = calendar_day_number(queue, ev->time);
+    if (day < queue->today) queue->today = day; // Never happens while simulating forward in time
+    if (!queue->resizing && queue->size > 2 * queue->num_days) calendar_queue_resize(queue, 2 * queue->num_days);
+}
+
+void calendar_queue_pop(struct event_queue* queue, struct event* out) {
+    int n = calendar_find(queue);
+    queue->days[queue->today & (queue->num_days - 1)] = queue->nodes[n].next;
+    *out = queue->nodes[n].ev;
+    event_node_release(queue, n);
+    if (!queue->resizing && queue->num_days > CALENDAR_MIN_DAYS && queue->size < queue->num_days / 2) {
+        calendar_queue_resize(queue, queue->num_days / 2);
+    }
+}
+
+// Ladder queue: new events after top_start go unsorted into the top. When the rest runs
+// out, the top is spread over a first rung of buckets, one per event; the earliest
+// non-empty bucket of the last rung is then sorted into the bottom, or, when it holds
+// more than LADDER_THRESHOLD events, spread over a finer rung of its own. Events before
+// top_start go into the first rung whose bucket for them has not been emptied yet, or
+// into the bottom. Each event is sorted once in a small bucket: O(1) amortised.
+int ladder_bucket(const struct ladder_rung* rung, double time) {
+    double k = floor((time - rung->start) / rung->width);
+    if (!(k > 0.0)) return 0;
+    return k >= rung->buckets - 1 ? rung->buckets - 1 : (int)k;
+}
+
+// Spreads a list of count events (with different times) over a new rung
+void ladder_spawn(struct event_queue* queue, int list, int count, double start, double width) {
+    struct ladder_rung* rung = &queue->rungs[queue->num_rungs++];
+    if (count > rung->capacity) {
+        rung->capacity = count;
+        arena_release(queue->arena, rung->head); // The contents are about to be cleared anyway
+        arena_release(queue->arena, rung->count);
+        rung->head = arena_alloc(queue->arena, count * sizeof(int));
+        rung->count = arena_alloc(queue->arena, count * sizeof(int));
+        if (rung->head == NULL || rung->count == NULL) {
+            perror("Failed to grow event queue");
+            exit(1);
+        }
+    }
+    rung->start = start;
+    rung->width = width;
+    rung->buckets = count;
+    rung->current = 0;
+    memset(rung->head, 0, count * sizeof(int));
+    memset(rung->count, 0, count * sizeof(int));
+    for (int n = list, next; n != 0; n = next) {
+        next = queue->nodes[n].next;
+        int b = ladder_bucket(rung, queue->nodes[n].ev.time);
+        queue->nodes[n].next = rung->head[b];
+        rung->head[b] = n;
+        rung->count[b]++;
+    }
+}
+
+void ladder_sort_into_bottom(struct event_queue* queue, int list, int count) {
+    event_queue_reserve(queue, queue->bottom + count);
+    for (int n = list, next; n != 0; n = next) {
+        next = queue->nodes[n].next;
+        queue->heap[queue->bottom++] = queue->nodes[n].ev;
+        event_node_release(queue, n);
+    }
+    qsort(queue->heap, queue->bottom, sizeof(struct event), compare_events_latest_first);
+}
+
+// Fills the empty bottom (there are events left)
+void ladder_refill(struct event_queue* queue) {
+    while (queue->bottom == 0) {
+        if (queue->num_rungs == 0) {
+            int list = queue->top, count = queue->top_count;
+            double min = queue->top_min, max = queue->top_max;
+            queue->top = 0;
+            queue->top_count = 0;
+            queue->top_start = max;
+            if (min == max) ladder_sort_into_bottom(queue, list, count);
+            else ladder_spawn(queue, list, count, min, (max - min) / count);
+            continue;
+        }
+        struct ladder_rung* rung = &queue->rungs[queue->num_rungs - 1];
+        while (rung->current < rung->buckets && rung->count[rung->current] == 0) rung->current++;
+        if (rung->current == rung->buckets) {
+            queue->num_rungs--;
+            continue;
+        }
+        int b = rung->current++, list = rung->head[b], count = rung->count[b];
+        double min = INFINITY, max = -INFINITY;
+        for (int n = list; n != 0; n = queue->nodes[n].next) {
+            min = fmin(min, queue->nodes[n].ev.time);
+            max = fmax(max, queue->nodes[n].ev.time);
+        }
+        if (count > LADDER_THRESHOLD && queue->num_rungs < LADDER_MAX_RUNGS && min < max) {
+            ladder_spawn(queue, list, count, rung->start + b * rung->width, rung->width / count);
+        } else {
+            ladder_sort_into_bottom(queue, list, count);
+        }
+    }
+}
+
+void ladder_queue_push(struct event_queue* queue, const struct event* ev) {
+    if (ev->time > queue->top_start) {
+        int n = event_node_new(queue, ev);
+        queue->nodes[n].next = queue->top;
+        queue->top = n;
+        queue->top_min = queue->top_count == 0 ? ev->time : fmin(queue->top_min, ev->time);
+        queue->top_max = queue->top_count == 0 ? ev->time : fmax(queue->top_max, ev->time);
+        queue->top_count++;
+        return;
+    }
+    for (int r = 0; r < queue->num_rungs; r++) {
+        struct ladder_rung* rung = &queue->rungs[r];
+        int b = ladder_bucket(rung, ev->time);
+        if (b >= rung->current) {
+            int n = event_node_new(queue, ev);
+            queue->nodes[n].next = rung->head[b];
+            rung->head[b] = n;
+            rung->count[b]++;
+            return;
+        }
+    }
+    // Due before every rung's next bucket: straight into the sorted bottom
+    event_queue_reserve(queue, queue->bottom + 1);
+    int low = 0, high = queue->bottom;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (event_before(&queue->heap[mid], ev)) high = mid;
+        else low = mid + 1;
+    }
+    memmove(&queue->heap[low + 1], &queue->heap[low], (queue->bottom - low) * sizeof(struct event));
+    queue->heap[low] = *ev;
+    queue->bottom++;
+}
+
+void ladder_queue_pop(struct event_queue* queue, struct event* out) {
+    ladder_refill(queue);
+    *out = queue->heap[--queue->bottom];
+}
+
+// Returns the event's sequence number, which serves as its cancellation handle
+uint64_t event_queue_push(struct event_queue* queue, double time, int type, int student, int office) {
+    struct event ev = { time, type, student, queue->next_seq++, office };
+    queue->size++;
+    switch (queue->kind) {
+    case CALENDAR_PAIRING_HEAP: pairing_heap_push(queue, &ev); break;
+    case CALENDAR_QUEUE: calendar_queue_push(queue, &ev); break;
+    case CALENDAR_LADDER_QUEUE: ladder_queue_push(queue, &ev); break;
+    default: binary_heap_push(queue, &ev); break;
+    }
+    return ev.seq;
+}
+
+int event_queue_pop(struct event_queue* queue, struct event* out) {
+    if (queue->size == 0) {
+        return 0;
+    }
+    queue->size--;
+    switch (queue->kind) {
+    case CALENDAR_PAIRING_HEAP: pairing_heap_pop(queue, out); break;
+    case CALENDAR_QUEUE: calendar_queue_pop(queue, out); break;
+    case CALENDAR_LADDER_QUEUE: ladder_queue_pop(queue, out); break;
+    default: binary_heap_pop(queue, out); break;
+    }
+    return 1;
+}
+
+// The earliest event, left in place; NULL if there is none
+const struct event* event_queue_peek(struct event_queue* queue) {
+    if (queue->size == 0) {
+        return NULL;
+    }
+    switch (queue->kind) {
+    case CALENDAR_PAIRING_HEAP: return &queue->nodes[queue->root].ev;
+    case CALENDAR_QUEUE: return &queue->nodes[calendar_find(queue)].ev;
+    case CALENDAR_LADDER_QUEUE: ladder_refill(queue); return &queue->heap[queue->bottom - 1];
+    default: return &queue->heap[0];
+    }
+}
+
+void event_queue_free(struct event_queue* queue) {
+    arena_release(queue->arena, queue->heap);
+    arena_release(queue->arena, queue->nodes);
+    arena_release(queue->arena, queue->days);
+    for (int r = 0; r < LADDER_MAX_RUNGS; r++) {
+        arena_release(queue->arena, queue->rungs[r].head);
+        arena_release(queue->arena, queue->rungs[r].count);
+    }
+}
+
+struct replication_result {
+    int served;              // Students called in by the TA
+    int balked;              // Students who found every chair taken
+    double mean_wait;        // Over all served students
+    int warmup;              // Observations dropped by MSER-5
+    double steady_mean_wait; // Over served students after the warm-up
+    double steady_p95_wait;  // 95th percentile after the warm-up
+    double utilization;      // Fraction of TA time spent consulting
+    int abandoned;           // Students who gave up waiting
+    double mean_wasted_wait; // Chair time of an abandoning student
+    int steals;              // Students served by a TA other than the one whose queue they joined
+    int batch_sessions[MAX_BATCH_SIZE + 1]; // Consultations held with each group size
+    int wakeups;             // Sessions that started with the TA asleep
+    int breaks;
+    double awake_idle;       // Fraction of TA time spent idle but awake
+};
+
+void summarize_waits(const double* waits, int served, int balked, struct replication_result* result) {
+    result->served = served;
+    result->balked = balked;
+    result->mean_wait = mean_of(waits, served);
+    result->warmup = mser5_truncation(waits, served);
+    result->steady_mean_wait = mean_of(waits + result->warmup, served - result->warmup);
+    result->steady_p95_wait = percentile_of(waits + result->warmup, served - result->warmup, 0.95);
+    result->utilization = 0.0;
+    result->abandoned = 0;
+    result->mean_wasted_wait = 0.0;
+    result->steals = 0;
+    memset(result->batch_sessions, 0, sizeof(result->batch_sessions));
+    result->wakeups = 0;
+    result->breaks = 0;
+    result->awake_idle = 0.0;
+}
+
+// State of one office during a virtual-time replication
+struct virtual_office {
+    const struct sim_config* cfg;
+    uint64_t seed;
+    int antithetic;
+    int index;                  // Position in an office network (0 otherwise)
+    struct event_queue* events; // Own calendar, or one shared by an office network
+    struct event_queue own_events;
+    int num_queues;             // 1 shared waiting room, one per TA, or one per topic (sharing the chairs)
+    int skills;                 // Skill-based routing: rooms are per topic
+    struct waiting_room* rooms;
+    int* room_chairs;
+    int* ta_busy;               // Consulting, waking up or on a break
+    double* ta_free_at;         // When each busy TA's current session ends
+    double* idle_since;         // When each idle TA last finished a session or came back from a break
+    int* break_pending;         // A break fell due during the TA's current session
+    int* sessions;              // Students in each TA's current session, batch_size slots per TA
+    int* session_size;
+    int* student_ta;            // TA serving each student
+    int* student_room;          // Queue each student sat down in
+    double* seated_at;          // Arrival time doubles as seat time
+    uint64_t* renege_timer;     // Live timer handle per student, 0: none
+    int* visits;                // Closed population: visits each student has made before this one (NULL: open)
+    double* waits;              // Output: wait of each served student, in call order
+    int waits_capacity;         // > 0: the office owns waits and grows it as needed
+    int* classes;               // Output (optional): their priority classes
+    int* topics;                // Output (optional): their question topics
+    int served, balked, abandoned, steals;
+    int finished;               // Students who have left: served, balked or abandoned
+    int batch_sessions[MAX_BATCH_SIZE + 1]; // Consultations held with each group size
+    int wakeups, breaks;
+    double busy_time, wasted_wait, awake_idle;
+    struct arena* arena;        // Where the office's arrays live (NULL: the heap)
+};
+
+uint64_t virtual_office_push(struct virtual_office* office, double time, int type, int student) {
+    return event_queue_push(office->events, time, type, student, office->index);
+}
+
+// waits, when the office owns it (waits_capacity > 0), must come from the same arena
+void virtual_office_init(struct virtual_office* office, const struct sim_config* cfg, int max_chairs, uint64_t seed,
+                         int antithetic, double* waits, int* classes, int* topics, struct arena* arena) {
+    memset(office, 0, sizeof(*office));
+    office->cfg = cfg;
+    office->seed = seed;
+    office->antithetic = antithetic;
+    office->arena = arena;
+    office->events = &office->own_events;
+    office->own_events.kind = cfg->calendar;
+    office->own_events.arena = arena;
+    office->own_events.next_seq = 1; // Sequence numbers double as timer handles, and 0 means no timer
+    office->skills = cfg->num_topics > 1;
+    office->num_queues = cfg->topology == TOPOLOGY_PER_TA ? cfg->num_tas : office->skills ? cfg->num_topics : 1;
+    office->rooms = arena_alloc(arena, office->num_queues * sizeof(struct waiting_room));
+    office->room_chairs = arena_alloc(arena, office->num_queues * sizeof(int));
+    office->ta_busy = arena_calloc(arena, cfg->num_tas, sizeof(int));
+    office->ta_free_at = arena_calloc(arena, cfg->num_tas, sizeof(double));
+    office->idle_since = arena_calloc(arena, cfg->num_tas, sizeof(double));
+    office->break_pending = arena_calloc(arena, cfg->num_tas, sizeof(int));
+    office->sessions = arena_alloc(arena, cfg->num_tas * cfg->batch_size * sizeof(int));
+    office->session_size = arena_calloc(arena, cfg->num_tas, sizeof(int));
+    office->student_ta = arena_alloc(arena, (cfg->num_students + 1) * sizeof(int));
+    office->student_room = arena_alloc(arena, (cfg->num_students + 1) * sizeof(int));
+    office->seated_at = arena_alloc(arena, (cfg->num_students + 1) * sizeof(double));
+    office->renege_timer = arena_calloc(arena, cfg->num_students + 1, sizeof(uint64_t));
+    office->waits = waits;
+    office->classes = classes;
+    office->topics = topics;
+    if (office->rooms == NULL || office->room_chairs == NULL || office->ta_busy == NULL ||
+        office->ta_free_at == NULL || office->idle_since == NULL || office->break_pending == NULL ||
+        office->sessions == NULL || office->session_size == NULL ||
+        office->student_ta == NULL || office->student_room == NULL || office->seated_at == NULL ||
+        office->renege_timer == NULL) {
+        perror("Failed to allocate virtual-time state");
+        exit(1);
+    }
+    for (int q = 0; q < office->num_queues; q++) {
+        office->room_chairs[q] = chairs_for_queue(cfg, max_chairs, q);
+        if (waiting_room_init(&office->rooms[q], office->room_chairs[q], cfg->num_students, arena) != 0) {
+            perror("Failed to allocate virtual-time state");
+            exit(1);
+        }
+    }
+    if (cfg->break_every > 0.0) {
+        for (int ta = 0; ta < cfg->num_tas; ta++) {
+            virtual_office_push(office, first_break(cfg, ta), EVENT_BREAK_START, ta);
+        }
+    }
+}
+
+void virtual_office_free(struct virtual_office* office) {
+    for (int q = 0; q < office->num_queues; q++) {
+        waiting_room_free(&office->rooms[q]);
+    }
+    event_queue_free(&office->own_events);
+    arena_release(office->arena, office->rooms);
+    arena_release(office->arena, office->room_chairs);
+    arena_release(office->arena, office->ta_busy);
+    arena_release(office->arena, office->ta_free_at);
+    arena_release(office->arena, office->idle_since);
+    arena_release(office->arena, office->break_pending);
+    arena_release(office->arena, office->sessions);
+    arena_release(office->arena, office->session_size);
+    arena_release(office->arena, office->student_ta);
+    arena_release(office->arena, office->student_room);
+    arena_release(office->arena, office->seated_at);
+    arena_release(office->arena, office->renege_timer);
+    arena_release(office->arena, office->visits);
+    if (office->waits_capacity > 0) {
+        arena_release(office->arena, office->waits);
+    }
+}
+
+// Seed of the student's current visit, so a returning student brings fresh demand
+uint64_t virtual_office_seed(const struct virtual_office* office, int student) {
+    return office->visits != NULL ? visit_seed(office->seed, office->visits[student]) : office->seed;
+}
+
+// The TA calls a student who has just been taken off a waiting room, plus up to
+// batch_size - 1 more from the same room for a group consultation
+void virtual_office_start(struct virtual_office* office, int ta, struct waiting_room* room,
+                          const struct waiting_entry* first, double now) {
+    const struct sim_config* cfg = office->cfg;
+    struct waiting_entry next = *first;
+    int leader = next.student, k = 0;
+    int* session = &office->sessions[ta * cfg->batch_size];
+
+    // A TA idle for longer than stay_awake has fallen asleep; the students wait while it wakes up
+    double idle = now - office->idle_since[ta], setup = 0.0;
+    if (idle > cfg->stay_awake) {
+        office->wakeups++;
+        office->awake_idle += cfg->stay_awake;
+        setup = cfg->wake_setup;
+    } else {
+        office->awake_idle += idle;
+    }
+    do {
+        if (office->served == office->waits_capacity && office->waits_capacity > 0) {
+            office->waits_capacity *= 2;
+            office->waits = arena_grow(office->arena, office->waits, office->served * sizeof(double),
+                                       office->waits_capacity * sizeof(double));
+            if (office->waits == NULL) {
+                perror("Failed to allocate memory for wait series");
+                exit(1);
+            }
+        }
+        office->renege_timer[next.student] = 0; // Cancel the patience timer in O(1)
+        if (office->classes != NULL) office->classes[office->served] = next.priority_class;
+        if (office->topics != NULL) {
+            office->topics[office->served] = draw_topic(cfg, virtual_office_seed(office, next.student), office->antithetic,
+                                                        next.student);
+        }
+        office->waits[office->served++] = now + setup - office->seated_at[next.student];
+        session[k++] = next.student;
+    } while (k < cfg->batch_size && waiting_room_pop(room, &next));
+    office->ta_busy[ta] = 1;
+    office->student_ta[leader] = ta;
+    office->session_size[ta] = k;
+    office->batch_sessions[k]++;
+
+    // One event per session: the other students leave with the leader
+    double service = skilled_session_time(cfg, virtual_office_seed(office, leader), office->antithetic, leader, k, ta);
+    office->busy_time += service;
+    office->ta_free_at[ta] = now + setup + service;
+    virtual_office_push(office, now + setup + service, EVENT_SERVICE_DONE, leader);
+}
+
+// Lets every idle TA that serves queue q call its most urgent student
+void virtual_office_dispatch(struct virtual_office* office, int queue, double now) {
+    const struct sim_config* cfg = office->cfg;
+    struct waiting_room* room = &office->rooms[queue];
+    int first = office->num_queues == 1 ? 0 : queue, last = office->num_queues == 1 ? cfg->num_tas - 1 : queue;
+    struct waiting_entry next;
+    for (int ta = first; ta <= last && room->occupied > 0; ta++) {
+        if (!office->ta_busy[ta] && waiting_room_pop(room, &next)) {
+            virtual_office_start(office, ta, room, &next, now);
+        }
+    }
+}
+
+// Work stealing: every idle TA with an empty queue takes the most urgent student
+// from the busy TA with the most students waiting
+void virtual_office_steal(struct virtual_office* office, double now) {
+    for (int ta = 0; ta < office->num_queues; ta++) {
+        if (office->ta_busy[ta] || office->rooms[ta].occupied > 0) {
+            continue;
+        }
+        int victim = -1;
+        for (int q = 0; q < office->num_queues; q++) {
+            if (office->rooms[q].occupied > 0 && (victim < 0 || office->rooms[q].occupied > office->rooms[victim].occupied)) {
+                victim = q;
+            }
+        }
+        struct waiting_entry next;
+        if (victim < 0 || !waiting_room_pop(&office->rooms[victim], &next)) {
+            return; // Nothing left to steal
+        }
+        office->steals++;
+        virtual_office_start(office, ta, &office->rooms[victim], &next, now);
+    }
+}
+
+// Queue an arriving student joins, or -1 if they find no chair
+int virtual_office_route(struct virtual_office* office, int student) {
+    if (office->num_queues == 1) {
+        return office->rooms[0].occupied < office->room_chairs[0] ? 0 : -1;
+    }
+    if (office->skills) {
+        int seated = 0;
+        for (int q = 0; q < office->num_queues; q++) seated += office->rooms[q].occupied;
+        return seated < office->room_chairs[0] ?
+               draw_topic(office->cfg, virtual_office_seed(office, student), office->antithetic, student) : -1;
+    }
+    int n = office->num_queues, lengths[n], full[n];
+    for (int q = 0; q < n; q++) {
+        lengths[q] = office->rooms[q].occupied + office->ta_busy[q];
+        full[q] = office->rooms[q].occupied >= office->room_chairs[q];
+    }
+    struct rng_stream routing_stream;
+    rng_stream_init(&routing_stream, virtual_office_seed(office, student), ROUTING_STREAM, student, office->antithetic);
+    return route_to_queue(office->cfg->routing, &routing_stream, lengths, full, n);
+}
+
+// A student walks in: takes a chair and waits, or balks. Returns 0 if they balked.
+int virtual_office_arrive(struct virtual_office* office, int id, double now) {
+    const struct sim_config* cfg = office->cfg;
+    int queue = virtual_office_route(office, id);
+    if (queue < 0) {
+        office->balked++;
+        office->finished++;
+        return 0;
+    }
+    uint64_t seed = virtual_office_seed(office, id);
+    office->seated_at[id] = now;
+    office->student_room[id] = queue;
+    waiting_room_push(&office->rooms[queue], id, draw_priority_class(cfg, seed, office->antithetic, id), now,
+                      cfg->aging_rate);
+    double patience = draw_patience(cfg, seed, office->antithetic, id);
+    if (patience > 0.0) {
+        office->renege_timer[id] = virtual_office_push(office, now + patience, EVENT_RENEGE, id);
+    }
+    if (office->skills) {
+        // Hand the student to an idle TA who knows the topic, if there is one
+        struct rng_stream routing_stream;
+        struct waiting_entry next;
+        rng_stream_init(&routing_stream, seed, ROUTING_STREAM, id, office->antithetic);
+        int ta = pick_skilled_ta(cfg, queue, office->ta_busy, office->idle_since, &routing_stream);
+        if (ta >= 0 && waiting_room_pop(&office->rooms[queue], &next)) {
+            virtual_office_start(office, ta, &office->rooms[queue], &next, now);
+        }
+        return 1;
+    }
+    virtual_office_dispatch(office, queue, now);
+    if (cfg->work_stealing && office->num_queues > 1) {
+        virtual_office_steal(office, now);
+    }
+    return 1;
+}
+
+// A renege timer fires; returns 0 if it was cancelled because the student was called first
+int virtual_office_renege(struct virtual_office* office, const struct event* ev, double now) {
+    if (ev->seq != office->renege_timer[ev->student]) {
+        return 0;
+    }
+    waiting_room_abandon(&office->rooms[office->student_room[ev->student]], ev->student);
+    office->abandoned++;
+    office->finished++;
+    office->wasted_wait += now - office->seated_at[ev->student];
+    return 1;
+}
+
+// A TA has become available: call the next student it can help
+void virtual_office_ta_free(struct virtual_office* office, int ta, double now) {
+    office->ta_busy[ta] = 0;
+    office->idle_since[ta] = now;
+    if (office->skills) {
+        int topic = best_topic_for_ta(office->cfg->ta_topics, ta, office->rooms);
+        struct waiting_entry next;
+        if (topic >= 0 && waiting_room_pop(&office->rooms[topic], &next)) {
+            virtual_office_start(office, ta, &office->rooms[topic], &next, now);
+        }
+        return;
+    }
+    virtual_office_dispatch(office, office->num_queues == 1 ? 0 : ta, now);
+    if (office->cfg->work_stealing && office->num_queues > 1) {
+        virtual_office_steal(office, now);
+    }
+}
+
+void virtual_office_begin_break(struct virtual_office* office, int ta, double now) {
+    office->ta_busy[ta] = 1;
+    office->breaks++;
+    virtual_office_push(office, now + office->cfg->break_length, EVENT_BREAK_END, ta);
+}
+
+// The session led by this student ends; returns the TA, whose session list stays valid until it calls again
+int virtual_office_finish(struct virtual_office* office, int leader, double now) {
+    int ta = office->student_ta[leader];
+    office->finished += office->session_size[ta];
+    if (office->break_pending[ta]) {
+        office->break_pending[ta] = 0;
+        virtual_office_begin_break(office, ta, now);
+        return ta;
+    }
+    virtual_office_ta_free(office, ta, now);
+    return ta;
+}
+
+// EVENT_BREAK_START or EVENT_BREAK_END for the TA in ev->student
+void virtual_office_break(struct virtual_office* office, const struct event* ev, double now) {
+    int ta = ev->student;
+    if (ev->type == EVENT_BREAK_END) {
+        virtual_office_ta_free(office, ta, now); // Back from the break awake
+        return;
+    }
+    // Keep the schedule going while students can still turn up
+    if (office->visits != NULL || office->finished < office->cfg->num_students) {
+        virtual_office_push(office, now + office->cfg->break_every, EVENT_BREAK_START, ta);
+    }
+    if (office->ta_busy[ta]) {
+        office->break_pending[ta] = 1;
+    } else {
+        virtual_office_begin_break(office, ta, now);
+    }
+}
+
+// Runs one replication with the given chair count; waits must hold num_students
+// entries, and classes and topics (optional) receive the priority class and
+// question topic of each wait
+void run_virtual_replication(const struct sim_config* cfg, int max_chairs, uint64_t seed, int antithetic,
+                             double* waits, int* classes, int* topics, struct replication_result* result) {
+    struct virtual_office office;
+    virtual_office_init(&office, cfg, max_chairs, seed, antithetic, waits, classes, topics, &replication_arena);
+    double now = 0.0;
+
+    double* arrivals = arena_alloc(&replication_arena, (cfg->num_students + 1) * sizeof(double));
+    if (arrivals == NULL) {
+        perror("Failed to allocate virtual-time state");
+        exit(1);
+    }
+    draw_arrival_times(cfg, seed, antithetic, arrivals);
+    for (int id = 1; id <= cfg->num_students; id++) {
+        virtual_office_push(&office, arrivals[id], EVENT_ARRIVAL, id);
+    }
+
+    struct event ev;
+    while (event_queue_pop(office.events, &ev)) {
+        if (ev.type == EVENT_RENEGE && ev.seq != office.renege_timer[ev.student]) {
+            continue; // Cancelled by the call: must not stretch the horizon utilization is measured over
+        }
+        if ((ev.type == EVENT_BREAK_START || ev.type == EVENT_BREAK_END) && office.finished == cfg->num_students) {
+            continue; // Everyone has left: breaks still on the calendar would only push the horizon out
+        }
+        now = ev.time;
+        if (ev.type == EVENT_ARRIVAL) {
+            virtual_office_arrive(&office, ev.student, now);
+        } else if (ev.type == EVENT_RENEGE) {
+            virtual_office_renege(&office, &ev, now);
+        } else if (ev.type == EVENT_SERVICE_DONE) {
+            virtual_office_finish(&office, ev.student, now);
+        } else {
+            virtual_office_break(&office, &ev, now);
+        }
+    }
+
+    summarize_waits(waits, office.served, office.balked, result);
+    result->utilization = now > 0.0 ? office.busy_time / (now * cfg->num_tas) : 0.0;
+    result->abandoned = office.abandoned;
+    result->mean_wasted_wait = office.abandoned > 0 ? office.wasted_wait / office.abandoned : 0.0;
+    result->steals = office.steals;
+    memcpy(result->batch_sessions, office.batch_sessions, sizeof(result->batch_sessions));
+    result->wakeups = office.wakeups;
+    result->breaks = office.breaks;
+    result->awake_idle = now > 0.0 ? office.awake_idle / (now * cfg->num_tas) : 0.0;
+    virtual_office_free(&office);
+    arena_reset(&replication_arena);
+}
+
+// --- Closed Population ---
+// A fixed class of students who keep coming back: each one thinks (studies) for an
+// exponential time, visits the office, and after being helped, balking or giving
+// up starts thinking again. There is one event per visit rather than a thread, so
+// long horizons are cheap. Every visit draws from its own seed (visit_seed), so
+// student i's n-th visit brings the same demand whatever the population size.
+struct closed_result {
+    int population;
+    int visits;              // Visits started within the horizon
+    int completed;           // Consultations finished within the horizon
+    double throughput;       // Completed consultations per second
+    double utilization;
+    double steady_mean_wait; // After MSER-5 warm-up truncation
+    double mean_response;    // Wait plus consultation, over completed visits
+    double balk_fraction;
+    double abandon_fraction;
+};
+
+// The student starts thinking and will visit again once done
+void closed_office_think(struct virtual_office* office, int student, double now) {
+    office->visits[student]++;
+    double think = draw_think_time(office->cfg, virtual_office_seed(office, student), office->antithetic, student);
+    virtual_office_push(office, now + think, EVENT_ARRIVAL, student);
+}
+
+void run_closed_replication(const struct sim_config* cfg, int population, uint64_t seed, struct closed_result* result) {
+    struct sim_config closed = *cfg;
+    closed.num_students = population;
+    struct virtual_office office;
+    virtual_office_init(&office, &closed, closed.max_chairs, seed, 0,
+                        arena_alloc(&replication_arena, 1024 * sizeof(double)), NULL, NULL, &replication_arena);
+    office.waits_capacity = 1024;
+    office.visits = arena_calloc(&replication_arena, population + 1, sizeof(int));
+    if (office.waits == NULL || office.visits == NULL) {
+        perror("Failed to allocate closed-population state");
+        exit(1);
+    }
+
+    // Everyone starts out thinking
+    for (int id = 1; id <= population; id++) {
+        virtual_office_push(&office, draw_think_time(&closed, seed, 0, id), EVENT_ARRIVAL, id);
+    }
+
+    int visits = 0, completed = 0;
+    double response_total = 0.0, horizon = cfg->closed_horizon;
+    struct event ev;
+    while (event_queue_pop(office.events, &ev) && ev.time <= horizon) {
+        double now = ev.time;
+        if (ev.type == EVENT_ARRIVAL) {
+            visits++;
+            if (!virtual_office_arrive(&office, ev.student, now)) {
+                closed_office_think(&office, ev.student, now);
+            }
+        } else if (ev.type == EVENT_RENEGE) {
+            if (virtual_office_renege(&office, &ev, now)) {
+                closed_office_think(&office, ev.student, now);
+            }
+        } else if (ev.type != EVENT_SERVICE_DONE) {
+            virtual_office_break(&office, &ev, now);
+        } else {
+            int ta = office.student_ta[ev.student];
+            const int* session = &office.sessions[ta * closed.batch_size];
+            for (int i = 0; i < office.session_size[ta]; i++) {
+                completed++;
+                response_total += now - office.seated_at[session[i]];
+                closed_office_think(&office, session[i], now);
+            }
+            virtual_office_finish(&office, ev.student, now);
+        }
+    }
+
+    // Sessions still running at the horizon only count up to it
+    double busy_time = office.busy_time;
+    for (int ta = 0; ta < closed.num_tas; ta++) {
+        if (office.ta_busy[ta] && office.ta_free_at[ta] > horizon) busy_time -= office.ta_free_at[ta] - horizon;
+    }
+    int warmup = mser5_truncation(office.waits, office.served);
+    result->population = population;
+    result->visits = visits;
+    result->completed = completed;
+    result->throughput = completed / horizon;
+    result->utilization = busy_time / (horizon * closed.num_tas);
+    result->steady_mean_wait = mean_of(office.waits + warmup, office.served - warmup);
+    result->mean_response = completed > 0 ? response_total / completed : 0.0;
+    result->balk_fraction = visits > 0 ? (double)office.balked / visits : 0.0;
+    result->abandon_fraction = visits > 0 ? (double)office.abandoned / visits : 0.0;
+    virtual_office_free(&office);
+    arena_reset(&replication_arena);
+}
+
+int run_closed_experiment(const struct sim_config* cfg) {
+    uint64_t seed = replication_seed(cfg->seed, 0);
+    struct closed_result result;
+    printf("Closed population: think time exp(%.4g) s, horizon %.4g s, %d TA(s), %d chairs, seed %llu\n",
+           cfg->think_mean, cfg->closed_horizon, cfg->num_tas, cfg->max_chairs, (unsigned long long)cfg->seed);
+
+    if (!cfg->population_sweep) {
+        run_closed_replication(cfg, cfg->num_students, seed, &result);
+        printf("%-34s %d\n", "Students:", result.population);
+        printf("%-34s %d started, %d consultations completed\n", "Visits:", result.visits, result.completed);
+        printf("%-34s %.4f students/s\n", "Throughput:", result.throughput);
+        printf("%-34s %.4f\n", "TA utilization:", result.utilization);
+        printf("%-34s %.4f s\n", "Mean wait (steady state):", result.steady_mean_wait);
+        printf("%-34s %.4f s\n", "Mean response (wait + consult):", result.mean_response);
+        printf("%-34s %.4f\n", "Fraction of visits balked:", result.balk_fraction);
+        if (cfg->patience_mean > 0.0) {
+            printf("%-34s %.4f\n", "Fraction of visits abandoned:", result.abandon_fraction);
+        }
+        return 0;
+    }
+
+    // Sweep the population in about 20 steps up to num_students; every size shares the seed (CRN)
+    int step = cfg->num_students > 20 ? cfg->num_students / 20 : 1;
+    int points = 0;
+    struct closed_result* sweep = malloc((cfg->num_students / step + 1) * sizeof(struct closed_result));
+    if (sweep == NULL) {
+        perror("Failed to allocate memory for the population sweep");
+        return 1;
+    }
+    printf("\n%10s %12s %8s %10s %12s %8s\n", "students", "throughput", "util", "wait (s)", "response (s)", "balked");
+    double peak = 0.0;
+    for (int n = step; n <= cfg->num_students; n += step) {
+        run_closed_replication(cfg, n, seed, &sweep[points]);
+        struct closed_result* r = &sweep[points++];
+        printf("%10d %12.4f %8.3f %10.3f %12.3f %7.1f%%\n", n, r->throughput, r->utilization, r->steady_mean_wait,
+               r->mean_response, 100.0 * r->balk_fraction);
+        if (r->throughput > peak) peak = r->throughput;
+    }
+
+    // Asymptotic bounds: throughput <= min(N / (S + Z), c / S), which cross at N*
+    double service = mean_service_time(cfg) / batch_speedup(cfg);
+    printf("\nAsymptotic saturation point N* = c (S + Z) / S: %.1f students\n",
+           cfg->num_tas * (service + cfg->think_mean) / service);
+    for (int i = 0; i < points; i++) {
+        if (sweep[i].throughput >= 0.9 * peak) {
+            printf("Observed knee: throughput reaches 90%% of its peak (%.4f students/s) at %d students\n", peak,
+                   sweep[i].population);
+            break;
+        }
+    }
+    free(sweep);
+    return 0;
+}
+
+// --- Office Network ---
+// Several offices, each with its own TAs and chairs, share one event calendar (a
+// Jackson-style network). Students arrive at office 0; after a consultation at
+// office i a student walks on to office j with probability office_routing[i][j],
+// arriving travel_time later, or leaves. A student who finds no chair or gives up
+// at any office leaves the network. Each office draws from its own seed, and a
+// student's n-th visit to an office from visit_seed, so revisits bring fresh demand.
+
+// Seed of office i; office 0 keeps the replication seed, so a one-office network matches the open run
+uint64_t network_office_seed(uint64_t seed, int office) {
+    return office == 0 ? seed : mix64(seed ^ (0xD1B54A32D192ED03ULL * (uint64_t)office));
+}
+
+// Expected visits per student to each office from the traffic equations v = e0 + v P.
+// Returns 1 if they do not converge, i.e. some students would never leave.
+int network_visit_ratios(const struct sim_config* cfg, double* visits) {
+    int n = cfg->num_offices;
+    double next[MAX_OFFICES];
+    for (int j = 0; j < n; j++) visits[j] = j == 0 ? 1.0 : 0.0;
+    for (int iteration = 0; iteration < 100000; iteration++) {
+        double change = 0.0;
+        for (int j = 0; j < n; j++) {
+            next[j] = j == 0 ? 1.0 : 0.0;
+            for (int i = 0; i < n; i++) next[j] += visits[i] * cfg->office_routing[i][j];
+            change = fmax(change, fabs(next[j] - visits[j]));
+        }
+        memcpy(visits, next, n * sizeof(double));
+        if (change < 1e-12) return 0;
+    }
+    return 1;
+}
+
+// Office a student walks on to after a consultation at `from`, or -1 if they leave
+int network_next_office(const struct sim_config* cfg, int from, uint64_t seed, int student) {
+    struct rng_stream network_stream;
+    rng_stream_init(&network_stream, seed, NETWORK_STREAM, student, 0);
+    double u = rng_uniform(&network_stream);
+    for (int j = 0; j < cfg->num_offices; j++) {
+        u -= cfg->office_routing[from][j];
+        if (u < 0.0) return j;
+    }
+    return -1;
+}
+
+// Students leaving an office after a consultation, for another office or (office -1)
+// out of the network. Collected while an office is simulated and delivered afterwards.
+struct network_transfer {
+    double time;
+    int office;
+    int student;
+};
+
+struct network_outbox {
+    struct network_transfer* items;
+    int count, capacity;
+};
+
+void network_outbox_add(struct network_outbox* outbox, double time, int office, int student) {
+    if (outbox->count == outbox->capacity) {
+        outbox->capacity = outbox->capacity ? outbox->capacity * 2 : 64;
+        outbox->items = realloc(outbox->items, outbox->capacity * sizeof(struct network_transfer));
+        if (outbox->items == NULL) {
+            perror("Failed to grow office transfer list");
+            exit(1);
+        }
+    }
+    outbox->items[outbox->count++] = (struct network_transfer){ time, office, student };
+}
+
+// Every statistic is kept per office or per student, so offices simulated on
+// different threads never write the same memory
+struct office_network {
+    const struct sim_config* cfg;
+    struct sim_config office_cfg[MAX_OFFICES];
+    struct virtual_office offices[MAX_OFFICES];
+    int arrivals[MAX_OFFICES], completed[MAX_OFFICES];
+    double sojourn_total[MAX_OFFICES];
+    double last_event[MAX_OFFICES];
+    double* entered; // When each student arrived at office 0
+    double* sojourn; // End-to-end sojourn of each student who left after a consultation, -1: lost or still inside
+};
+
+void office_network_init(struct office_network* net, const struct sim_config* cfg, uint64_t seed) {
+    int students = cfg->num_students;
+    memset(net, 0, sizeof(*net));
+    net->cfg = cfg;
+    net->entered = malloc((students + 1) * sizeof(double));
+    net->sojourn = malloc((students + 1) * sizeof(double));
+    if (net->entered == NULL || net->sojourn == NULL) {
+        perror("Failed to allocate office-network state");
+        exit(1);
+    }
+    for (int i = 0; i < cfg->num_offices; i++) {
+        struct sim_config* office_cfg = &net->office_cfg[i];
+        *office_cfg = *cfg;
+        office_cfg->num_tas = cfg->offices[i].num_tas;
+        office_cfg->max_chairs = cfg->offices[i].max_chairs;
+        if (cfg->offices[i].service_mean > 0.0) {
+            office_cfg->service_dist = DIST_EXPONENTIAL;
+            office_cfg->service_mean = cfg->offices[i].service_mean;
+        }
+        virtual_office_init(&net->offices[i], office_cfg, office_cfg->max_chairs, network_office_seed(seed, i), 0,
+                            malloc(students * sizeof(double)), NULL, NULL, NULL);
+        net->offices[i].index = i;
+        net->offices[i].waits_capacity = students; // Revisits can outnumber the students
+        net->offices[i].visits = calloc(students + 1, sizeof(int));
+        if (net->offices[i].waits == NULL || net->offices[i].visits == NULL) {
+            perror("Failed to allocate office-network state");
+            exit(1);
+        }
+    }
+    draw_arrival_times(cfg, seed, 0, net->entered);
+    for (int id = 0; id <= students; id++) {
+        net->sojourn[id] = -1.0;
+    }
+}
+
+// Call once every office's calendar is in place
+void office_network_admit(struct office_network* net) {
+    for (int id = 1; id <= net->cfg->num_students; id++) {
+        virtual_office_push(&net->offices[0], net->entered[id], EVENT_ARRIVAL, id);
+    }
+}
+
+void office_network_free(struct office_network* net) {
+    for (int i = 0; i < net->cfg->num_offices; i++) {
+        virtual_office_free(&net->offices[i]);
+    }
+    free(net->entered);
+    free(net->sojourn);
+}
+
+// Handles one event of office i; students who walk on or leave are added to the outbox
+void office_network_handle(struct office_network* net, int i, const struct event* ev, struct network_outbox* outbox) {
+    struct virtual_office* office = &net->offices[i];
+    double now = ev->time;
+    net->last_event[i] = now;
+    if (ev->type == EVENT_ARRIVAL) {
+        net->arrivals[i]++;
+        if (!virtual_office_arrive(office, ev->student, now)) {
+            office->visits[ev->student]++; // Lost to the network
+        }
+    } else if (ev->type == EVENT_RENEGE) {
+        if (virtual_office_renege(office, ev, now)) {
+            office->visits[ev->student]++;
+        }
+    } else {
+        // EVENT_SERVICE_DONE (offices in a network take no breaks): route every student of the session
+        int ta = office->student_ta[ev->student];
+        const int* session = &office->sessions[ta * office->cfg->batch_size];
+        for (int k = 0; k < office->session_size[ta]; k++) {
+            int student = session[k];
+            int next = network_next_office(net->cfg, i, virtual_office_seed(office, student), student);
+            net->completed[i]++;
+            net->sojourn_total[i] += now - office->seated_at[student];
+            office->visits[student]++;
+            network_outbox_add(outbox, next < 0 ? now : now + net->cfg->travel_time, next, student);
+        }
+        virtual_office_finish(office, ev->student, now);
+    }
+}
+
+struct network_engine_stats {
+    double wall;         // Seconds of wall clock
+    long processed;      // Events handled, including any later rolled back
+    int windows;         // Conservative: synchronisation windows
+    long rolled_back;    // Optimistic: events undone
+    long rollbacks, anti_messages;
+    int gvt_rounds;
+};
+
+void office_network_deliver(struct office_network* net, const struct network_transfer* transfer) {
+    if (transfer->office < 0) {
+        net->sojourn[transfer->student] = transfer->time - net->entered[transfer->student];
+    } else {
+        virtual_office_push(&net->offices[transfer->office], transfer->time, EVENT_ARRIVAL, transfer->student);
+    }
+}
+
+// Sequential engine: every office shares one calendar. Returns the number of events.
+long office_network_run_sequential(struct office_network* net) {
+    long handled = 0;
+    struct event_queue events = { .kind = net->cfg->calendar };
+    struct network_outbox outbox = { 0 };
+    for (int i = 0; i < net->cfg->num_offices; i++) {
+        net->offices[i].events = &events;
+    }
+    office_network_admit(net);
+    struct event ev;
+    while (event_queue_pop(&events, &ev)) {
+        office_network_handle(net, ev.office, &ev, &outbox);
+        handled++;
+        for (int t = 0; t < outbox.count; t++) {
+            office_network_deliver(net, &outbox.items[t]);
+        }
+        outbox.count = 0;
+    }
+    free(outbox.items);
+    event_queue_free(&events);
+    return handled;
+}
+
+// Longest-processing-time-first partition of the offices over the threads, on each office's expected load
+void office_network_partition(const struct office_network* net, int threads, int* owner) {
+    const struct sim_config* cfg = net->cfg;
+    double visit_ratio[MAX_OFFICES], load[MAX_OFFICES], work[MAX_OFFICES] = { 0 };
+    network_visit_ratios(cfg, visit_ratio);
+    for (int i = 0; i < cfg->num_offices; i++) {
+        owner[i] = -1;
+        load[i] = visit_ratio[i] * mean_service_time(&net->office_cfg[i]) / batch_speedup(&net->office_cfg[i]);
+    }
+    for (int assigned = 0; assigned < cfg->num_offices; assigned++) {
+        int heaviest = -1, lightest = 0;
+        for (int i = 0; i < cfg->num_offices; i++) {
+            if (owner[i] < 0 && (heaviest < 0 || load[i] > load[heaviest])) heaviest = i;
+        }
+        for (int w = 1; w < threads; w++) {
+            if (work[w] < work[lightest]) lightest = w;
+        }
+        work[lightest] += load[heaviest];
+        owner[heaviest] = lightest;
+    }
+}
+
+// Parallel engine (conservative, windowed): every office keeps its own calendar and
+// each thread owns a subset of the offices. A student walking between offices
+// arrives travel_time after leaving, so once the earliest pending event anywhere
+// is at T, no office can receive anything before T + travel_time: every thread
+// simulates its offices up to that horizon without talking to the others, then
+// all threads meet at a barrier and deliver the students who walked on. Events
+// that tie on time are ordered by type and, for arrivals, by student, so each
+// office sees exactly the sequence the sequential engine gives it.
+struct network_worker {
+    struct office_network* net;
+    int id, num_workers;
+    int offices[MAX_OFFICES], num_offices;
+    const int* owner;                    // Thread owning each office
+    struct network_outbox outbox;
+    struct network_worker* workers;
+    double next_event;                   // Earliest pending event of this thread's offices
+    pthread_barrier_t* barrier;
+    int windows;
+    long events;
+};
+
+void* network_worker_func(void* arg) {
+    struct network_worker* worker = arg;
+    struct office_network* net = worker->net;
+    while (1) {
+        // Take delivery of the students walking to this thread's offices (each thread records its own leavers)
+        for (int w = 0; w < worker->num_workers; w++) {
+            const struct network_outbox* outbox = &worker->workers[w].outbox;
+            for (int t = 0; t < outbox->count; t++) {
+                const struct network_transfer* transfer = &outbox->items[t];
+                if (transfer->office < 0 ? w == worker->id : worker->owner[transfer->office] == worker->id) {
+                    office_network_deliver(net, transfer);
+                }
+            }
+        }
+        worker->next_event = INFINITY;
+        for (int k = 0; k < worker->num_offices; k++) {
+            const struct event* next = event_queue_peek(net->offices[worker->offices[k]].events);
+            if (next != NULL) worker->next_event = fmin(worker->next_event, next->time);
+        }
+        pthread_barrier_wait(worker->barrier);
+
+        // Every thread works out the same horizon
+        double start = INFINITY;
+        for (int w = 0; w < worker->num_workers; w++) {
+            start = fmin(start, worker->workers[w].next_event);
+        }
+        worker->outbox.count = 0;
+        if (start == INFINITY) {
+            return NULL;
+        }
+        double horizon = start + net->cfg->travel_time;
+        worker->windows++;
+        for (int k = 0; k < worker->num_offices; k++) {
+            int i = worker->offices[k];
+            struct event_queue* events = net->offices[i].events;
+            const struct event* next;
+            struct event ev;
+            while ((next = event_queue_peek(events)) != NULL && next->time < horizon) {
+                event_queue_pop(events, &ev);
+                office_network_handle(net, i, &ev, &worker->outbox);
+                worker->events++;
+            }
+        }
+        pthread_barrier_wait(worker->barrier);
+    }
+}
+
+void office_network_run_parallel(struct office_network* net, int threads, struct network_engine_stats* stats) {
+    const struct sim_config* cfg = net->cfg;
+    struct network_worker workers[MAX_OFFICES];
+    pthread_t tids[MAX_OFFICES];
+    pthread_barrier_t barrier;
+    int owner[MAX_OFFICES];
+
+    memset(workers, 0, sizeof(workers));
+    office_network_partition(net, threads, owner);
+    for (int i = 0; i < cfg->num_offices; i++) {
+        workers[owner[i]].offices[workers[owner[i]].num_offices++] = i;
+    }
+
+    office_network_admit(net);
+    pthread_barrier_init(&barrier, NULL, threads);
+    for (int w = 0; w < threads; w++) {
+        workers[w].net = net;
+        workers[w].id = w;
+        workers[w].num_workers = threads;
+        workers[w].owner = owner;
+        workers[w].workers = workers;
+        workers[w].barrier = &barrier;
+        if (pthread_create(&tids[w], NULL, network_worker_func, &workers[w]) != 0) {
+            perror("Failed to create network worker thread");
+            exit(1);
+        }
+    }
+    for (int w = 0; w < threads; w++) {
+        pthread_join(tids[w], NULL);
+        free(workers[w].outbox.items);
+        stats->processed += workers[w].events;
+    }
+    pthread_barrier_destroy(&barrier);
+    stats->windows = workers[0].windows;
+}
+
+// Optimistic engine (Time Warp): every office runs ahead on its own thread's
+// schedule, assuming no student will walk in before its next event. When one does
+// (a straggler), the office rolls back to the state saved before the first event it
+// got wrong, cancels every student it sent on since with an anti-message (which may
+// roll the receiver back in turn) and carries on. Every so often all threads agree
+// on the global virtual time (GVT), the earliest time anything can still change:
+// what happened before it is committed, and the saved states, sent students and
+// received students it needed are freed (fossil collection). Unlike the
+// conservative engine it needs no lookahead, so it also runs --travel-time 0.
+//
+// The state is saved before every event, but only the part one event can change:
+// the office's TAs, waiting rooms and calendar (bounded by its TAs and chairs) and
+// the records of the students involved, i.e. the event's own student and everyone
+// in a waiting room or a session. A save therefore costs the same however many
+// students the run has.
+#define TIME_WARP_GVT_INTERVAL 4096 // Events a thread processes between GVT rounds
+
+// A student walking in (sign +1), or the anti-message cancelling one (sign -1)
+struct time_warp_message {
+    double time;
+    int student;
+    int sign;
+};
+
+// Header of a saved state; the office state and student records follow it
+struct time_warp_save {
+    struct event next; // The event about to be processed
+    struct event last; // The one processed before it
+    int sent;          // Length of the sent log at that point
+    size_t records;    // Offset of the student records within the save
+};
+
+struct time_warp_office {
+    pthread_mutex_t lock; // Guards the mailbox
+    struct time_warp_message* mailbox;
+    int mailbox_count, mailbox_capacity;
+    struct time_warp_message* delivered; // The mailbox's previous buffer, swapped out to be read without the lock
+    int delivered_capacity;
+    struct time_warp_message* input; // Students who walked in from other offices, in (time, student) order
+    int input_count, input_capacity;
+    int input_next;                  // First one not yet processed
+    int external_next;               // Office 0: next arrival from outside, in (time, student) order
+    struct network_outbox sent;      // Everything sent by events not yet committed
+    char* saves;                     // Saved states, oldest first
+    size_t saves_size, saves_capacity;
+    size_t* save_offsets;
+    int save_count, save_offsets_capacity;
+    struct event last;               // Last event processed
+    long processed, rolled_back, rollbacks, anti_messages;
+};
+
+struct time_warp_engine {
+    struct office_network* net;
+    struct time_warp_office offices[MAX_OFFICES];
+    struct time_warp_message* external; // Arrivals at office 0 from outside, in (time, student) order
+    int owner[MAX_OFFICES];
+    int threads;
+    int gvt_requested;
+    double local_min[MAX_OFFICES];   // Per thread, during a GVT round
+    pthread_barrier_t barrier;
+    int gvt_rounds;
+};
+
+struct time_warp_worker {
+    struct time_warp_engine* engine;
+    int id;
+    struct network_outbox outbox;    // Scratch for the event being handled
+    double gvt;                      // As of the last GVT round
+};
+
+int message_before(double time_a, int student_a, double time_b, int student_b) {
+    return time_a != time_b ? time_a < time_b : student_a < student_b;
+}
+
+// A student's arrival as an event, to compare it with the office's own events
+struct event arrival_event(double time, int student, int office) {
+    struct event ev = { time, EVENT_ARRIVAL, student, 0, office };
+    return ev;
+}
+
+// Copies bytes from field to data + *offset, or back when restoring; only measures when data is NULL
+void state_copy(char* data, size_t* offset, void* field, size_t bytes, int restore) {
+    if (data != NULL) {
+        if (restore) memcpy(field, data + *offset, bytes);
+        else memcpy(data + *offset, field, bytes);
+    }
+    *offset += bytes;
+}
+
+// Everything of office i one event can change, except the student records
+void time_warp_office_state(struct office_network* net, int i, char* data, size_t* offset, int restore) {
+    struct virtual_office* office = &net->offices[i];
+    const struct sim_config* cfg = office->cfg;
+    int tas = cfg->num_tas;
+    if (data != NULL && restore) {
+        // Arrays are restored in place, so keep the live allocations
+        struct virtual_office live = *office;
+        memcpy(office, data + *offset, sizeof(*office));
+        office->waits = live.waits;
+        office->waits_capacity = live.waits_capacity;
+        office->own_events = live.own_events;
+        office->events = live.events;
+        *offset += sizeof(*office);
+    } else {
+        state_copy(data, offset, office, sizeof(*office), 0);
+    }
+    state_copy(data, offset, &net->arrivals[i], sizeof(int), restore);
+    state_copy(data, offset, &net->completed[i], sizeof(int), restore);
+    state_copy(data, offset, &net->sojourn_total[i], sizeof(double), restore);
+    state_copy(data, offset, &net->last_event[i], sizeof(double), restore);
+    state_copy(data, offset, office->ta_busy, tas * sizeof(int), restore);
+    state_copy(data, offset, office->ta_free_at, tas * sizeof(double), restore);
+    state_copy(data, offset, office->idle_since, tas * sizeof(double), restore);
+    state_copy(data, offset, office->break_pending, tas * sizeof(int), restore);
+    state_copy(data, offset, office->session_size, tas * sizeof(int), restore);
+    state_copy(data, offset, office->sessions, tas * cfg->batch_size * sizeof(int), restore);
+    for (int q = 0; q < office->num_queues; q++) {
+        struct waiting_room* room = &office->rooms[q];
+        state_copy(data, offset, &room->size, sizeof(int), restore);
+        state_copy(data, offset, &room->occupied, sizeof(int), restore);
+        state_copy(data, offset, &room->next_seq, sizeof(uint64_t), restore);
+        state_copy(data, offset, room->heap, room->size * sizeof(struct waiting_entry), restore);
+    }
+    struct event_queue* events = &office->own_events;
+    state_copy(data, offset, &events->next_seq, sizeof(uint64_t), restore);
+    state_copy(data, offset, &events->size, sizeof(int), restore);
+    if (events->size > events->capacity) {
+        events->capacity = events->size;
+        events->heap = realloc(events->heap, events->capacity * sizeof(struct event));
+        if (events->heap == NULL) {
+            perror("Failed to grow event queue");
+            exit(1);
+        }
+    }
+    state_copy(data, offset, events->heap, events->size * sizeof(struct event), restore);
+}
+
+// One student's record at office i
+void time_warp_student_record(struct virtual_office* office, int student, char* data, size_t* offset, int restore) {
+    if (restore) *offset += sizeof(int);
+    else state_copy(data, offset, &student, sizeof(int), 0);
+    state_copy(data, offset, &office->student_ta[student], sizeof(int), restore);
+    state_copy(data, offset, &office->student_room[student], sizeof(int), restore);
+    state_copy(data, offset, &office->visits[student], sizeof(int), restore);
+    state_copy(data, offset, &office->seated_at[student], sizeof(double), restore);
+    state_copy(data, offset, &office->renege_timer[student], sizeof(uint64_t), restore);
+    for (int q = 0; q < office->num_queues; q++) {
+        state_copy(data, offset, &office->rooms[q].status[student], 1, restore);
+        state_copy(data, offset, &office->rooms[q].latest_seq[student], sizeof(uint64_t), restore);
+    }
+}
+
+// Records of every student the event can touch: its own, and everyone seated or in a session
+void time_warp_save_students(struct virtual_office* office, int student, char* data, size_t* offset) {
+    const struct sim_config* cfg = office->cfg;
+    time_warp_student_record(office, student, data, offset, 0);
+    for (int q = 0; q < office->num_queues; q++) {
+        for (int e = 0; e < office->rooms[q].size; e++) {
+            time_warp_student_record(office, office->rooms[q].heap[e].student, data, offset, 0);
+        }
+    }
+    for (int ta = 0; ta < cfg->num_tas; ta++) {
+        for (int k = 0; k < office->session_size[ta]; k++) {
+            time_warp_student_record(office, office->sessions[ta * cfg->batch_size + k], data, offset, 0);
+        }
+    }
+}
+
+void time_warp_save(struct time_warp_engine* engine, int i, const struct event* next) {
+    struct time_warp_office* lp = &engine->offices[i];
+    struct virtual_office* office = &engine->net->offices[i];
+    struct time_warp_save header = { *next, lp->last, lp->sent.count, 0 };
+    size_t size = sizeof(header);
+    time_warp_office_state(engine->net, i, NULL, &size, 0);
+    header.records = size;
+    time_warp_save_students(office, next->student, NULL, &size);
+
+    if (lp->saves_size + size > lp->saves_capacity) {
+        lp->saves_capacity = 2 * (lp->saves_size + size);
+        lp->saves = realloc(lp->saves, lp->saves_capacity);
+    }
+    if (lp->save_count == lp->save_offsets_capacity) {
+        lp->save_offsets_capacity = lp->save_offsets_capacity ? 2 * lp->save_offsets_capacity : 256;
+        lp->save_offsets = realloc(lp->save_offsets, lp->save_offsets_capacity * sizeof(size_t));
+    }
+    if (lp->saves == NULL || lp->save_offsets == NULL) {
+        perror("Failed to allocate saved office states");
+        exit(1);
+    }
+    char* data = lp->saves + lp->saves_size;
+    size_t offset = sizeof(header);
+    memcpy(data, &header, sizeof(header));
+    time_warp_office_state(engine->net, i, data, &offset, 0);
+    time_warp_save_students(office, next->student, data, &offset);
+    lp->save_offsets[lp->save_count++] = lp->saves_size;
+    lp->saves_size += size;
+}
+
+const struct time_warp_save* time_warp_save_at(const struct time_warp_office* lp, int s) {
+    return (const struct time_warp_save*)(lp->saves + lp->save_offsets[s]);
+}
+
+void time_warp_send(struct time_warp_office* lp, double time, int student, int sign) {
+    pthread_mutex_lock(&lp->lock);
+    if (lp->mailbox_count == lp->mailbox_capacity) {
+        lp->mailbox_capacity = lp->mailbox_capacity ? 2 * lp->mailbox_capacity : 64;
+        lp->mailbox = realloc(lp->mailbox, lp->mailbox_capacity * sizeof(struct time_warp_message));
+        if (lp->mailbox == NULL) {
+            perror("Failed to grow office mailbox");
+            exit(1);
+        }
+    }
+    lp->mailbox[lp->mailbox_count++] = (struct time_warp_message){ time, student, sign };
+    pthread_mutex_unlock(&lp->lock);
+}
+
+// First input message not before the event
+int time_warp_input_bound(const struct time_warp_office* lp, const struct event* ev) {
+    int low = 0, high = lp->input_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        struct event arrival = arrival_event(lp->input[mid].time, lp->input[mid].student, ev->office);
+        if (event_before(&arrival, ev)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+int time_warp_external_bound(const struct time_warp_engine* engine, const struct event* ev) {
+    int low = 0, high = engine->net->cfg->num_students;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        struct event arrival = arrival_event(engine->external[mid].time, engine->external[mid].student, 0);
+        if (event_before(&arrival, ev)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Undoes every event of office i from the first one not before ev
+void time_warp_rollback(struct time_warp_engine* engine, int i, const struct event* ev) {
+    struct time_warp_office* lp = &engine->offices[i];
+    struct virtual_office* office = &engine->net->offices[i];
+    int target = lp->save_count - 1;
+    while (target > 0 && !event_before(&time_warp_save_at(lp, target - 1)->next, ev)) target--;
+
+    // Student records newest first, then the office as it was before the target event
+    for (int s = lp->save_count - 1; s >= target; s--) {
+        const struct time_warp_save* save = time_warp_save_at(lp, s);
+        size_t end = s + 1 < lp->save_count ? lp->save_offsets[s + 1] : lp->saves_size;
+        size_t offset = save->records;
+        while (lp->save_offsets[s] + offset < end) {
+            int student;
+            memcpy(&student, (const char*)save + offset, sizeof(int));
+            time_warp_student_record(office, student, (char*)save, &offset, 1);
+        }
+    }
+    const struct time_warp_save* save = time_warp_save_at(lp, target);
+    size_t offset = sizeof(*save);
+    time_warp_office_state(engine->net, i, (char*)save, &offset, 1);
+
+    // Cancel what the undone events sent on
+    for (int t = save->sent; t < lp->sent.count; t++) {
+        const struct network_transfer* transfer = &lp->sent.items[t];
+        if (transfer->office >= 0) {
+            time_warp_send(&engine->offices[transfer->office], transfer->time, transfer->student, -1);
+            lp->anti_messages++;
+        }
+    }
+    lp->sent.count = save->sent;
+    lp->last = save->last;
+    lp->input_next = time_warp_input_bound(lp, &save->next);
+    if (i == 0) lp->external_next = time_warp_external_bound(engine, &save->next);
+    lp->rolled_back += lp->save_count - target;
+    lp->rollbacks++;
+    lp->saves_size = lp->save_offsets[target];
+    lp->save_count = target;
+}
+
+// Delivers office i's mail: students walking in, rolling back if they are stragglers, and anti-messages.
+// Returns the earliest time in it, INFINITY if there was none.
+double time_warp_receive(struct time_warp_engine* engine, int i) {
+    struct time_warp_office* lp = &engine->offices[i];
+    pthread_mutex_lock(&lp->lock);
+    int count = lp->mailbox_count, capacity = lp->mailbox_capacity;
+    struct time_warp_message* mail = lp->mailbox;
+    if (count > 0) {
+        lp->mailbox = lp->delivered;
+        lp->mailbox_capacity = lp->delivered_capacity;
+        lp->mailbox_count = 0;
+        lp->delivered = mail;
+        lp->delivered_capacity = capacity;
+    }
+    pthread_mutex_unlock(&lp->lock);
+
+    double earliest = INFINITY;
+    for (int m = 0; m < count; m++) {
+        struct event arrival = arrival_event(mail[m].time, mail[m].student, i);
+        earliest = fmin(earliest, mail[m].time);
+        if (mail[m].sign > 0) {
+            if (event_before(&arrival, &lp->last)) {
+                time_warp_rollback(engine, i, &arrival);
+            }
+            if (lp->input_count == lp->input_capacity) {
+                lp->input_capacity = lp->input_capacity ? 2 * lp->input_capacity : 64;
+                lp->input = realloc(lp->input, lp->input_capacity * sizeof(struct time_warp_message));
+                if (lp->input == NULL) {
+                    perror("Failed to grow office input");
+                    exit(1);
+                }
+            }
+            int at = time_warp_input_bound(lp, &arrival);
+            memmove(&lp->input[at + 1], &lp->input[at], (lp->input_count - at) * sizeof(struct time_warp_message));
+            lp->input[at] = mail[m];
+            lp->input_count++;
+        } else {
+            // The positive message was sent first through the same mailbox, so it is here
+            int at = time_warp_input_bound(lp, &arrival);
+            if (at < lp->input_next) {
+                time_warp_rollback(engine, i, &arrival);
+            }
+            memmove(&lp->input[at], &lp->input[at + 1], (lp->input_count - at - 1) * sizeof(struct time_warp_message));
+            lp->input_count--;
+        }
+    }
+    return earliest;
+}
+
+// The next event of office i (calendar, students walking in, or arrivals from outside); 0 if there is none
+int time_warp_next(const struct time_warp_engine* engine, int i, struct event* next, int* source) {
+    const struct time_warp_office* lp = &engine->offices[i];
+    const struct event* head = event_queue_peek(engine->net->offices[i].events);
+    *source = -1;
+    if (head != NULL) {
+        *next = *head;
+        *source = 0;
+    }
+    if (lp->input_next < lp->input_count) {
+        struct event arrival = arrival_event(lp->input[lp->input_next].time, lp->input[lp->input_next].student, i);
+        if (*source < 0 || event_before(&arrival, next)) {
+            *next = arrival;
+            *source = 1;
+        }
+    }
+    if (i == 0 && lp->external_next < engine->net->cfg->num_students) {
+        const struct time_warp_message* external = &engine->external[lp->external_next];
+        struct event arrival = arrival_event(external->time, external->student, 0);
+        if (*source < 0 || event_before(&arrival, next)) {
+            *next = arrival;
+            *source = 2;
+        }
+    }
+    return *source >= 0;
+}
+
+void time_warp_step(struct time_warp_worker* worker, int i) {
+    struct time_warp_engine* engine = worker->engine;
+    struct time_warp_office* lp = &engine->offices[i];
+    struct event ev;
+    int source;
+    time_warp_next(engine, i, &ev, &source);
+    time_warp_save(engine, i, &ev);
+    if (source == 0) event_queue_pop(engine->net->offices[i].events, &ev);
+    else if (source == 1) lp->input_next++;
+    else lp->external_next++;
+
+    worker->outbox.count = 0;
+    office_network_handle(engine->net, i, &ev, &worker->outbox);
+    for (int t = 0; t < worker->outbox.count; t++) {
+        const struct network_transfer* transfer = &worker->outbox.items[t];
+        network_outbox_add(&lp->sent, transfer->time, transfer->office, transfer->student);
+        if (transfer->office >= 0) {
+            time_warp_send(&engine->offices[transfer->office], transfer->time, transfer->student, +1);
+        }
+    }
+    lp->last = ev;
+    lp->processed++;
+}
+
+// Commits everything office i did before the GVT and frees what only a rollback past it would need
+void time_warp_fossil_collect(struct time_warp_engine* engine, int i, double gvt) {
+    struct time_warp_office* lp = &engine->offices[i];
+    int kept = 0;
+    while (kept < lp->save_count && time_warp_save_at(lp, kept)->next.time < gvt) kept++;
+    int committed = kept < lp->save_count ? time_warp_save_at(lp, kept)->sent : lp->sent.count;
+    int consumed = kept < lp->save_count ? time_warp_input_bound(lp, &time_warp_save_at(lp, kept)->next)
+                                         : lp->input_next;
+
+    for (int t = 0; t < committed; t++) {
+        if (lp->sent.items[t].office < 0) office_network_deliver(engine->net, &lp->sent.items[t]);
+    }
+    memmove(lp->sent.items, lp->sent.items + committed, (lp->sent.count - committed) * sizeof(struct network_transfer));
+    lp->sent.count -= committed;
+    memmove(lp->input, lp->input + consumed, (lp->input_count - consumed) * sizeof(struct time_warp_message));
+    lp->input_count -= consumed;
+    lp->input_next -= consumed;
+
+    if (kept == 0) return;
+    size_t dropped = kept < lp->save_count ? lp->save_offsets[kept] : lp->saves_size;
+    memmove(lp->saves, lp->saves + dropped, lp->saves_size - dropped);
+    lp->saves_size -= dropped;
+    for (int s = kept; s < lp->save_count; s++) {
+        lp->save_offsets[s - kept] = lp->save_offsets[s] - dropped;
+        ((struct time_warp_save*)(lp->saves + lp->save_offsets[s - kept]))->sent -= committed;
+    }
+    lp->save_count -= kept;
+}
+
+// All threads stop, take in their mail and agree on the GVT; returns 1 once nothing is left to simulate
+int time_warp_gvt_round(struct time_warp_worker* worker) {
+    struct time_warp_engine* engine = worker->engine;
+    pthread_barrier_wait(&engine->barrier);
+    double local_min = INFINITY;
+    for (int i = 0; i < engine->net->cfg->num_offices; i++) {
+        struct event next;
+        int source;
+        if (engine->owner[i] != worker->id) continue;
+        // An anti-message leaves no event behind, but the rollback it caused may have sent
+        // anti-messages of its own, as early as itself, after their receivers took in their mail
+        local_min = fmin(local_min, time_warp_receive(engine, i));
+        if (time_warp_next(engine, i, &next, &source)) local_min = fmin(local_min, next.time);
+    }
+    engine->local_min[worker->id] = local_min;
+    if (worker->id == 0) {
+        __atomic_store_n(&engine->gvt_requested, 0, __ATOMIC_RELEASE);
+        engine->gvt_rounds++;
+    }
+    pthread_barrier_wait(&engine->barrier);
+
+    // Mail sent during the round (anti-messages from rollbacks) is for times no earlier than its sender's minimum,
+    // which covers the mail that caused the rollback
+    double gvt = INFINITY;
+    for (int w = 0; w < engine->threads; w++) {
+        gvt = fmin(gvt, engine->local_min[w]);
+    }
+    for (int i = 0; i < engine->net->cfg->num_offices; i++) {
+        if (engine->owner[i] == worker->id) time_warp_fossil_collect(engine, i, gvt);
+    }
+    worker->gvt = gvt;
+    return gvt == INFINITY;
+}
+
+void* time_warp_worker_func(void* arg) {
+    struct time_warp_worker* worker = arg;
+    struct time_warp_engine* engine = worker->engine;
+    int since_round = 0, idle = 0;
+    while (1) {
+        if (__atomic_load_n(&engine->gvt_requested, __ATOMIC_ACQUIRE)) {
+            if (time_warp_gvt_round(worker)) return NULL;
+            since_round = 0;
+            continue;
+        }
+        // Smallest timestamp first among this thread's offices, no further than the optimism window past the GVT
+        double horizon = worker->gvt + engine->net->cfg->optimism_window;
+        int best = -1;
+        struct event best_next = { 0 };
+        for (int i = 0; i < engine->net->cfg->num_offices; i++) {
+            struct event next;
+            int source;
+            if (engine->owner[i] != worker->id) continue;
+            time_warp_receive(engine, i);
+            if (time_warp_next(engine, i, &next, &source) && next.time <= horizon &&
+                (best < 0 || event_before(&next, &best_next))) {
+                best = i;
+                best_next = next;
+            }
+        }
+        if (best < 0) {
+            // Nothing to do until mail arrives; ask for a GVT round to find out whether the run is over
+            if (++idle > 64) {
+                __atomic_store_n(&engine->gvt_requested, 1, __ATOMIC_RELEASE);
+                idle = 0;
+            }
+            sched_yield();
+            continue;
+        }
+        idle = 0;
+        time_warp_step(worker, best);
+        if (++since_round >= TIME_WARP_GVT_INTERVAL) {
+            __atomic_store_n(&engine->gvt_requested, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+int compare_messages(const void* a, const void* b) {
+    const struct time_warp_message* x = a;
+    const struct time_warp_message* y = b;
+    return message_before(x->time, x->student, y->time, y->student) ? -1 :
+           message_before(y->time, y->student, x->time, x->student);
+}
+
+void office_network_run_optimistic(struct office_network* net, int threads, struct network_engine_stats* stats) {
+    const struct sim_config* cfg = net->cfg;
+    struct time_warp_engine* engine = calloc(1, sizeof(struct time_warp_engine));
+    struct time_warp_worker workers[MAX_OFFICES];
+    pthread_t tids[MAX_OFFICES];
+    if (engine == NULL ||
+        (engine->external = malloc(cfg->num_students * sizeof(struct time_warp_message))) == NULL) {
+        perror("Failed to allocate the optimistic engine");
+        exit(1);
+    }
+    engine->net = net;
+    engine->threads = threads;
+    for (int id = 1; id <= cfg->num_students; id++) {
+        engine->external[id - 1] = (struct time_warp_message){ net->entered[id], id, +1 };
+    }
+    qsort(engine->external, cfg->num_students, sizeof(struct time_warp_message), compare_messages);
+    office_network_partition(net, threads, engine->owner);
+    for (int i = 0; i < cfg->num_offices; i++) {
+        // A saved state copies the calendar as one array, so it must be a binary heap (still empty:
+        // the students from outside come from engine->external)
+        net->offices[i].own_events.kind = CALENDAR_BINARY_HEAP;
+        pthread_mutex_init(&engine->offices[i].lock, NULL);
+        engine->offices[i].last = arrival_event(-INFINITY, 0, i);
+    }
+
+    pthread_barrier_init(&engine->barrier, NULL, threads);
+    memset(workers, 0, sizeof(workers));
+    for (int w = 0; w < threads; w++) {
+        workers[w].engine = engine;
+        workers[w].id = w;
+        if (pthread_create(&tids[w], NULL, time_warp_worker_func, &workers[w]) != 0) {
+            perror("Failed to create Time Warp worker thread");
+            exit(1);
+        }
+    }
+    for (int w = 0; w < threads; w++) {
+        pthread_join(tids[w], NULL);
+        free(workers[w].outbox.items);
+    }
+    pthread_barrier_destroy(&engine->barrier);
+
+    stats->gvt_rounds = engine->gvt_rounds;
+    for (int i = 0; i < cfg->num_offices; i++) {
+        struct time_warp_office* lp = &engine->offices[i];
+        stats->processed += lp->processed;
+        stats->rolled_back += lp->rolled_back;
+        stats->rollbacks += lp->rollbacks;
+        stats->anti_messages += lp->anti_messages;
+        pthread_mutex_destroy(&lp->lock);
+        free(lp->mailbox);
+        free(lp->delivered);
+        free(lp->input);
+        free(lp->sent.items);
+        free(lp->saves);
+        free(lp->save_offsets);
+    }
+    free(engine->external);
+    free(engine);
+}
+
+// Runs the network on one engine; net must be freshly initialised
+void office_network_run(struct office_network* net, int engine, int threads, struct network_engine_stats* stats) {
+    struct timespec started, finished;
+    memset(stats, 0, sizeof(*stats));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (engine == NETWORK_OPTIMISTIC) {
+        office_network_run_optimistic(net, threads, stats);
+    } else if (engine == NETWORK_CONSERVATIVE) {
+        office_network_run_parallel(net, threads, stats);
+    } else {
+        stats->processed = office_network_run_sequential(net);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats->wall = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+// 1 if two runs of the same network gave the same results, down to every wait and sojourn
+int office_network_same(const struct office_network* a, const struct office_network* b) {
+    for (int i = 0; i < a->cfg->num_offices; i++) {
+        const struct virtual_office* x = &a->offices[i];
+        const struct virtual_office* y = &b->offices[i];
+        if (a->arrivals[i] != b->arrivals[i] || a->completed[i] != b->completed[i] ||
+            a->sojourn_total[i] != b->sojourn_total[i] || a->last_event[i] != b->last_event[i] ||
+            x->served != y->served || x->balked != y->balked || x->abandoned != y->abandoned ||
+            x->busy_time != y->busy_time || memcmp(x->waits, y->waits, x->served * sizeof(double)) != 0) {
+            return 0;
+        }
+    }
+    return memcmp(a->sojourn, b->sojourn, (a->cfg->num_students + 1) * sizeof(double)) == 0;
+}
+
+const char* network_engine_name(int engine) {
+    switch (engine) {
+    case NETWORK_CONSERVATIVE: return "conservative";
+    case NETWORK_OPTIMISTIC: return "optimistic";
+    default: return "sequential";
+    }
+}
+
+void print_network_engine(const struct sim_config* cfg, int engine, int threads, const struct network_engine_stats* stats) {
+    if (engine == NETWORK_CONSERVATIVE) {
+        printf("Engine: conservative, %d threads, %d windows of %.4g s lookahead, %.3f s wall clock\n", threads,
+               stats->windows, cfg->travel_time, stats->wall);
+    } else if (engine == NETWORK_OPTIMISTIC) {
+        printf("Engine: optimistic, %d threads, %ld events processed, %ld rolled back in %ld rollbacks "
+               "(%ld anti-messages), %d GVT rounds, %.3f s wall clock\n", threads, stats->processed,
+               stats->rolled_back, stats->rollbacks, stats->anti_messages, stats->gvt_rounds, stats->wall);
+    } else {
+        printf("Engine: sequential, %.3f s wall clock\n", stats->wall);
+    }
+}
+
+void print_network_report(const struct office_network* net) {
+    const struct sim_config* cfg = net->cfg;
+    int n = cfg->num_offices, students = cfg->num_students;
+
+    // Gather in student order, so every engine sums in the same order
+    int left = 0, lost = 0;
+    double now = 0.0, last_arrival = 0.0;
+    double* sojourns = malloc(students * sizeof(double));
+    if (sojourns == NULL) {
+        perror("Failed to allocate memory for sojourn times");
+        return;
+    }
+    for (int id = 1; id <= students; id++) {
+        if (net->sojourn[id] >= 0.0) sojourns[left++] = net->sojourn[id];
+        last_arrival = fmax(last_arrival, net->entered[id]);
+    }
+    for (int i = 0; i < n; i++) {
+        now = fmax(now, net->last_event[i]);
+        lost += net->offices[i].balked + net->offices[i].abandoned;
+    }
+
+    // Open Jackson network prediction (infinite waiting rooms, so it ignores balking and reneging)
+    double visit_ratio[MAX_OFFICES], lambda = last_arrival > 0.0 ? students / last_arrival : 0.0;
+    network_visit_ratios(cfg, visit_ratio);
+    printf("Office network: %d office(s), %d students, travel time %.4g s, seed %llu\n", n, students,
+           cfg->travel_time, (unsigned long long)cfg->seed);
+    printf("\n%6s %4s %6s %9s %7s %8s %9s %11s %6s %16s %7s\n", "office", "TAs", "chairs", "arrivals", "balked",
+           "gave up", "wait (s)", "sojourn (s)", "util", "visits/student", "load");
+    printf("%74s %8s %7s %7s\n", "", "sim", "jackson", "jackson");
+    for (int i = 0; i < n; i++) {
+        const struct sim_config* office_cfg = &net->office_cfg[i];
+        const struct virtual_office* office = &net->offices[i];
+        double load = lambda * visit_ratio[i] * mean_service_time(office_cfg) /
+                      (batch_speedup(office_cfg) * office_cfg->num_tas);
+        printf("%6d %4d %6d %9d %7d %8d %9.3f %11.3f %6.3f %8.3f %7.3f %7.3f\n", i, office_cfg->num_tas,
+               office_cfg->max_chairs, net->arrivals[i], office->balked, office->abandoned,
+               mean_of(office->waits, office->served),
+               net->completed[i] > 0 ? net->sojourn_total[i] / net->completed[i] : 0.0,
+               now > 0.0 ? office->busy_time / (now * office_cfg->num_tas) : 0.0, (double)net->arrivals[i] / students,
+               visit_ratio[i], load);
+    }
+    printf("\nStudents who finished their last consultation: %d\n", left);
+    printf("Students lost to a full or abandoned office: %d\n", lost);
+    printf("End-to-end sojourn (arrival at office 0 to leaving): mean %.4f s, p50 %.4f s, p95 %.4f s\n",
+           mean_of(sojourns, left), percentile_of(sojourns, left, 0.5), percentile_of(sojourns, left, 0.95));
+    free(sojourns);
+}
+
+struct office_network* office_network_create(const struct sim_config* cfg) {
+    struct office_network* net = malloc(sizeof(struct office_network));
+    if (net == NULL) {
+        perror("Failed to allocate office-network state");
+        exit(1);
+    }
+    office_network_init(net, cfg, replication_seed(cfg->seed, 0));
+    return net;
+}
+
+void office_network_destroy(struct office_network* net) {
+    office_network_free(net);
+    free(net);
+}
+
+int run_network_experiment(const struct sim_config* cfg) {
+    int threads = cfg->network_threads < cfg->num_offices ? cfg->network_threads : cfg->num_offices;
+    int engine = threads > 1 ? cfg->network_engine : NETWORK_SEQUENTIAL;
+    struct network_engine_stats stats;
+    struct office_network* net = office_network_create(cfg);
+    office_network_run(net, engine, threads, &stats);
+    print_network_report(net);
+    print_network_engine(cfg, engine, threads, &stats);
+    if (!cfg->network_benchmark) {
+        office_network_destroy(net);
+        return 0;
+    }
+
+    // Every engine on the same model and seed, checked against the sequential run
+    struct office_network* reference = net;
+    struct network_engine_stats reference_stats = stats;
+    if (engine != NETWORK_SEQUENTIAL) {
+        reference = office_network_create(cfg);
+        office_network_run(reference, NETWORK_SEQUENTIAL, 1, &reference_stats);
+    }
+    printf("\nEngine benchmark (%d threads):\n", threads);
+    printf("%-13s %10s %8s %12s %12s %12s %10s\n", "engine", "wall (s)", "speedup", "sync points", "events",
+           "rolled back", "identical");
+    for (int e = NETWORK_SEQUENTIAL; e <= NETWORK_OPTIMISTIC; e++) {
+        if (e == NETWORK_CONSERVATIVE && cfg->travel_time <= 0.0) {
+            printf("%-13s (needs --travel-time > 0 for lookahead)\n", network_engine_name(e));
+            continue;
+        }
+        struct office_network* run = reference;
+        struct network_engine_stats run_stats = reference_stats;
+        if (e != NETWORK_SEQUENTIAL) {
+            run = office_network_create(cfg);
+            office_network_run(run, e, threads, &run_stats);
+        }
+        printf("%-13s %10.3f %7.2fx %12d %12ld %12ld %10s\n", network_engine_name(e), run_stats.wall,
+               reference_stats.wall / run_stats.wall, e == NETWORK_OPTIMISTIC ? run_stats.gvt_rounds : run_stats.windows,
+               run_stats.processed, run_stats.rolled_back, office_network_same(run, reference) ? "yes" : "NO");
+        if (run != reference) office_network_destroy(run);
+    }
+    if (reference != net) office_network_destroy(reference);
+    office_network_destroy(net);
+    return 0;
+}
+
+// --- Calendar Benchmark ---
+// The hold model: n events are kept pending while the calendar repeatedly pops the
+// earliest one and pushes its successor an exponential time later, the classic way to
+// time a pending-event set at a fixed size. The first n holds warm the queue up to its
+// steady-state shape and are not timed. Every calendar is fed the same increments, so
+// the sum of the popped times also checks that they all pop the same order. The
+// queue draws its memory from an arena, which counts any block it needs mid-run.
+#define HOLD_OPERATIONS 1000000
+#define HOLD_MAX_SIZE 1000000
+
+const char* calendar_kind_name(int kind) {
+    switch (kind) {
+    case CALENDAR_PAIRING_HEAP: return "pairing heap";
+    case CALENDAR_QUEUE: return "calendar queue";
+    case CALENDAR_LADDER_QUEUE: return "ladder queue";
+    default: return "binary heap";
+    }
+}
+
+// Nanoseconds per hold (one pop and one push) with size events pending; adds the
+// mallocs made during the timed holds to *mallocs
+double hold_benchmark(int kind, int size, uint64_t seed, double* checksum, long* mallocs) {
+    struct arena arena = { 0 };
+    struct event_queue queue = { .kind = kind, .arena = &arena };
+    struct rng_stream stream;
+    struct event ev;
+    struct timespec started, finished;
+    rng_stream_init(&stream, seed, HOLD_STREAM, size, 0);
+    for (int i = 0; i < size; i++) {
+        event_queue_push(&queue, rng_exponential(&stream, 1.0), EVENT_SERVICE_DONE, i, 0);
+    }
+    for (int i = 0; i < size; i++) {
+        event_queue_pop(&queue, &ev);
+        event_queue_push(&queue, ev.time + rng_exponential(&stream, 1.0), EVENT_SERVICE_DONE, ev.student, 0);
+    }
+    *checksum = 0.0;
+    long warm_mallocs = arena.block_mallocs;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (int i = 0; i < HOLD_OPERATIONS; i++) {
+        event_queue_pop(&queue, &ev);
+        *checksum += ev.time;
+        event_queue_push(&queue, ev.time + rng_exponential(&stream, 1.0), EVENT_SERVICE_DONE, ev.student, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    *mallocs += arena.block_mallocs - warm_mallocs;
+    event_queue_free(&queue);
+    arena_destroy(&arena);
+    return ((finished.tv_sec - started.tv_sec) * 1e9 + (finished.tv_nsec - started.tv_nsec)) / HOLD_OPERATIONS;
+}
+
+int run_calendar_benchmark(const struct sim_config* cfg) {
+    printf("Hold model: %d holds (pop the earliest event, push one an exponential time later) per queue size\n",
+           HOLD_OPERATIONS);
+    printf("%10s", "pending");
+    for (int kind = CALENDAR_BINARY_HEAP; kind <= CALENDAR_LADDER_QUEUE; kind++) {
+        printf(" %15s", calendar_kind_name(kind));
+    }
+    printf("   (ns per hold)\n");
+    int same = 1;
+    long mallocs = 0;
+    for (int size = 10; size <= HOLD_MAX_SIZE; size *= 10) {
+        double reference = 0.0, checksum;
+        int fastest = CALENDAR_BINARY_HEAP;
+        double ns[CALENDAR_LADDER_QUEUE + 1];
+        for (int kind = CALENDAR_BINARY_HEAP; kind <= CALENDAR_LADDER_QUEUE; kind++) {
+            ns[kind] = hold_benchmark(kind, size, cfg->seed, &checksum, &mallocs);
+            if (kind == CALENDAR_BINARY_HEAP) reference = checksum;
+            else same &= checksum == reference;
+            if (ns[kind] < ns[fastest]) fastest = kind;
+        }
+        printf("%10d", size);
+        for (int kind = CALENDAR_BINARY_HEAP; kind <= CALENDAR_LADDER_QUEUE; kind++) {
+            printf(" %14.1f%c", ns[kind], kind == fastest ? '*' : ' ');
+        }
+        printf("\n");
+    }
+    printf("* fastest at that size. %s\n", same ? "Every calendar popped the events in the same order."
+                                                : "The calendars popped the events in DIFFERENT orders.");
+    printf("Blocks taken from malloc during the timed holds: %ld\n", mallocs);
+    return same ? 0 : 1;
+}
+
+// --- False Sharing Benchmark ---
+// Times three ways of keeping a counter that every thread bumps: one shared atomic
+// (each bump pulls the line over to the bumping core), per-thread shards packed side
+// by side (nothing is logically shared, but the shards sit on one line, which moves
+// just as much) and shards a cache line apart, the way ta_counters and office_sync
+// are laid out. Where the kernel allows it, perf_event_open counts the cache misses
+// each layout causes over all threads; otherwise only the timings are shown.
+#define SHARING_INCREMENTS 10000000 // Per thread
+#define SHARING_MAX_THREADS 64
+
+enum sharing_layout { SHARING_ATOMIC, SHARING_PACKED, SHARING_PADDED };
+
+struct padded_counter {
+    long value;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct sharing_worker {
+    int layout;               // enum sharing_layout
+    int index;
+    long* shared;
+    long* packed;             // One long per thread, adjacent
+    struct padded_counter* padded;
+    pthread_barrier_t* start;
+};
+
+void* sharing_worker_func(void* arg) {
+    struct sharing_worker* worker = arg;
+    long* own = worker->layout == SHARING_PACKED ? &worker->packed[worker->index] : &worker->padded[worker->index].value;
+    pthread_barrier_wait(worker->start);
+    for (long i = 0; i < SHARING_INCREMENTS; i++) {
+        if (worker->layout == SHARING_ATOMIC) {
+            __atomic_add_fetch(worker->shared, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(own, __atomic_load_n(own, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED); // Sole writer
+        }
+    }
+    return NULL;
+}
+
+int perf_open_errno; // Why the last perf_counter_open failed
+
+// Counts one hardware event for this process and every thread it starts from now
+// on; -1 if the kernel, the CPU or perf_event_paranoid does not allow it
+int perf_counter_open(uint32_t type, uint64_t event) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = event;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) perf_open_errno = errno;
+    return fd;
+#else
+    (void)type;
+    (void)event;
+    perf_open_errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void perf_counters_enable(const int* fds, int n, int enable) {
+#ifdef __linux__
+    for (int i = 0; i < n; i++) {
+        if (fds[i] < 0) continue;
+        if (enable) ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+#else
+    (void)fds;
+    (void)n;
+    (void)enable;
+#endif
+}
+
+// Runs one layout on threads threads; returns ns per increment, and the event counts
+// (-1 where unavailable) in counts. Returns a negative time if a count came out wrong.
+double sharing_benchmark(int layout, int threads, long* counts) {
+#ifdef __linux__
+    static const uint32_t types[] = { PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+    static const uint64_t events[] = {
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+#else
+    static const uint32_t types[] = { 0, 0 };
+    static const uint64_t events[] = { 0, 0 };
+#endif
+    long shared = 0, packed[SHARING_MAX_THREADS] = { 0 };
+    struct padded_counter* padded = aligned_alloc(CACHE_LINE, threads * sizeof(struct padded_counter));
+    struct sharing_worker workers[SHARING_MAX_THREADS];
+    pthread_t ids[SHARING_MAX_THREADS];
+    pthread_barrier_t start;
+    int fds[2], started = 0;
+    if (padded == NULL) {
+        perror("Failed to allocate benchmark counters");
+        exit(1);
+    }
+    memset(padded, 0, threads * sizeof(struct padded_counter));
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int e = 0; e < 2; e++) fds[e] = perf_counter_open(types[e], events[e]);
+    perf_counters_enable(fds, 2, 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (struct sharing_worker){ layout, i, &shared, packed, padded, &start };
+        if (pthread_create(&ids[i], NULL, sharing_worker_func, &workers[i]) != 0) {
+            perror("Failed to create benchmark thread");
+            exit(1);
+        }
+        started++;
+    }
+    pthread_barrier_wait(&start);
+    double began = elapsed_seconds();
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double seconds = elapsed_seconds() - began;
+    perf_counters_enable(fds, 2, 0);
+    for (int e = 0; e < 2; e++) {
+        long long value;
+        counts[e] = fds[e] >= 0 && read(fds[e], &value, sizeof(value)) == sizeof(value) ? (long)value : -1;
+        if (fds[e] >= 0) close(fds[e]);
+    }
+
+    long total = shared;
+    for (int i = 0; i < threads; i++) total += packed[i] + padded[i].value;
+    pthread_barrier_destroy(&start);
+    free(padded);
+    double ns = seconds * 1e9 / ((double)threads * SHARING_INCREMENTS);
+    return total == (long)threads * SHARING_INCREMENTS ? ns : -ns;
+}
+
+void print_perf_count(long count) {
+    if (count >= 0) printf(" %16ld", count);
+    else printf(" %16s", "n/a");
+}
+
+int run_sharing_benchmark(const struct sim_config* cfg) {
+    static const char* names[] = { "shared atomic", "packed shards", "padded shards" };
+    int threads = cfg->jobs < 2 ? 2 : cfg->jobs > SHARING_MAX_THREADS ? SHARING_MAX_THREADS : cfg->jobs;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("False sharing: %d threads x %d increments, %ld online CPU(s)\n", threads, SHARING_INCREMENTS, cpus);
+    printf("%-14s %14s %16s %16s\n", "Layout", "ns/increment", "cache misses", "L1d load misses");
+    int ok = 1, counted = 0;
+    for (int layout = SHARING_ATOMIC; layout <= SHARING_PADDED; layout++) {
+        long counts[2];
+        double ns = sharing_benchmark(layout, threads, counts);
+        ok &= ns >= 0.0;
+        counted |= counts[0] >= 0 || counts[1] >= 0;
+        printf("%-14s %14.2f", names[layout], fabs(ns));
+        print_perf_count(counts[0]);
+        print_perf_count(counts[1]);
+        printf("\n");
+    }
+    if (!counted) {
+        printf("Hardware counters unavailable (perf_event_open: %s); timings only.\n", strerror(perf_open_errno));
+    }
+    if (cpus == 1) {
+        printf("With one CPU the threads take turns instead of contending, so the layouts barely differ.\n");
+    }
+    if (!ok) {
+        printf("A layout LOST increments.\n");
+    }
+    return ok ? 0 : 1;
+}
+
+// --- Handoff Benchmark ---
+// Times the student-to-TA handoff on its own. A "student" thread posts the TA's
+// semaphore and a "TA" thread waiting in it under one of the --ta-wait policies
+// notes how long it took to run again, then posts back. Each policy is timed with
+// each placement of the pair, as far as the CPUs this process may use allow: left
+// to the scheduler, both pinned to one CPU, pinned to two CPUs of one node and
+// pinned to CPUs on two nodes.
+#define HANDOFF_ROUNDS 20000
+
+struct handoff_pair {
+    struct office_sem present; // Student to TA
+    sem_t ready;               // TA back to student
+    double posted;             // When the student last posted present (elapsed seconds)
+    double* wake_us;           // Per round: from that post to the TA running
+    int rounds;
+    int ta_cpu;                // -1: unpinned
+    int policy;                // enum ta_wait_policy
+    double budget_us;
+    int slept;                 // Rounds in which the TA ended up asleep
+};
+
+void* handoff_ta_func(void* arg) {
+    struct handoff_pair* pair = arg;
+    pin_self(pair->ta_cpu);
+    for (int r = 0; r < pair->rounds; r++) {
+        pair->slept += office_sem_wait_polling(&pair->present, pair->policy, pair->budget_us);
+        pair->wake_us[r] = (elapsed_seconds() - pair->posted) * 1e6;
+        sem_post(&pair->ready);
+    }
+    return NULL;
+}
+
+// Runs rounds handoffs from this thread on student_cpu to a TA on ta_cpu waiting
+// under policy; fills wake_us and slept, and returns the mean round trip in microseconds
+double handoff_benchmark(int student_cpu, int ta_cpu, int policy, double budget_us, double* wake_us, int rounds,
+                         int* slept) {
+    struct handoff_pair pair = { .wake_us = wake_us, .rounds = rounds, .ta_cpu = ta_cpu, .policy = policy,
+                                 .budget_us = budget_us };
+    cpu_set_t home;
+    pthread_t ta;
+    sched_getaffinity(0, sizeof(home), &home);
+    office_sem_init(&pair.present, 0);
+    sem_init(&pair.ready, 0, 0);
+    pin_self(student_cpu);
+    if (pthread_create(&ta, NULL, handoff_ta_func, &pair) != 0) {
+        perror("Failed to create benchmark thread");
+        exit(1);
+    }
+    double began = elapsed_seconds();
+    for (int r = 0; r < rounds; r++) {
+        pair.posted = elapsed_seconds();
+        office_sem_post(&pair.present);
+        sem_wait(&pair.ready);
+    }
+    double seconds = elapsed_seconds() - began;
+    pthread_join(ta, NULL);
+    sched_setaffinity(0, sizeof(home), &home);
+    office_sem_destroy(&pair.present);
+    sem_destroy(&pair.ready);
+    *slept = pair.slept;
+    return seconds * 1e6 / rounds;
+}
+
+int run_handoff_benchmark(const struct sim_config* cfg) {
+    static const char* policies[] = { "block", "spin", "adaptive" };
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    // First allowed CPU, another on its node and one on another node, where they exist
+    int first = -1, same_node = -1, other_node = -1, nodes[MAX_NUMA_NODES] = { 0 }, num_nodes = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        int node = cpu_node(cpu);
+        if (node < MAX_NUMA_NODES && !nodes[node]++) num_nodes++;
+        if (first < 0) first = cpu;
+        else if (node == cpu_node(first) && same_node < 0) same_node = cpu;
+        else if (node != cpu_node(first) && other_node < 0) other_node = cpu;
+    }
+    struct {
+        const char* name;
+        int student_cpu, ta_cpu;
+    } placements[] = {
+        { "unpinned", -1, -1 },
+        { "same CPU", first, first },
+        { "same node", first, same_node },
+        { "across nodes", first, other_node },
+    };
+    double* wake_us = malloc(HANDOFF_ROUNDS * sizeof(double));
+    if (wake_us == NULL) {
+        perror("Failed to allocate benchmark samples");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &simulation_start);
+    printf("Student-to-TA handoff: %d rounds per run, %d allowed CPU(s) on %d NUMA node(s), %.0f us spin budget\n",
+           HANDOFF_ROUNDS, CPU_COUNT(&allowed), num_nodes, cfg->spin_budget_us);
+    printf("%-9s %-13s %7s %9s %9s %9s %9s %9s %11s %7s\n", "Policy", "Placement", "CPUs", "wake p50", "p90", "p99",
+           "p99.9", "max", "round trip", "slept");
+    for (int policy = TA_WAIT_BLOCK; policy <= TA_WAIT_ADAPTIVE; policy++) {
+        for (size_t p = 0; p < sizeof(placements) / sizeof(placements[0]); p++) {
+            if (p > 0 && placements[p].ta_cpu < 0) {
+                if (policy == TA_WAIT_BLOCK) {
+                    printf("%-9s %-13s %7s   (needs another allowed CPU%s)\n", "", placements[p].name, "-",
+                           p == 3 ? " on a second node" : "");
+                }
+                continue;
+            }
+            int slept;
+            double round_trip = handoff_benchmark(placements[p].student_cpu, placements[p].ta_cpu, policy,
+                                                  cfg->spin_budget_us, wake_us, HANDOFF_ROUNDS, &slept);
+            char cpus[16] = "-";
+            if (placements[p].ta_cpu >= 0) snprintf(cpus, sizeof(cpus), "%d,%d", placements[p].student_cpu, placements[p].ta_cpu);
+            printf("%-9s %-13s %7s %9.2f %9.2f %9.2f %9.2f %9.2f %11.2f %6.1f%%\n", policies[policy],
+                   placements[p].name, cpus, percentile_of(wake_us, HANDOFF_ROUNDS, 0.50),
+                   percentile_of(wake_us, HANDOFF_ROUNDS, 0.90), percentile_of(wake_us, HANDOFF_ROUNDS, 0.99),
+                   percentile_of(wake_us, HANDOFF_ROUNDS, 0.999), percentile_of(wake_us, HANDOFF_ROUNDS, 1.0),
+                   round_trip, 100.0 * slept / HANDOFF_ROUNDS);
+        }
+    }
+    printf("Times in microseconds; wake: the student's post until the TA runs again; slept: rounds in which\n"
+           "the TA went to sleep in the semaphore.\n");
+    if (CPU_COUNT(&allowed) == 1) {
+        printf("With one CPU a polling TA sees the post only after yielding to the student, so the policies differ little.\n");
+    }
+    free(wake_us);
+    return 0;
+}
+
+// --- Result Cache ---
+// Replication results are stored on disk under a hash of a canonical description
+// of every input that affects them (configuration, replication seed, antithetic
+// flag and ENGINE_VERSION), so re-running an identical sweep only simulates the
+// points it has not seen before. Each entry repeats the full key to rule out hash
+// collisions, and is written to a temporary file and renamed into place so
+// concurrent workers never observe a partial entry.
+int cache_hits = 0, cache_misses = 0; // Updated atomically by replication workers
+
+// Parameters a distribution does not use are left out, so changing them cannot cause a miss
+void describe_distribution(int dist, int min, int max, double mean, char* text, size_t size) {
+    if (dist == DIST_EXPONENTIAL) {
+        snprintf(text, size, "exp(%.17g)", mean);
+    } else {
+        snprintf(text, size, "uniform(%d,%d)", min, max);
+    }
+}
+
+// 64-bit FNV-1a
+uint64_t hash_string(const char* text) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (; *text; text++) {
+        hash = (hash ^ (unsigned char)*text) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+void canonical_replication_key(const struct sim_config* cfg, int max_chairs, uint64_t seed, int antithetic,
+                               char* key, size_t size) {
+    char arrival[64], service[64], priority[256] = "";
+    describe_distribution(cfg->arrival_dist, cfg->arrival_min_seconds, cfg->arrival_max_seconds, cfg->arrival_mean,
+                          arrival, sizeof(arrival));
+    describe_distribution(cfg->service_dist, cfg->help_min_seconds, cfg->help_max_seconds, cfg->service_mean,
+                          service, sizeof(service));
+    if (cfg->priority_classes > 1) {
+        int used = snprintf(priority, sizeof(priority), ";aging=%.17g;classes=", cfg->aging_rate);
+        for (int k = 0; k < cfg->priority_classes; k++) {
+            used += snprintf(priority + used, sizeof(priority) - used, "%s%.17g", k ? "," : "", cfg->class_weights[k]);
+        }
+    }
+    if (cfg->num_topics > 1) {
+        // The skill table can be large: the key carries its hash
+        char table[64];
+        uint64_t skills = 0xCBF29CE484222325ULL;
+        for (int ta = 0; ta < cfg->num_tas; ta++) {
+            for (int topic = 0; topic < cfg->num_topics; topic++) {
+                snprintf(table, sizeof(table), "%d,%d,%.17g;", ta, topic, cfg->skill_speed[ta][topic]);
+                skills = skills ^ hash_string(table);
+                skills *= 0x100000001B3ULL;
+            }
+        }
+        size_t used = strlen(priority);
+        snprintf(priority + used, sizeof(priority) - used, ";topics=%d,%d,%016llx", cfg->num_topics, cfg->skill_policy,
+                 (unsigned long long)skills);
+    }
+    int per_ta = cfg->topology == TOPOLOGY_PER_TA;
+    snprintf(key, size, "engine=%d;students=%d;chairs=%d;tas=%d;topology=%d,%d,%d;arrival=%s;service=%s%s;"
+             "batch=%d,%.17g;wake=%.17g,%.17g;breaks=%.17g,%.17g;patience=%.17g;seed=%llu;antithetic=%d",
+             ENGINE_VERSION, cfg->num_students, max_chairs, cfg->num_tas, cfg->topology, per_ta ? cfg->routing : 0,
+             per_ta && cfg->work_stealing, arrival, service, priority, cfg->batch_size,
+             cfg->batch_size > 1 ? cfg->batch_growth : 0.0, cfg->wake_setup, cfg->stay_awake, cfg->break_every,
+             cfg->break_every > 0.0 ? cfg->break_length : 0.0, cfg->patience_mean, (unsigned long long)seed,
+             antithetic);
+}
+
+void cache_entry_path(const char* dir, const char* key, char* path, size_t size) {
+    snprintf(path, size, "%s/%016llx.result", dir, (unsigned long long)hash_string(key));
+}
+
+int cache_lookup(const char* dir, const char* key, struct replication_result* result) {
+    char path[4096], stored_key[1024];
+    cache_entry_path(dir, key, path, sizeof(path));
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int found = fgets(stored_key, sizeof(stored_key), file) != NULL &&
+                strncmp(stored_key, key, strlen(key)) == 0 && stored_key[strlen(key)] == '\n' &&
+                fscanf(file, "%d %d %lf %d %lf %lf %lf %d %lf %d %d %d %lf", &result->served, &result->balked,
+                       &result->mean_wait, &result->warmup, &result->steady_mean_wait, &result->steady_p95_wait,
+                       &result->utilization, &result->abandoned, &result->mean_wasted_wait, &result->steals,
+                       &result->wakeups, &result->breaks, &result->awake_idle) == 13;
+    memset(result->batch_sessions, 0, sizeof(result->batch_sessions));
+    for (int k = 1; found && k <= MAX_BATCH_SIZE; k++) {
+        found = fscanf(file, "%d", &result->batch_sessions[k]) == 1;
+    }
+    fclose(file);
+    return found;
+}
+
+void cache_store(const char* dir, const char* key, const struct replication_result* result) {
+    char path[4096], temp_path[4200];
+    cache_entry_path(dir, key, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.%lu.tmp", path, (unsigned long)pthread_self());
+    FILE* file = fopen(temp_path, "w");
+    if (file == NULL) {
+        return; // The cache is an optimisation: failing to write it is not an error
+    }
+    fprintf(file, "%s\n%d %d %.17g %d %.17g %.17g %.17g %d %.17g %d %d %d %.17g\n", key, result->served,
+            result->balked, result->mean_wait, result->warmup, result->steady_mean_wait, result->steady_p95_wait,
+            result->utilization, result->abandoned, result->mean_wasted_wait, result->steals, result->wakeups,
+            result->breaks, result->awake_idle);
+    for (int k = 1; k <= MAX_BATCH_SIZE; k++) {
+        fprintf(file, "%d%c", result->batch_sessions[k], k == MAX_BATCH_SIZE ? '\n' : ' ');
+    }
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        remove(temp_path);
+    }
+}
+
+// Same as run_virtual_replication, but answered from the cache when possible.
+// On a hit only the summary is filled in; waits is left untouched.
+void run_cached_replication(const struct sim_config* cfg, int max_chairs, uint64_t seed, int antithetic,
+                            double* waits, struct replication_result* result) {
+    char key[1024];
+    if (cfg->cache_dir != NULL) {
+        canonical_replication_key(cfg, max_chairs, seed, antithetic, key, sizeof(key));
+        if (cache_lookup(cfg->cache_dir, key, result)) {
+            __atomic_fetch_add(&cache_hits, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_fetch_add(&cache_misses, 1, __ATOMIC_RELAXED);
+    }
+    run_virtual_replication(cfg, max_chairs, seed, antithetic, waits, NULL, NULL, result);
+    if (cfg->cache_dir != NULL) {
+        cache_store(cfg->cache_dir, key, result);
+    }
+}
+
+int prepare_cache_dir(const char* dir) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create result cache directory");
+        return 1;
+    }
+    return 0;
+}
+
+void print_cache_summary(const struct sim_config* cfg) {
+    if (cfg->cache_dir != NULL) {
+        printf("Result cache %s: %d hit(s), %d miss(es)\n", cfg->cache_dir, cache_hits, cache_misses);
+    }
+}
+
+// Runs a (possibly antithetic) replication and returns the value used as one
+// independent observation: an antithetic pair is averaged into a single point
+void run_observation(const struct sim_config* cfg, int max_chairs, int replication, double* waits,
+                     double* mean_wait, double* balk_fraction, double* abandon_fraction, double* wasted_wait) {
+    uint64_t seed = replication_seed(cfg->seed, replication);
+    struct replication_result result;
+    run_cached_replication(cfg, max_chairs, seed, 0, waits, &result);
+    *mean_wait = result.mean_wait;
+    *balk_fraction = (double)result.balked / cfg->num_students;
+    *abandon_fraction = (double)result.abandoned / cfg->num_students;
+    *wasted_wait = result.mean_wasted_wait;
+    if (cfg->antithetic) {
+        run_cached_replication(cfg, max_chairs, seed, 1, waits, &result);
+        *mean_wait = (*mean_wait + result.mean_wait) / 2.0;
+        *balk_fraction = (*balk_fraction + (double)result.balked / cfg->num_students) / 2.0;
+        *abandon_fraction = (*abandon_fraction + (double)result.abandoned / cfg->num_students) / 2.0;
+        *wasted_wait = (*wasted_wait + result.mean_wasted_wait) / 2.0;
+    }
+}
+
+void print_abandonment(int abandoned, int arrived, double mean_wasted_wait) {
+    printf("Students who gave up waiting: %d (%.2f%% of arrivals), mean wasted wait %.3f s\n", abandoned,
+           arrived > 0 ? 100.0 * abandoned / arrived : 0.0, mean_wasted_wait);
+}
+
+void print_batch_sizes(const int* sessions, int batch_size) {
+    int total = 0, students = 0;
+    for (int k = 1; k <= batch_size; k++) {
+        total += sessions[k];
+        students += k * sessions[k];
+    }
+    printf("Consultation sessions: %d (mean group size %.2f)\n", total, total > 0 ? (double)students / total : 0.0);
+    printf("  %5s %9s %8s\n", "size", "sessions", "share");
+    for (int k = 1; k <= batch_size; k++) {
+        printf("  %5d %9d %7.1f%%\n", k, sessions[k], total > 0 ? 100.0 * sessions[k] / total : 0.0);
+    }
+}
+
+void print_ta_availability(int wakeups, int breaks) {
+    printf("TA wake-ups from sleep: %d (%.4g s setup each), breaks taken: %d\n", wakeups, config.wake_setup, breaks);
+}
+
+// Replays the run's seed under several stay-awake times: the latency cost of
+// sleeping against the time TAs spend idle but awake
+void print_stay_awake_policies(const struct sim_config* cfg, double* waits) {
+    double service = mean_service_time(cfg);
+    double stay[] = { 0.0, 0.5 * service, service, 2.0 * service, 5.0 * service, INFINITY };
+    printf("\nStay-awake policy (same seed; a TA idle longer than T falls asleep):\n");
+    printf("  %10s %12s %12s %9s %11s\n", "T (s)", "mean wait", "p95 wait", "wake-ups", "awake idle");
+    for (size_t i = 0; i < sizeof(stay) / sizeof(stay[0]); i++) {
+        struct sim_config policy = *cfg;
+        struct replication_result result;
+        policy.stay_awake = stay[i];
+        run_virtual_replication(&policy, cfg->max_chairs, replication_seed(cfg->seed, 0), 0, waits, NULL, NULL,
+                                &result);
+        char label[32];
+        if (isinf(stay[i])) snprintf(label, sizeof(label), "forever");
+        else snprintf(label, sizeof(label), "%.3g", stay[i]);
+        printf("  %10s %10.3f s %10.3f s %9d %10.1f%%\n", label, result.mean_wait, result.steady_p95_wait,
+               result.wakeups, 100.0 * result.awake_idle);
+    }
+}
+
+void print_interval(const char* label, const double* values, int n, const char* unit) {
+    double mean, half_width;
+    mean_and_half_width(values, n, &mean, &half_width);
+    printf("%-34s %.4f +/- %.4f%s\n", label, mean, half_width, unit);
+}
+
+int run_virtual_experiment(const struct sim_config* cfg) {
+    double* waits = malloc(cfg->num_students * sizeof(double));
+    if (waits == NULL) {
+        perror("Failed to allocate memory for wait series");
+        return 1;
+    }
+
+    if (cfg->replications == 1 && !cfg->antithetic && cfg->compare_chairs == 0) {
+        struct replication_result result;
+        int* classes = malloc(2 * cfg->num_students * sizeof(int));
+        if (classes == NULL) {
+            perror("Failed to allocate memory for wait classes");
+            free(waits);
+            return 1;
+        }
+        int* topics = classes + cfg->num_students;
+        run_virtual_replication(cfg, cfg->max_chairs, replication_seed(cfg->seed, 0), 0, waits, classes, topics,
+                                &result);
+        printf("Virtual-time run: %d students, %d chairs, seed %llu\n",
+               cfg->num_students, cfg->max_chairs, (unsigned long long)cfg->seed);
+        printf("Students who found no chair: %d\n", result.balked);
+        if (cfg->patience_mean > 0.0) {
+            print_abandonment(result.abandoned, cfg->num_students, result.mean_wasted_wait);
+        }
+        print_wait_statistics(waits, classes, cfg->priority_classes, topics, cfg->num_topics, result.served);
+        if (cfg->batch_size > 1) {
+            print_batch_sizes(result.batch_sessions, cfg->batch_size);
+        }
+        if (cfg->wake_setup > 0.0 || cfg->break_every > 0.0) {
+            print_ta_availability(result.wakeups, result.breaks);
+        }
+        if (cfg->wake_setup > 0.0) {
+            print_stay_awake_policies(cfg, waits);
+        }
+        if (cfg->work_stealing) {
+            // Same seed without stealing, so the difference is due to stealing alone
+            struct sim_config no_stealing = *cfg;
+            struct replication_result baseline;
+            no_stealing.work_stealing = 0;
+            run_virtual_replication(&no_stealing, cfg->max_chairs, replication_seed(cfg->seed, 0), 0, waits, NULL,
+                                    NULL, &baseline);
+            printf("Students stolen by idle TAs: %d\n", result.steals);
+            printf("Mean wait without stealing: %.4f s, with stealing: %.4f s", baseline.mean_wait, result.mean_wait);
+            if (baseline.mean_wait > 0.0) {
+                printf(" (%.1f%% lower)", 100.0 * (baseline.mean_wait - result.mean_wait) / baseline.mean_wait);
+            }
+            printf("\n");
+        }
+        free(classes);
+        free(waits);
+        return 0;
+    }
+
+    int n = cfg->replications;
+    double* samples = malloc(12 * n * sizeof(double));
+    if (samples == NULL) {
+        perror("Failed to allocate memory for replication results");
+        free(waits);
+        return 1;
+    }
+    double *wait_a = samples, *balk_a = samples + n, *wait_b = samples + 2 * n;
+    double *balk_b = samples + 3 * n, *wait_diff = samples + 4 * n, *balk_diff = samples + 5 * n;
+    double *abandon_a = samples + 6 * n, *wasted_a = samples + 7 * n, *abandon_b = samples + 8 * n;
+    double *wasted_b = samples + 9 * n, *abandon_diff = samples + 10 * n, *wasted_diff = samples + 11 * n;
+
+    for (int r = 0; r < n; r++) {
+        run_observation(cfg, cfg->max_chairs, r, waits, &wait_a[r], &balk_a[r], &abandon_a[r], &wasted_a[r]);
+        if (cfg->compare_chairs > 0) {
+            // Same replication seed: both configurations see identical arrivals and service demands
+            run_observation(cfg, cfg->compare_chairs, r, waits, &wait_b[r], &balk_b[r], &abandon_b[r], &wasted_b[r]);
+            wait_diff[r] = wait_b[r] - wait_a[r];
+            balk_diff[r] = balk_b[r] - balk_a[r];
+            abandon_diff[r] = abandon_b[r] - abandon_a[r];
+            wasted_diff[r] = wasted_b[r] - wasted_a[r];
+        }
+    }
+
+    printf("Virtual-time experiment: %d students, %d %s, seed %llu\n", cfg->num_students, n,
+           cfg->antithetic ? "antithetic pairs" : "replications", (unsigned long long)cfg->seed);
+    printf("\n[%d chairs]\n", cfg->max_chairs);
+    print_interval("Mean wait:", wait_a, n, " s");
+    print_interval("Fraction balked:", balk_a, n, "");
+    if (cfg->patience_mean > 0.0) {
+        print_interval("Fraction gave up:", abandon_a, n, "");
+        print_interval("Mean wasted wait:", wasted_a, n, " s");
+    }
+
+    if (cfg->compare_chairs > 0) {
+        printf("\n[%d chairs]\n", cfg->compare_chairs);
+        print_interval("Mean wait:", wait_b, n, " s");
+        print_interval("Fraction balked:", balk_b, n, "");
+        if (cfg->patience_mean > 0.0) {
+            print_interval("Fraction gave up:", abandon_b, n, "");
+            print_interval("Mean wasted wait:", wasted_b, n, " s");
+        }
+
+        // Variance an independent-streams comparison would have had, for the same n
+        double mean, hw_a, hw_b, hw_diff;
+        printf("\n[Difference %d - %d chairs, common random numbers]\n", cfg->compare_chairs, cfg->max_chairs);
+        print_interval("Mean wait:", wait_diff, n, " s");
+        mean_and_half_width(wait_a, n, &mean, &hw_a);
+        mean_and_half_width(wait_b, n, &mean, &hw_b);
+        mean_and_half_width(wait_diff, n, &mean, &hw_diff);
+        if (hw_diff > 0.0) {
+            printf("%-34s %.4f s (variance reduction x%.1f)\n", "Independent-streams half-width:",
+                   sqrt(hw_a * hw_a + hw_b * hw_b), (hw_a * hw_a + hw_b * hw_b) / (hw_diff * hw_diff));
+        }
+        print_interval("Fraction balked:", balk_diff, n, "");
+        if (cfg->patience_mean > 0.0) {
+            print_interval("Fraction gave up:", abandon_diff, n, "");
+            print_interval("Mean wasted wait:", wasted_diff, n, " s");
+        }
+    }
+    print_cache_summary(cfg);
+
+    free(samples);
+    free(waits);
+    return 0;
+}
+
+// --- Analytic M/M/c/K Model ---
+// With Poisson arrivals and exponential consultations the office is an M/M/c/K
+// queue: c TAs, and K = c + chairs students at most (seated or with a TA), since
+// a student gives up their chair the moment a TA calls them. The waiting-room
+// wait is the queueing delay Wq.
+struct mmck_metrics {
+    double p_block;        // Probability an arriving student finds every chair taken
+    double throughput;     // Students served per second
+    double utilization;    // Fraction of TA time spent consulting
+    double mean_in_system; // L
+    double mean_waiting;   // Lq: students in chairs
+    double mean_wait;      // Wq, over admitted students
+    double p_wait;         // Probability an admitted student waits at all
+    double p95_wait;       // 95th percentile of Wq over admitted students
+};
+
+// P(Erlang(k, rate) > t) = sum_{j<k} e^{-rate t} (rate t)^j / j!
+double erlang_tail(int k, double rate, double t) {
+    double x = rate * t, term = exp(-x), sum = 0.0;
+    for (int j = 0; j < k; j++) {
+        sum += term;
+        term *= x / (j + 1);
+    }
+    return sum;
+}
+
+// P(Wq > t): an admitted student who finds n >= c present waits for n - c + 1 departures at rate c*mu
+double mmck_wait_exceeds(const double* arrival_sees, int c, int capacity, double mu, double t) {
+    double tail = 0.0;
+    for (int n = c; n < capacity; n++) {
+        tail += arrival_sees[n] * erlang_tail(n - c + 1, c * mu, t);
+    }
+    return tail;
+}
+
+int mmck_solve(int c, int chairs, double lambda, double mu, struct mmck_metrics* m) {
+    int capacity = c + chairs;
+    double* p = malloc((capacity + 1) * sizeof(double));
+    if (p == NULL) {
+        perror("Failed to allocate memory for M/M/c/K probabilities");
+        return 1;
+    }
+
+    // Unnormalised p_n = a^n / (n! for n <= c, c! c^(n-c) beyond), built by recurrence
+    double a = lambda / mu, total = 0.0;
+    p[0] = 1.0;
+    for (int n = 1; n <= capacity; n++) {
+        p[n] = p[n - 1] * a / (n < c ? n : c);
+    }
+    for (int n = 0; n <= capacity; n++) total += p[n];
+    for (int n = 0; n <= capacity; n++) p[n] /= total;
+
+    m->p_block = p[capacity];
+    m->throughput = lambda * (1.0 - m->p_block);
+    m->utilization = m->throughput / (c * mu);
+    m->mean_in_system = m->mean_waiting = 0.0;
+    for (int n = 0; n <= capacity; n++) {
+        m->mean_in_system += n * p[n];
+        if (n > c) m->mean_waiting += (n - c) * p[n];
+    }
+    m->mean_wait = m->throughput > 0.0 ? m->mean_waiting / m->throughput : 0.0;
+
+    // PASTA: admitted arrivals see state n with probability p_n / (1 - p_K)
+    for (int n = 0; n < capacity; n++) p[n] /= (1.0 - m->p_block);
+    m->p_wait = mmck_wait_exceeds(p, c, capacity, mu, 0.0);
+    m->p95_wait = 0.0;
+    if (m->p_wait > 0.05) {
+        double lo = 0.0, hi = 1.0 / mu;
+        while (mmck_wait_exceeds(p, c, capacity, mu, hi) > 0.05) hi *= 2.0;
+        for (int iter = 0; iter < 60; iter++) {
+            double mid = (lo + hi) / 2.0;
+            if (mmck_wait_exceeds(p, c, capacity, mu, mid) > 0.05) lo = mid; else hi = mid;
+        }
+        m->p95_wait = hi;
+    }
+
+    free(p);
+    return 0;
+}
+
+int analytic_model_applies(const struct sim_config* cfg) {
+    return cfg->arrival_dist == DIST_EXPONENTIAL && cfg->service_dist == DIST_EXPONENTIAL && cfg->max_chairs > 0 &&
+           cfg->patience_mean <= 0.0 && cfg->topology == TOPOLOGY_SHARED && cfg->batch_size == 1 &&
+           cfg->wake_setup == 0.0 && cfg->break_every == 0.0 && cfg->num_topics <= 1;
+}
+
+int mmck_for_config(const struct sim_config* cfg, int num_tas, int max_chairs, struct mmck_metrics* m) {
+    return mmck_solve(num_tas, max_chairs, 1.0 / cfg->arrival_mean, 1.0 / cfg->service_mean, m);
+}
+
+void print_mmck_metrics(const struct sim_config* cfg, const struct mmck_metrics* m) {
+    printf("M/M/%d/%d closed form (arrival rate %.4g/s, service rate %.4g/s per TA)\n", cfg->num_tas,
+           cfg->num_tas + cfg->max_chairs, 1.0 / cfg->arrival_mean, 1.0 / cfg->service_mean);
+    printf("%-34s %.4f\n", "Fraction balked:", m->p_block);
+    printf("%-34s %.4f students/s\n", "Throughput:", m->throughput);
+    printf("%-34s %.4f\n", "TA utilization:", m->utilization);
+    printf("%-34s %.4f\n", "Mean students in chairs:", m->mean_waiting);
+    printf("%-34s %.4f\n", "Mean students in office:", m->mean_in_system);
+    printf("%-34s %.4f\n", "P(wait > 0):", m->p_wait);
+    printf("%-34s %.4f s\n", "Mean wait:", m->mean_wait);
+    printf("%-34s %.4f s\n", "p95 wait:", m->p95_wait);
+}
+
+void print_validation_row(const char* label, double theory, const double* values, int n) {
+    double mean, half_width;
+    mean_and_half_width(values, n, &mean, &half_width);
+    double deviation = theory != 0.0 ? 100.0 * (mean - theory) / theory : 0.0;
+    printf("%-18s %12.4f %12.4f +/- %-9.4f %+8.2f%%  %s\n", label, theory, mean, half_width, deviation,
+           fabs(mean - theory) <= half_width ? "ok" : "OUTSIDE CI");
+}
+
+// Runs the engine and reports how far its steady-state estimates fall from theory
+int run_validation(const struct sim_config* cfg) {
+    if (!analytic_model_applies(cfg)) {
+        fprintf(stderr, "--validate needs exponential arrivals and service, at least one chair, no reneging, a shared "
+                        "waiting room, no group consultations, always-available TAs and a single topic\n");
+        return 1;
+    }
+
+    struct mmck_metrics theory;
+    double started = elapsed_seconds();
+    if (mmck_for_config(cfg, cfg->num_tas, cfg->max_chairs, &theory) != 0) {
+        return 1;
+    }
+    double analytic_seconds = elapsed_seconds() - started;
+
+    int n = cfg->replications < 2 ? 10 : cfg->replications;
+    double* waits = malloc(cfg->num_students * sizeof(double));
+    double* samples = malloc(4 * n * sizeof(double));
+    if (waits == NULL || samples == NULL) {
+        perror("Failed to allocate memory for validation");
+        return 1;
+    }
+    double *balk = samples, *mean_wait = samples + n, *p95_wait = samples + 2 * n, *utilization = samples + 3 * n;
+
+    started = elapsed_seconds();
+    for (int r = 0; r < n; r++) {
+        struct replication_result result;
+        run_cached_replication(cfg, cfg->max_chairs, replication_seed(cfg->seed, r), 0, waits, &result);
+        balk[r] = (double)result.balked / cfg->num_students;
+        mean_wait[r] = result.steady_mean_wait;
+        p95_wait[r] = result.steady_p95_wait;
+        utilization[r] = result.utilization;
+    }
+    double simulation_seconds = elapsed_seconds() - started;
+
+    printf("Validation: M/M/%d/%d, %d replications of %d students (steady state after MSER-5)\n\n",
+           cfg->num_tas, cfg->num_tas + cfg->max_chairs, n, cfg->num_students);
+    printf("%-18s %12s %26s %9s\n", "Metric", "Theory", "Simulated (95% CI)", "Deviation");
+    print_validation_row("Fraction balked", theory.p_block, balk, n);
+    print_validation_row("Mean wait (s)", theory.mean_wait, mean_wait, n);
+    print_validation_row("p95 wait (s)", theory.p95_wait, p95_wait, n);
+    print_validation_row("TA utilization", theory.utilization, utilization, n);
+    printf("\nClosed form: %.1f us, simulation: %.1f ms (%.0f simulated students/s)\n", analytic_seconds * 1e6,
+           simulation_seconds * 1e3, simulation_seconds > 0.0 ? n * (double)cfg->num_students / simulation_seconds : 0.0);
+    print_cache_summary(cfg);
+
+    free(samples);
+    free(waits);
+    return 0;
+}
+
+// --- Parallel Replications ---
+struct replication_batch {
+    const struct sim_config* cfg;
+    int replications;
+    struct replication_result* results;
+    int next;              // Next replication to hand out
+    int workers;           // Workers started so far, numbering them for --pin-workers
+    pthread_mutex_t lock;
+};
+
+void* replication_worker(void* arg) {
+    struct replication_batch* batch = arg;
+    pthread_mutex_lock(&batch->lock);
+    int self = batch->workers++;
+    pthread_mutex_unlock(&batch->lock);
+    pin_self(pinned_cpu(batch->cfg->pin_worker_cpus, batch->cfg->num_pin_worker_cpus, self));
+    double* waits = malloc(batch->cfg->num_students * sizeof(double));
+    if (waits == NULL) {
+        perror("Failed to allocate memory for wait series");
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        int r = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (r >= batch->replications) break;
+        run_cached_replication(batch->cfg, batch->cfg->max_chairs, replication_seed(batch->cfg->seed, r), 0,
+                                waits, &batch->results[r]);
+    }
+    free(waits);
+    arena_destroy(&replication_arena);
+    return NULL;
+}
+
+// Runs replications 0..n-1 of cfg on up to cfg->jobs threads. Replication r always
+// uses the same seed, so results do not depend on the number of workers.
+void run_replications_parallel(const struct sim_config* cfg, int replications, struct replication_result* results) {
+    struct replication_batch batch = { cfg, replications, results, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    int workers = cfg->jobs < replications ? cfg->jobs : replications;
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads != NULL && i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, replication_worker, &batch) == 0) started++;
+    }
+    if (started == 0) {
+        replication_worker(&batch); // No threads available: run inline
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// --- Staffing Optimizer ---
+// Finds the cheapest (TAs, chairs) whose p95 wait and balking fraction meet the
+// SLA. Candidates are visited in cost order, so the first one confirmed by
+// simulation is the answer. Before simulating, a candidate is discarded if
+//  - the throughput bound already rules it out: c TAs serve at most c/E[S]
+//    students per second (times the best group-size speedup with batching),
+//    so at least 1 - c/(lambda E[S]) of arrivals balk;
+//  - the M/M/c/K closed form (exact for exponential distributions) misses the SLA;
+//  - it is dominated by a candidate that already failed: fewer chairs or TAs
+//    cannot reduce balking, and more chairs with no more TAs cannot reduce waits.
+// All simulations of a search share replication seeds (common random numbers),
+// which keeps the dominance comparisons between neighbouring configurations consistent.
+enum staffing_verdict {
+    STAFFING_UNVISITED,
+    STAFFING_PRUNED_THROUGHPUT,
+    STAFFING_PRUNED_DOMINATED,
+    STAFFING_FAILS_BALK,       // Too many students balk (smaller chair/TA counts fail too)
+    STAFFING_FAILS_WAIT,       // p95 wait too long (more chairs with no more TAs fail too)
+    STAFFING_FAILS_BOTH,
+    STAFFING_FEASIBLE,
+};
+
+struct staffing_candidate {
+    int tas, chairs;
+    double cost;
+};
+
+struct staffing_eval {
+    int verdict;
+    int simulated;          // Verdict confirmed by simulation rather than the closed form
+    double balk_pct, balk_hw;
+    double p95_wait, p95_hw;
+};
+
+int compare_staffing_candidates(const void* a, const void* b) {
+    const struct staffing_candidate *x = a, *y = b;
+    if (x->cost != y->cost) return x->cost < y->cost ? -1 : 1;
+    if (x->tas != y->tas) return x->tas - y->tas;
+    return x->chairs - y->chairs;
+}
+
+int staffing_verdict_for(double balk_pct, double p95_wait, const struct sim_config* cfg) {
+    int balk_ok = balk_pct <= cfg->sla_balk_pct, wait_ok = p95_wait <= cfg->sla_p95_wait;
+    if (balk_ok && wait_ok) return STAFFING_FEASIBLE;
+    if (!balk_ok && !wait_ok) return STAFFING_FAILS_BOTH;
+    return balk_ok ? STAFFING_FAILS_WAIT : STAFFING_FAILS_BALK;
+}
+
+// Whether an earlier failure at (tas, chairs) rules out (c, k) as well
+int staffing_dominated(const struct staffing_eval* grid, int stride, const struct sim_config* cfg, int c, int k) {
+    for (int tas = 1; tas <= cfg->search_tas; tas++) {
+        for (int chairs = 1; chairs <= cfg->search_chairs; chairs++) {
+            int verdict = grid[tas * stride + chairs].verdict;
+            int balk_failed = verdict == STAFFING_FAILS_BALK || verdict == STAFFING_FAILS_BOTH;
+            int wait_failed = verdict == STAFFING_FAILS_WAIT || verdict == STAFFING_FAILS_BOTH;
+            if (balk_failed && c <= tas && k <= chairs) return 1;
+            if (wait_failed && c <= tas && k >= chairs) return 1;
+        }
+    }
+    return 0;
+}
+
+void simulate_staffing(const struct sim_config* cfg, int c, int k, int replications, struct staffing_eval* eval) {
+    struct sim_config candidate = *cfg;
+    candidate.num_tas = c;
+    candidate.max_chairs = k;
+
+    struct replication_result* results = malloc(replications * sizeof(struct replication_result));
+    double* samples = malloc(2 * replications * sizeof(double));
+    if (results == NULL || samples == NULL) {
+        perror("Failed to allocate memory for staffing evaluation");
+        exit(1);
+    }
+    run_replications_parallel(&candidate, replications, results);
+    for (int r = 0; r < replications; r++) {
+        samples[r] = 100.0 * results[r].balked / cfg->num_students;
+        samples[replications + r] = results[r].steady_p95_wait;
+    }
+    mean_and_half_width(samples, replications, &eval->balk_pct, &eval->balk_hw);
+    mean_and_half_width(samples + replications, replications, &eval->p95_wait, &eval->p95_hw);
+    eval->verdict = staffing_verdict_for(eval->balk_pct, eval->p95_wait, cfg);
+    eval->simulated = 1;
+    free(samples);
+    free(results);
+}
+
+const char* staffing_verdict_name(int verdict) {
+    switch (verdict) {
+    case STAFFING_FAILS_BALK: return "too many balk";
+    case STAFFING_FAILS_WAIT: return "waits too long";
+    case STAFFING_FAILS_BOTH: return "balking and waits";
+    case STAFFING_FEASIBLE: return "feasible";
+    default: return "pruned";
+    }
+}
+
+int run_staffing_optimizer(const struct sim_config* cfg) {
+    int stride = cfg->search_chairs + 1;
+    int total = cfg->search_tas * cfg->search_chairs;
+    int replications = cfg->replications < 2 ? 10 : cfg->replications;
+    struct staffing_candidate* candidates = malloc(total * sizeof(struct staffing_candidate));
+    struct staffing_eval* grid = calloc((cfg->search_tas + 1) * stride, sizeof(struct staffing_eval));
+    if (candidates == NULL || grid == NULL) {
+        perror("Failed to allocate memory for staffing search");
+        return 1;
+    }
+
+    int n = 0;
+    for (int c = 1; c <= cfg->search_tas; c++) {
+        for (int k = 1; k <= cfg->search_chairs; k++) {
+            candidates[n++] = (struct staffing_candidate){ c, k, c * cfg->ta_cost + k * cfg->chair_cost };
+        }
+    }
+    qsort(candidates, n, sizeof(struct staffing_candidate), compare_staffing_candidates);
+
+    printf("Staffing search: p95 wait <= %.3g s, balked <= %.3g%%, cost = %.3g x TAs + %.3g x chairs\n",
+           cfg->sla_p95_wait, cfg->sla_balk_pct, cfg->ta_cost, cfg->chair_cost);
+    printf("Grid: 1..%d TAs x 1..%d chairs, %d replications of %d students per simulated point\n\n",
+           cfg->search_tas, cfg->search_chairs, replications, cfg->num_students);
+    printf("%4s %6s %8s  %-22s %-22s %s\n", "TAs", "chairs", "cost", "balked %", "p95 wait (s)", "verdict");
+
+    double offered_load = cfg->arrival_dist == DIST_EXPONENTIAL ?
+                          mean_service_time(cfg) / (cfg->arrival_mean * batch_speedup(cfg)) : 0.0;
+    int pruned_throughput = 0, pruned_dominated = 0, pruned_analytic = 0, simulated = 0;
+    struct staffing_candidate* best = NULL;
+    double started = elapsed_seconds();
 
-pthread_mutex_t count_mutex;        // Mutex to protect num_students_in_chairs
-int num_students_in_chairs = 0;     // Counter for students currently in chairs
+    for (int i = 0; i < n && best == NULL; i++) {
+        int c = candidates[i].tas, k = candidates[i].chairs;
+        struct staffing_eval* eval = &grid[c * stride + k];
 
-// --- Utility Function ---
-// Generates a random number between min and max (inclusive)
-int random_int(int min, int max) {
-    if (min > max) {
-        int temp = min;
-        min = max;
-        max = temp;
+        if (offered_load > 0.0 && 100.0 * (1.0 - c / offered_load) > cfg->sla_balk_pct) {
+            eval->verdict = STAFFING_PRUNED_THROUGHPUT;
+            pruned_throughput++;
+            continue;
+        }
+        if (staffing_dominated(grid, stride, cfg, c, k)) {
+            eval->verdict = STAFFING_PRUNED_DOMINATED;
+            pruned_dominated++;
+            continue;
+        }
+
+        struct sim_config candidate = *cfg;
+        candidate.max_chairs = k;
+        struct mmck_metrics theory;
+        if (analytic_model_applies(&candidate) && mmck_for_config(cfg, c, k, &theory) == 0) {
+            int verdict = staffing_verdict_for(100.0 * theory.p_block, theory.p95_wait, cfg);
+            if (verdict != STAFFING_FEASIBLE) {
+                *eval = (struct staffing_eval){ verdict, 0, 100.0 * theory.p_block, 0.0, theory.p95_wait, 0.0 };
+                pruned_analytic++;
+                printf("%4d %6d %8.3g  %-22.4f %-22.4f %s (closed form)\n", c, k, candidates[i].cost,
+                       eval->balk_pct, eval->p95_wait, staffing_verdict_name(verdict));
+                continue;
+            }
+        }
+
+        simulate_staffing(cfg, c, k, replications, eval);
+        simulated++;
+        char balk_text[32], wait_text[32];
+        snprintf(balk_text, sizeof(balk_text), "%.4f +/- %.4f", eval->balk_pct, eval->balk_hw);
+        snprintf(wait_text, sizeof(wait_text), "%.4f +/- %.4f", eval->p95_wait, eval->p95_hw);
+        printf("%4d %6d %8.3g  %-22s %-22s %s\n", c, k, candidates[i].cost, balk_text, wait_text,
+               staffing_verdict_name(eval->verdict));
+        if (eval->verdict == STAFFING_FEASIBLE) {
+            best = &candidates[i];
+        }
+    }
+
+    printf("\n");
+    if (best != NULL) {
+        printf("Cheapest feasible configuration: %d TA(s), %d chair(s), cost %.3g\n", best->tas, best->chairs, best->cost);
+    } else {
+        printf("No configuration in the search grid meets the SLA.\n");
+    }
+    printf("Grid points: %d, simulated: %d, pruned by throughput bound: %d, by closed form: %d, by dominance: %d "
+           "(%.1f ms)\n", total, simulated, pruned_throughput, pruned_analytic, pruned_dominated,
+           (elapsed_seconds() - started) * 1e3);
+    print_cache_summary(cfg);
+
+    free(grid);
+    free(candidates);
+    return best != NULL ? 0 : 2;
+}
+
+// --- Command Line ---
+void usage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --students N         Number of students (default %d)\n", NUM_STUDENTS);
+    printf("  --chairs N           Waiting-room chairs (default %d)\n", MAX_CHAIRS);
+    printf("  --seed S             Base random seed (default: current time)\n");
+    printf("  --time-scale X       Threaded mode: real seconds per simulated second (default 1)\n");
+    printf("  --virtual            Run in simulated time instead of with threads\n");
+    printf("  --student-model M    Threaded mode: threads (real time), coroutines (one thread, simulated time)\n"
+           "                       or fibers (M:N on worker threads, real time)\n");
+    printf("  --fiber-workers N    Worker threads running the fibers (default: online CPUs)\n");
+    printf("  --fiber-stack KB     Stack per fiber (default %d)\n", FIBER_DEFAULT_STACK_KB);
+    printf("  --thread-stack KB    Stack per TA and student thread (default: the system's)\n");
+    printf("  --thread-guard KB    Guard region below each thread stack (default: the system's)\n");
+    printf("  --max-student-threads N  Create student threads in arrival order, at most N alive at once\n");
+    printf("  --pin-tas LIST       Pin TA threads round robin to these CPUs, e.g. 0,2-3 (threads model)\n");
+    printf("  --pin-workers LIST   Pin fiber and replication worker threads round robin to these CPUs\n");
+    printf("  --ta-wait P          How an idle TA waits: block (sleep), spin (poll) or adaptive (poll, then sleep)\n");
+    printf("  --spin-budget US     Adaptive waits: microseconds of polling before sleeping (default %d)\n",
+           DEFAULT_SPIN_BUDGET_US);
+    printf("  --replications R     Independent replications (virtual mode)\n");
+    printf("  --antithetic         Pair each replication with its antithetic twin (virtual mode)\n");
+    printf("  --compare-chairs N   Also run every replication with N chairs on common random numbers\n");
+    printf("  --tas N              Number of TAs (default %d)\n", NUM_TAS);
+    printf("  --arrival-dist D     uniform (offset in [%d, %d] s) or exp (Poisson arrivals)\n",
+           STUDENT_ARRIVAL_MIN_SECONDS, STUDENT_ARRIVAL_MAX_SECONDS);
+    printf("  --arrival-mean X     Mean gap between exponential arrivals (default 1)\n");
+    printf("  --service-dist D     uniform (whole seconds in [%d, %d]) or exp\n", TA_HELP_MIN_SECONDS, TA_HELP_MAX_SECONDS);
+    printf("  --service-mean X     Mean exponential consultation length (default 2)\n");
+    printf("  --analytic           Use the M/M/c/K closed form instead of simulating when it applies\n");
+    printf("  --validate           Simulate and compare against the M/M/c/K closed form\n");
+    printf("  --optimize           Find the cheapest TAs and chairs meeting the SLA below\n");
+    printf("  --sla-p95-wait X     Staffing SLA: p95 wait in seconds (default 5)\n");
+    printf("  --sla-balk-pct Y     Staffing SLA: percent of students balking (default 5)\n");
+    printf("  --search-tas N       Largest TA count to consider (default 8)\n");
+    printf("  --search-chairs N    Largest chair count to consider (default 20)\n");
+    printf("  --ta-cost X          Cost of one TA (default 10)\n");
+    printf("  --chair-cost X       Cost of one chair (default 1)\n");
+    printf("  --jobs N             Worker threads for parallel replications (default: online CPUs)\n");
+    printf("  --cache-dir DIR      Reuse replication results stored in DIR (created if missing)\n");
+    printf("  --priority-classes K Students fall into classes 0 (most urgent) .. K-1 (max %d)\n", MAX_PRIORITY_CLASSES);
+    printf("  --class-weights LIST Comma-separated relative frequency of each class (default equal)\n");
+    printf("  --aging-rate X       Classes a waiting student climbs per second waited (default 0)\n");
+    printf("  --patience X         Mean exponential time a seated student waits before giving up (default: forever)\n");
+    printf("  --topology T         shared (one waiting room) or per-ta (each TA owns a share of the chairs)\n");
+    printf("  --routing R          Per-TA routing: jsq (shortest queue), p2c (power of two choices) or random\n");
+    printf("  --steal              Per-TA queues: an idle TA with an empty queue serves a busy TA's student\n");
+    printf("  --batch B            A TA calls up to B waiting students into one group consultation (max %d)\n",
+           MAX_BATCH_SIZE);
+    printf("  --batch-growth X     Extra group-session length per additional student, as a fraction (default 0.25)\n");
+    printf("  --wake-setup X       Seconds a sleeping TA needs to wake up before consulting (default 0)\n");
+    printf("  --stay-awake T       A TA idle for longer than T seconds falls asleep (default 0)\n");
+    printf("  --break-every P      Each TA takes a break every P seconds, staggered across TAs\n");
+    printf("  --break-length L     Length of each break in seconds\n");
+    printf("  --topics K           Students bring one of K question topics; TAs only take topics they know (max %d)\n",
+           MAX_TOPICS);
+    printf("  --ta-skills LIST     Topics per TA with optional speeds, e.g. 0:1.5+1,1+2:0.8 (default: all, speed 1)\n");
+    printf("  --skill-policy P     Idle TA a seated student goes to: longest-idle or weighted (by speed)\n");
+    printf("  --closed H           Closed population: the students keep returning; simulate H seconds in virtual time\n");
+    printf("  --think-mean X       Closed population: mean exponential time between visits (default 30)\n");
+    printf("  --population-sweep   Closed population: throughput for population sizes up to --students\n");
+    printf("  --network LIST       Network of offices as TASxCHAIRS[:MEAN], e.g. 2x5:2.5,1x3 (max %d); students arrive at the first\n",
+           MAX_OFFICES);
+    printf("  --network-routing M  Chance of moving on from office i to j, rows separated by ';' (default: in order)\n");
+    printf("  --travel-time X      Network: seconds to walk between offices (default 0)\n");
+    printf("  --network-threads N  Network: simulate the offices on N threads\n");
+    printf("  --network-engine E   Network threads: conservative (travel time as lookahead) or optimistic (Time Warp)\n");
+    printf("  --optimism-window X  Optimistic engine: run at most X seconds past the GVT (default: %d mean\n"
+           "                       consultations plus the travel time). Wider lets offices speculate further, but\n"
+           "                       beyond a few consultations most of that work is rolled back; inf for unbounded\n",
+           OPTIMISM_CONSULTATIONS);
+    printf("  --network-benchmark  Network: also run every engine on the same model and compare speed and results\n");
+    printf("  --calendar KIND      Virtual time: pending-event set, heap, pairing, calendar or ladder (default heap)\n");
+    printf("  --calendar-benchmark Time every calendar on the hold model at queue sizes 10 to %d\n", HOLD_MAX_SIZE);
+    printf("  --arena-stats        Virtual time: report how replication memory came from the per-thread arenas\n");
+    printf("  --sharing-benchmark  Time a shared atomic counter against packed and cache-line-padded per-thread shards\n");
+    printf("  --handoff-benchmark  Time the student-to-TA handoff unpinned and pinned to one CPU, one node or two\n");
+    printf("  --quiet              Threaded mode: print only the summary\n");
+}
+
+int parse_class_weights(const char* list, struct sim_config* cfg) {
+    char* end;
+    for (int k = 0; k < MAX_PRIORITY_CLASSES; k++) {
+        cfg->class_weights[k] = strtod(list, &end);
+        if (end == list || cfg->class_weights[k] < 0.0) {
+            fprintf(stderr, "Invalid class weight list '%s'\n", list);
+            return 1;
+        }
+        if (*end != ',') return 0;
+        list = end + 1;
     }
-    return (rand() % (max - min + 1)) + min;
+    fprintf(stderr, "At most %d class weights are supported\n", MAX_PRIORITY_CLASSES);
+    return 1;
 }
 
-// --- TA Thread Function ---
-void* ta_thread_func(void* arg) {
-    printf("TA: Office is open! Ready for students.\n");
+// "0:1.5+1,1+2:0.8": TA 0 knows topics 0 (at 1.5 times the normal speed) and 1,
+// TA 1 knows topics 1 and 2 (at 0.8 times). Returns the number of TAs listed, or -1.
+int parse_ta_skills(const char* spec, struct sim_config* cfg) {
+    const char* p = spec;
+    char* end;
+    int ta = 0;
+    memset(cfg->skill_speed, 0, sizeof(cfg->skill_speed));
+    while (ta < MAX_SKILLED_TAS) {
+        long topic = strtol(p, &end, 10);
+        double speed = 1.0;
+        if (end == p || topic < 0 || topic >= MAX_TOPICS) break;
+        p = end;
+        if (*p == ':') {
+            speed = strtod(p + 1, &end);
+            if (end == p + 1 || speed <= 0.0) break;
+            p = end;
+        }
+        cfg->skill_speed[ta][topic] = speed;
+        if (*p == '+') {
+            p++;
+            continue;
+        }
+        ta++;
+        if (*p == '\0') return ta;
+        if (*p != ',') break;
+        p++;
+    }
+    fprintf(stderr, "Invalid TA skill list '%s' (expected e.g. 0:1.5+1,1+2:0.8 for at most %d TAs)\n", spec,
+            MAX_SKILLED_TAS);
+    return -1;
+}
 
-    while (1) { // TA works indefinitely (or until all students are processed if we add such logic)
-        printf("TA: Checking for students or going to sleep...\n");
-        sem_wait(&student_present_for_ta_sem); // Wait for a student to be present 
+// Precomputes the eligibility bitmasks and checks every topic has a TA
+int build_skill_masks(struct sim_config* cfg, int skilled_tas) {
+    if (skilled_tas == 0) {
+        // No --ta-skills: every TA knows every topic at normal speed
+        for (int ta = 0; ta < MAX_SKILLED_TAS; ta++) {
+            for (int topic = 0; topic < cfg->num_topics; topic++) cfg->skill_speed[ta][topic] = 1.0;
+        }
+    } else if (skilled_tas != cfg->num_tas) {
+        fprintf(stderr, "--ta-skills lists %d TA(s) but there are %d\n", skilled_tas, cfg->num_tas);
+        return 1;
+    }
+    memset(cfg->topic_tas, 0, sizeof(cfg->topic_tas));
+    memset(cfg->ta_topics, 0, sizeof(cfg->ta_topics));
+    for (int ta = 0; ta < MAX_SKILLED_TAS; ta++) {
+        for (int topic = 0; topic < MAX_TOPICS; topic++) {
+            if (cfg->skill_speed[ta][topic] <= 0.0) continue;
+            if (topic >= cfg->num_topics) {
+                fprintf(stderr, "TA %d has a skill for topic %d, but there are only %d topics\n", ta, topic,
+                        cfg->num_topics);
+                return 1;
+            }
+            cfg->topic_tas[topic] |= 1ULL << ta;
+            cfg->ta_topics[ta] |= 1ULL << topic;
+        }
+    }
+    for (int topic = 0; topic < cfg->num_topics; topic++) {
+        if (cfg->topic_tas[topic] == 0) {
+            fprintf(stderr, "No TA knows topic %d\n", topic);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        // A student is present and has taken a chair (and signaled).
-        printf("TA: A student is present. Calling them in.\n");
-        sem_post(&ta_ready_for_student_sem); // Signal to the specific student that TA is ready 
+// "2x5:2.5,1x3": office 0 has 2 TAs and 5 chairs with exponential consultations of mean
+// 2.5 s, office 1 has 1 TA and 3 chairs with the base service distribution
+int parse_network(const char* spec, struct sim_config* cfg) {
+    const char* p = spec;
+    char* end;
+    int n = 0;
+    while (n < MAX_OFFICES) {
+        struct office_spec* office = &cfg->offices[n];
+        office->num_tas = (int)strtol(p, &end, 10);
+        if (end == p || *end != 'x' || office->num_tas < 1) break;
+        p = end + 1;
+        office->max_chairs = (int)strtol(p, &end, 10);
+        if (end == p || office->max_chairs < 0) break;
+        p = end;
+        office->service_mean = 0.0;
+        if (*p == ':') {
+            office->service_mean = strtod(p + 1, &end);
+            if (end == p + 1 || office->service_mean <= 0.0) break;
+            p = end;
+        }
+        n++;
+        if (*p == '\0') {
+            cfg->num_offices = n;
+            return 0;
+        }
+        if (*p != ',') break;
+        p++;
+    }
+    fprintf(stderr, "Invalid office list '%s' (expected e.g. 2x5:2.5,1x3 for at most %d offices)\n", spec, MAX_OFFICES);
+    return 1;
+}
 
-        int help_duration = random_int(TA_HELP_MIN_SECONDS, TA_HELP_MAX_SECONDS);
-        printf("TA: Helping a student for %d seconds...\n", help_duration);
-        sleep(help_duration);
+// "0,0.6,0.2;0.1,0,0.3;0,0,0": row i holds the chance of moving on from office i to
+// each office; whatever is left of the row is the chance of leaving. Returns the
+// number of offices (rows and columns), or -1.
+int parse_network_routing(const char* spec, struct sim_config* cfg) {
+    const char* p = spec;
+    char* end;
+    int rows = 0, columns = 0, j = 0;
+    memset(cfg->office_routing, 0, sizeof(cfg->office_routing));
+    while (rows < MAX_OFFICES && j < MAX_OFFICES) {
+        double chance = strtod(p, &end);
+        if (end == p || chance < 0.0) break;
+        cfg->office_routing[rows][j++] = chance;
+        p = end;
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (rows == 0) columns = j;
+        if (j != columns) break;
+        rows++;
+        j = 0;
+        if (*p == '\0' && rows == columns) return rows;
+        if (*p != ';') break;
+        p++;
+    }
+    fprintf(stderr, "Invalid routing matrix '%s' (expected a square matrix with rows like 0,0.6 separated by ';')\n",
+            spec);
+    return -1;
+}
 
-        printf("TA: Finished helping the student.\n");
-        sem_post(&consultation_finished_sem); // Signal that consultation for this student is over
-                                              // TA will loop and wait for the next student 
+int parse_distribution(const char* name, int* dist) {
+    if (strcmp(name, "uniform") == 0) {
+        *dist = DIST_UNIFORM;
+    } else if (strcmp(name, "exp") == 0 || strcmp(name, "exponential") == 0) {
+        *dist = DIST_EXPONENTIAL;
+    } else {
+        fprintf(stderr, "Unknown distribution '%s' (expected uniform or exp)\n", name);
+        return 1;
     }
-    pthread_exit(NULL);
+    return 0;
 }
 
-// --- Student Thread Function ---
-void* student_thread_func(void* student_id_ptr) {
-    int student_id = *(int*)student_id_ptr;
-    free(student_id_ptr); // Free the allocated memory for the ID
+int parse_options(int argc, char** argv, struct sim_config* cfg) {
+    enum { OPT_STUDENTS = 1000, OPT_CHAIRS, OPT_SEED, OPT_TIME_SCALE, OPT_VIRTUAL, OPT_REPLICATIONS,
+           OPT_ANTITHETIC, OPT_COMPARE_CHAIRS, OPT_TAS, OPT_ARRIVAL_DIST, OPT_ARRIVAL_MEAN, OPT_SERVICE_DIST,
+           OPT_SERVICE_MEAN, OPT_ANALYTIC, OPT_VALIDATE, OPT_OPTIMIZE, OPT_SLA_P95_WAIT, OPT_SLA_BALK_PCT,
+           OPT_SEARCH_TAS, OPT_SEARCH_CHAIRS, OPT_TA_COST, OPT_CHAIR_COST, OPT_JOBS, OPT_CACHE_DIR,
+           OPT_PRIORITY_CLASSES, OPT_CLASS_WEIGHTS, OPT_AGING_RATE, OPT_PATIENCE, OPT_TOPOLOGY, OPT_ROUTING, OPT_STEAL, OPT_BATCH, OPT_BATCH_GROWTH, OPT_WAKE_SETUP,
+           OPT_STAY_AWAKE, OPT_BREAK_EVERY, OPT_BREAK_LENGTH, OPT_TOPICS, OPT_TA_SKILLS, OPT_SKILL_POLICY, OPT_CLOSED,
+           OPT_THINK_MEAN, OPT_POPULATION_SWEEP, OPT_NETWORK, OPT_NETWORK_ROUTING, OPT_TRAVEL_TIME, OPT_NETWORK_THREADS,
+           OPT_NETWORK_ENGINE, OPT_NETWORK_BENCHMARK, OPT_OPTIMISM_WINDOW, OPT_CALENDAR, OPT_CALENDAR_BENCHMARK, OPT_ARENA_STATS,
+           OPT_SHARING_BENCHMARK, OPT_STUDENT_MODEL, OPT_FIBER_WORKERS,
+           OPT_FIBER_STACK, OPT_THREAD_STACK, OPT_THREAD_GUARD, OPT_MAX_STUDENT_THREADS,
+           OPT_PIN_TAS, OPT_PIN_WORKERS, OPT_HANDOFF_BENCHMARK, OPT_TA_WAIT, OPT_SPIN_BUDGET, OPT_QUIET, OPT_HELP };
+    static const struct option options[] = {
+        { "students", required_argument, NULL, OPT_STUDENTS },
+        { "chairs", required_argument, NULL, OPT_CHAIRS },
+        { "seed", required_argument, NULL, OPT_SEED },
+        { "time-scale", required_argument, NULL, OPT_TIME_SCALE },
+        { "virtual", no_argument, NULL, OPT_VIRTUAL },
+        { "replications", required_argument, NULL, OPT_REPLICATIONS },
+        { "antithetic", no_argument, NULL, OPT_ANTITHETIC },
+        { "compare-chairs", required_argument, NULL, OPT_COMPARE_CHAIRS },
+        { "tas", required_argument, NULL, OPT_TAS },
+        { "arrival-dist", required_argument, NULL, OPT_ARRIVAL_DIST },
+        { "arrival-mean", required_argument, NULL, OPT_ARRIVAL_MEAN },
+        { "service-dist", required_argument, NULL, OPT_SERVICE_DIST },
+        { "service-mean", required_argument, NULL, OPT_SERVICE_MEAN },
+        { "analytic", no_argument, NULL, OPT_ANALYTIC },
+        { "validate", no_argument, NULL, OPT_VALIDATE },
+        { "optimize", no_argument, NULL, OPT_OPTIMIZE },
+        { "sla-p95-wait", required_argument, NULL, OPT_SLA_P95_WAIT },
+        { "sla-balk-pct", required_argument, NULL, OPT_SLA_BALK_PCT },
+        { "search-tas", required_argument, NULL, OPT_SEARCH_TAS },
+        { "search-chairs", required_argument, NULL, OPT_SEARCH_CHAIRS },
+        { "ta-cost", required_argument, NULL, OPT_TA_COST },
+        { "chair-cost", required_argument, NULL, OPT_CHAIR_COST },
+        { "jobs", required_argument, NULL, OPT_JOBS },
+        { "cache-dir", required_argument, NULL, OPT_CACHE_DIR },
+        { "priority-classes", required_argument, NULL, OPT_PRIORITY_CLASSES },
+        { "class-weights", required_argument, NULL, OPT_CLASS_WEIGHTS },
+        { "aging-rate", required_argument, NULL, OPT_AGING_RATE },
+        { "patience", required_argument, NULL, OPT_PATIENCE },
+        { "topology", required_argument, NULL, OPT_TOPOLOGY },
+        { "routing", required_argument, NULL, OPT_ROUTING },
+        { "steal", no_argument, NULL, OPT_STEAL },
+        { "batch", required_argument, NULL, OPT_BATCH },
+        { "batch-growth", required_argument, NULL, OPT_BATCH_GROWTH },
+        { "wake-setup", required_argument, NULL, OPT_WAKE_SETUP },
+        { "stay-awake", required_argument, NULL, OPT_STAY_AWAKE },
+        { "break-every", required_argument, NULL, OPT_BREAK_EVERY },
+        { "break-length", required_argument, NULL, OPT_BREAK_LENGTH },
+        { "topics", required_argument, NULL, OPT_TOPICS },
+        { "ta-skills", required_argument, NULL, OPT_TA_SKILLS },
+        { "skill-policy", required_argument, NULL, OPT_SKILL_POLICY },
+        { "closed", required_argument, NULL, OPT_CLOSED },
+        { "think-mean", required_argument, NULL, OPT_THINK_MEAN },
+        { "population-sweep", no_argument, NULL, OPT_POPULATION_SWEEP },
+        { "network", required_argument, NULL, OPT_NETWORK },
+        { "network-routing", required_argument, NULL, OPT_NETWORK_ROUTING },
+        { "travel-time", required_argument, NULL, OPT_TRAVEL_TIME },
+        { "network-threads", required_argument, NULL, OPT_NETWORK_THREADS },
+        { "network-engine", required_argument, NULL, OPT_NETWORK_ENGINE },
+        { "network-benchmark", no_argument, NULL, OPT_NETWORK_BENCHMARK },
+        { "optimism-window", required_argument, NULL, OPT_OPTIMISM_WINDOW },
+        { "calendar", required_argument, NULL, OPT_CALENDAR },
+        { "calendar-benchmark", no_argument, NULL, OPT_CALENDAR_BENCHMARK },
+        { "arena-stats", no_argument, NULL, OPT_ARENA_STATS },
+        { "sharing-benchmark", no_argument, NULL, OPT_SHARING_BENCHMARK },
+        { "student-model", required_argument, NULL, OPT_STUDENT_MODEL },
+        { "fiber-workers", required_argument, NULL, OPT_FIBER_WORKERS },
+        { "fiber-stack", required_argument, NULL, OPT_FIBER_STACK },
+        { "thread-stack", required_argument, NULL, OPT_THREAD_STACK },
+        { "thread-guard", required_argument, NULL, OPT_THREAD_GUARD },
+        { "max-student-threads", required_argument, NULL, OPT_MAX_STUDENT_THREADS },
+        { "pin-tas", required_argument, NULL, OPT_PIN_TAS },
+        { "pin-workers", required_argument, NULL, OPT_PIN_WORKERS },
+        { "handoff-benchmark", no_argument, NULL, OPT_HANDOFF_BENCHMARK },
+        { "ta-wait", required_argument, NULL, OPT_TA_WAIT },
+        { "spin-budget", required_argument, NULL, OPT_SPIN_BUDGET },
+        { "quiet", no_argument, NULL, OPT_QUIET },
+        { "help", no_argument, NULL, OPT_HELP },
+        { NULL, 0, NULL, 0 },
+    };
 
-    // Simulate random arrival time
-    sleep(random_int(STUDENT_ARRIVAL_MIN_SECONDS, STUDENT_ARRIVAL_MAX_SECONDS));
-    printf("Student %d: Arrived at TA's office.\n", student_id);
+    int seed_given = 0, window_given = 0, skilled_tas = 0, routing_offices = 0, opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_STUDENTS: cfg->num_students = atoi(optarg); break;
+        case OPT_CHAIRS: cfg->max_chairs = atoi(optarg); break;
+        case OPT_SEED: cfg->seed = strtoull(optarg, NULL, 10); seed_given = 1; break;
+        case OPT_TIME_SCALE: cfg->time_scale = atof(optarg); break;
+        case OPT_VIRTUAL: cfg->virtual_time = 1; break;
+        case OPT_REPLICATIONS: cfg->replications = atoi(optarg); break;
+        case OPT_ANTITHETIC: cfg->antithetic = 1; break;
+        case OPT_COMPARE_CHAIRS: cfg->compare_chairs = atoi(optarg); break;
+        case OPT_TAS: cfg->num_tas = atoi(optarg); break;
+        case OPT_ARRIVAL_DIST: if (parse_distribution(optarg, &cfg->arrival_dist) != 0) return 1; break;
+        case OPT_ARRIVAL_MEAN: cfg->arrival_mean = atof(optarg); break;
+        case OPT_SERVICE_DIST: if (parse_distribution(optarg, &cfg->service_dist) != 0) return 1; break;
+        case OPT_SERVICE_MEAN: cfg->service_mean = atof(optarg); break;
+        case OPT_ANALYTIC: cfg->analytic = 1; break;
+        case OPT_VALIDATE: cfg->validate = 1; cfg->virtual_time = 1; break;
+        case OPT_OPTIMIZE: cfg->optimize = 1; cfg->virtual_time = 1; break;
+        case OPT_SLA_P95_WAIT: cfg->sla_p95_wait = atof(optarg); break;
+        case OPT_SLA_BALK_PCT: cfg->sla_balk_pct = atof(optarg); break;
+        case OPT_SEARCH_TAS: cfg->search_tas = atoi(optarg); break;
+        case OPT_SEARCH_CHAIRS: cfg->search_chairs = atoi(optarg); break;
+        case OPT_TA_COST: cfg->ta_cost = atof(optarg); break;
+        case OPT_CHAIR_COST: cfg->chair_cost = atof(optarg); break;
+        case OPT_JOBS: cfg->jobs = atoi(optarg); break;
+        case OPT_CACHE_DIR: cfg->cache_dir = optarg; break;
+        case OPT_PRIORITY_CLASSES: cfg->priority_classes = atoi(optarg); break;
+        case OPT_CLASS_WEIGHTS: if (parse_class_weights(optarg, cfg) != 0) return 1; break;
+        case OPT_AGING_RATE: cfg->aging_rate = atof(optarg); break;
+        case OPT_PATIENCE: cfg->patience_mean = atof(optarg); break;
+        case OPT_TOPOLOGY:
+            if (strcmp(optarg, "shared") == 0) cfg->topology = TOPOLOGY_SHARED;
+            else if (strcmp(optarg, "per-ta") == 0) cfg->topology = TOPOLOGY_PER_TA;
+            else { fprintf(stderr, "Unknown topology '%s' (expected shared or per-ta)\n", optarg); return 1; }
+            break;
+        case OPT_ROUTING:
+            if (strcmp(optarg, "jsq") == 0) cfg->routing = ROUTING_JSQ;
+            else if (strcmp(optarg, "p2c") == 0) cfg->routing = ROUTING_P2C;
+            else if (strcmp(optarg, "random") == 0) cfg->routing = ROUTING_RANDOM;
+            else { fprintf(stderr, "Unknown routing '%s' (expected jsq, p2c or random)\n", optarg); return 1; }
+            break;
+        case OPT_STEAL: cfg->work_stealing = 1; break;
+        case OPT_BATCH: cfg->batch_size = atoi(optarg); break;
+        case OPT_BATCH_GROWTH: cfg->batch_growth = atof(optarg); break;
+        case OPT_WAKE_SETUP: cfg->wake_setup = atof(optarg); break;
+        case OPT_STAY_AWAKE: cfg->stay_awake = atof(optarg); break;
+        case OPT_BREAK_EVERY: cfg->break_every = atof(optarg); break;
+        case OPT_BREAK_LENGTH: cfg->break_length = atof(optarg); break;
+        case OPT_TOPICS: cfg->num_topics = atoi(optarg); break;
+        case OPT_TA_SKILLS:
+            if ((skilled_tas = parse_ta_skills(optarg, cfg)) < 0) return 1;
+            break;
+        case OPT_SKILL_POLICY:
+            if (strcmp(optarg, "longest-idle") == 0) cfg->skill_policy = SKILL_LONGEST_IDLE;
+            else if (strcmp(optarg, "weighted") == 0) cfg->skill_policy = SKILL_WEIGHTED;
+            else { fprintf(stderr, "Unknown skill policy '%s' (expected longest-idle or weighted)\n", optarg); return 1; }
+            break;
+        case OPT_CLOSED: cfg->closed_horizon = atof(optarg); break;
+        case OPT_THINK_MEAN: cfg->think_mean = atof(optarg); break;
+        case OPT_POPULATION_SWEEP: cfg->population_sweep = 1; break;
+        case OPT_NETWORK: if (parse_network(optarg, cfg) != 0) return 1; break;
+        case OPT_NETWORK_ROUTING:
+            if ((routing_offices = parse_network_routing(optarg, cfg)) < 0) return 1;
+            break;
+        case OPT_TRAVEL_TIME: cfg->travel_time = atof(optarg); break;
+        case OPT_NETWORK_THREADS: cfg->network_threads = atoi(optarg); break;
+        case OPT_NETWORK_ENGINE:
+            if (strcmp(optarg, "conservative") == 0) cfg->network_engine = NETWORK_CONSERVATIVE;
+            else if (strcmp(optarg, "optimistic") == 0) cfg->network_engine = NETWORK_OPTIMISTIC;
+            else { fprintf(stderr, "Unknown network engine '%s' (expected conservative or optimistic)\n", optarg); return 1; }
+            break;
+        case OPT_NETWORK_BENCHMARK: cfg->network_benchmark = 1; break;
+        case OPT_OPTIMISM_WINDOW: cfg->optimism_window = atof(optarg); window_given = 1; break;
+        case OPT_CALENDAR:
+            if (strcmp(optarg, "heap") == 0) cfg->calendar = CALENDAR_BINARY_HEAP;
+            else if (strcmp(optarg, "pairing") == 0) cfg->calendar = CALENDAR_PAIRING_HEAP;
+            else if (strcmp(optarg, "calendar") == 0) cfg->calendar = CALENDAR_QUEUE;
+            else if (strcmp(optarg, "ladder") == 0) cfg->calendar = CALENDAR_LADDER_QUEUE;
+            else { fprintf(stderr, "Unknown calendar '%s' (expected heap, pairing, calendar or ladder)\n", optarg); return 1; }
+            break;
+        case OPT_CALENDAR_BENCHMARK: cfg->calendar_benchmark = 1; break;
+        case OPT_ARENA_STATS: cfg->arena_stats = 1; break;
+        case OPT_SHARING_BENCHMARK: cfg->sharing_benchmark = 1; break;
+        case OPT_STUDENT_MODEL:
+            if (strcmp(optarg, "threads") == 0) cfg->student_model = STUDENTS_THREADS;
+            else if (strcmp(optarg, "coroutines") == 0) cfg->student_model = STUDENTS_COROUTINES;
+            else if (strcmp(optarg, "fibers") == 0) cfg->student_model = STUDENTS_FIBERS;
+            else { fprintf(stderr, "Unknown student model '%s' (expected threads, coroutines or fibers)\n", optarg); return 1; }
+            break;
+        case OPT_FIBER_WORKERS: cfg->fiber_workers = atoi(optarg); break;
+        case OPT_FIBER_STACK: cfg->fiber_stack_kb = atoi(optarg); break;
+        case OPT_THREAD_STACK: cfg->thread_stack_kb = atoi(optarg); break;
+        case OPT_THREAD_GUARD: cfg->thread_guard_kb = atoi(optarg); break;
+        case OPT_MAX_STUDENT_THREADS: cfg->max_student_threads = atoi(optarg); break;
+        case OPT_PIN_TAS:
+        case OPT_PIN_WORKERS: {
+            int* cpus = opt == OPT_PIN_TAS ? cfg->pin_ta_cpus : cfg->pin_worker_cpus;
+            int n = parse_cpu_list(optarg, cpus, MAX_PINNED_CPUS);
+            if (n < 0) {
+                fprintf(stderr, "Invalid CPU list '%s' (expected e.g. 0,2-3, at most %d CPUs)\n", optarg, MAX_PINNED_CPUS);
+                return 1;
+            }
+            for (int i = 0; i < n; i++) {
+                if (cpus[i] >= CPU_SETSIZE || cpus[i] >= sysconf(_SC_NPROCESSORS_CONF)) {
+                    fprintf(stderr, "CPU %d does not exist\n", cpus[i]);
+                    return 1;
+                }
+            }
+            *(opt == OPT_PIN_TAS ? &cfg->num_pin_ta_cpus : &cfg->num_pin_worker_cpus) = n;
+            break;
+        }
+        case OPT_HANDOFF_BENCHMARK: cfg->handoff_benchmark = 1; break;
+        case OPT_TA_WAIT:
+            if (strcmp(optarg, "block") == 0) cfg->ta_wait = TA_WAIT_BLOCK;
+            else if (strcmp(optarg, "spin") == 0) cfg->ta_wait = TA_WAIT_SPIN;
+            else if (strcmp(optarg, "adaptive") == 0) cfg->ta_wait = TA_WAIT_ADAPTIVE;
+            else { fprintf(stderr, "Unknown TA wait policy '%s' (expected block, spin or adaptive)\n", optarg); return 1; }
+            break;
+        case OPT_SPIN_BUDGET: cfg->spin_budget_us = atof(optarg); break;
+        case OPT_QUIET: cfg->quiet = 1; break;
+        case OPT_HELP: usage(argv[0]); exit(0);
+        default: usage(argv[0]); return 1;
+        }
+    }
 
-    pthread_mutex_lock(&count_mutex);
-    if (num_students_in_chairs < MAX_CHAIRS) { // Check if there's a chair available
-        num_students_in_chairs++;
-        sem_wait(&waiting_room_chairs_sem); // Take one of the available chair slots
-        printf("Student %d: Took a chair. (Waiting students in chairs: %d)\n", student_id, num_students_in_chairs);
-        pthread_mutex_unlock(&count_mutex);
+    if (cfg->closed_horizon > 0.0 || cfg->num_offices > 0) {
+        cfg->virtual_time = 1; // There is no threaded closed population or network: one thread per visit would not scale
+    }
+    if (!seed_given) {
+        cfg->seed = (uint64_t)time(NULL);
+    }
+    if (cfg->jobs < 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg->jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (cfg->num_students < 1 || cfg->max_chairs < 0 || cfg->replications < 1 || cfg->time_scale <= 0.0 ||
+        cfg->num_tas < 1 || cfg->arrival_mean <= 0.0 || cfg->service_mean <= 0.0 || cfg->search_tas < 1 ||
+        cfg->search_chairs < 1 || cfg->priority_classes < 1 || cfg->priority_classes > MAX_PRIORITY_CLASSES ||
+        cfg->aging_rate < 0.0 || cfg->batch_size < 1 || cfg->batch_size > MAX_BATCH_SIZE || cfg->batch_growth < 0.0) {
+        fprintf(stderr, "Invalid configuration: need students >= 1, chairs >= 0, TAs >= 1, replications >= 1, "
+                        "positive means and time scale, 1..%d priority classes, a non-negative aging rate, "
+                        "a batch size of 1..%d and a non-negative batch growth\n",
+                MAX_PRIORITY_CLASSES, MAX_BATCH_SIZE);
+        return 1;
+    }
+    if (!cfg->virtual_time && cfg->topology == TOPOLOGY_PER_TA && cfg->priority_classes > 1) {
+        fprintf(stderr, "Threaded per-TA queues are FIFO: --priority-classes needs --topology shared or --virtual\n");
+        return 1;
+    }
+    if (cfg->closed_horizon < 0.0 || cfg->think_mean <= 0.0) {
+        fprintf(stderr, "--closed needs a non-negative horizon and --think-mean a positive mean\n");
+        return 1;
+    }
+    if (cfg->wake_setup < 0.0 || cfg->stay_awake < 0.0 || cfg->break_every < 0.0 || cfg->break_length < 0.0 ||
+        (cfg->break_every > 0.0 && cfg->break_length >= cfg->break_every)) {
+        fprintf(stderr, "Wake-up and break times must be non-negative, and a break shorter than the time between breaks\n");
+        return 1;
+    }
+    if (cfg->population_sweep && cfg->closed_horizon <= 0.0) {
+        fprintf(stderr, "--population-sweep needs --closed\n");
+        return 1;
+    }
+    if (cfg->num_topics < 1 || cfg->num_topics > MAX_TOPICS) {
+        fprintf(stderr, "--topics must be between 1 and %d\n", MAX_TOPICS);
+        return 1;
+    }
+    if (cfg->num_topics > 1) {
+        if (cfg->topology != TOPOLOGY_SHARED || cfg->num_tas > MAX_SKILLED_TAS ||
+            (cfg->optimize && (skilled_tas > 0 || cfg->search_tas > MAX_SKILLED_TAS))) {
+            fprintf(stderr, "Skill-based routing needs a shared waiting room and at most %d TAs, and --optimize "
+                            "cannot vary the TA count of a --ta-skills list\n", MAX_SKILLED_TAS);
+            return 1;
+        }
+        if (build_skill_masks(cfg, skilled_tas) != 0) {
+            return 1;
+        }
+    }
+    if (cfg->num_offices > 0) {
+        double visits[MAX_OFFICES];
+        if (routing_offices == 0) {
+            // Default: a tandem line, every student visits each office once in order
+            for (int i = 0; i + 1 < cfg->num_offices; i++) cfg->office_routing[i][i + 1] = 1.0;
+        } else if (routing_offices != cfg->num_offices) {
+            fprintf(stderr, "--network-routing has %d rows but --network lists %d offices\n", routing_offices,
+                    cfg->num_offices);
+            return 1;
+        }
+        for (int i = 0; i < cfg->num_offices; i++) {
+            double total = 0.0;
+            for (int j = 0; j < cfg->num_offices; j++) total += cfg->office_routing[i][j];
+            if (total > 1.0 + 1e-9) {
+                fprintf(stderr, "Row %d of --network-routing adds up to more than 1\n", i);
+                return 1;
+            }
+        }
+        if (!window_given) {
+            // Unbounded, offices run so far ahead that nearly everything is rolled back
+            double base = cfg->service_dist == DIST_EXPONENTIAL ? cfg->service_mean
+                                                                : (cfg->help_min_seconds + cfg->help_max_seconds) / 2.0;
+            double longest = 0.0;
+            for (int i = 0; i < cfg->num_offices; i++) {
+                double mean = cfg->offices[i].service_mean > 0.0 ? cfg->offices[i].service_mean : base;
+                if (mean > longest) longest = mean;
+            }
+            cfg->optimism_window = OPTIMISM_CONSULTATIONS * longest + cfg->travel_time;
+        }
+        if (network_visit_ratios(cfg, visits) != 0) {
+            fprintf(stderr, "--network-routing never lets some students leave the network\n");
+            return 1;
+        }
+        if (cfg->closed_horizon > 0.0 || cfg->analytic || cfg->validate || cfg->optimize || cfg->replications > 1 ||
+            cfg->antithetic || cfg->compare_chairs > 0 || cfg->num_topics > 1 || cfg->break_every > 0.0 ||
+            cfg->travel_time < 0.0 || cfg->network_threads < 1 || !(cfg->optimism_window > 0.0) ||
+            (cfg->network_threads > 1 && cfg->network_engine == NETWORK_CONSERVATIVE && cfg->travel_time <= 0.0)) {
+            fprintf(stderr, "--network runs one open replication: it cannot be combined with --closed, --analytic, "
+                            "--validate, --optimize, --replications, --antithetic, --compare-chairs, --topics or "
+                            "--break-every, and needs a non-negative --travel-time (positive for the conservative engine; the "
+                            "optimistic one also runs 0) and a positive --optimism-window\n");
+            return 1;
+        }
+    }
+    if (cfg->work_stealing && (cfg->topology != TOPOLOGY_PER_TA || cfg->num_tas < 2)) {
+        fprintf(stderr, "--steal needs --topology per-ta and at least two TAs\n");
+        return 1;
+    }
+    if (cfg->cache_dir != NULL && prepare_cache_dir(cfg->cache_dir) != 0) {
+        return 1;
+    }
+    if (!cfg->virtual_time && (cfg->replications > 1 || cfg->compare_chairs > 0)) {
+        fprintf(stderr, "--replications and --compare-chairs require --virtual\n");
+        return 1;
+    }
+    if (cfg->student_model == STUDENTS_COROUTINES &&
+        (cfg->virtual_time || cfg->topology != TOPOLOGY_SHARED || cfg->num_topics > 1 || cfg->wake_setup > 0.0 ||
+         cfg->break_every > 0.0)) {
+        fprintf(stderr, "--student-model coroutines runs the threaded mode's shared waiting room: it cannot be "
+                        "combined with --virtual, --topology per-ta, --topics, --wake-setup or --break-every\n");
+        return 1;
+    }
+    if (cfg->student_model == STUDENTS_FIBERS && cfg->virtual_time) {
+        fprintf(stderr, "--student-model fibers is a threaded-mode runtime: it cannot be combined with --virtual\n");
+        return 1;
+    }
+    if (cfg->fiber_workers < 0 || cfg->fiber_stack_kb < 16) {
+        fprintf(stderr, "--fiber-workers must be non-negative and --fiber-stack at least 16 KB\n");
+        return 1;
+    }
+    if ((cfg->thread_stack_kb != 0 && (long)cfg->thread_stack_kb * 1024 < (long)PTHREAD_STACK_MIN) ||
+        cfg->thread_guard_kb < -1 || cfg->max_student_threads < 0) {
+        fprintf(stderr, "--thread-stack must be at least %d KB, --thread-guard and --max-student-threads "
+                        "non-negative\n", (int)(PTHREAD_STACK_MIN / 1024));
+        return 1;
+    }
+    if (cfg->student_model != STUDENTS_THREADS &&
+        (cfg->thread_stack_kb != 0 || cfg->thread_guard_kb >= 0 || cfg->max_student_threads > 0)) {
+        fprintf(stderr, "--thread-stack, --thread-guard and --max-student-threads apply to --student-model threads\n");
+        return 1;
+    }
+    if (cfg->num_pin_ta_cpus > 0 && (cfg->virtual_time || cfg->student_model != STUDENTS_THREADS)) {
+        fprintf(stderr, "--pin-tas pins threaded mode's TA threads: it needs --student-model threads without --virtual "
+                        "(pin fiber workers with --pin-workers)\n");
+        return 1;
+    }
+    if (cfg->spin_budget_us < 0.0) {
+        fprintf(stderr, "--spin-budget must be non-negative\n");
+        return 1;
+    }
+    if (cfg->ta_wait != TA_WAIT_BLOCK && (cfg->virtual_time || cfg->student_model != STUDENTS_THREADS)) {
+        fprintf(stderr, "--ta-wait spin and adaptive poll from TA threads: they need --student-model threads "
+                        "without --virtual\n");
+        return 1;
+    }
+    if (cfg->fiber_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg->fiber_workers = cpus > 0 ? (int)cpus : 1;
+    }
+    return 0;
+}
 
-        printf("Student %d: Informing TA they are ready.\n", student_id);
-        sem_post(&student_present_for_ta_sem); // Announce presence to TA / Wake TA 
+// --- Threaded Simulation ---
+// Where the students' time went, one pass over the student table per phase
+void print_student_phases(const struct student_table* table, int n) {
+    int count[STUDENT_ABANDONED + 1] = { 0 };
+    for (int id = 1; id <= n; id++) {
+        count[table->state[id]]++;
+    }
+    double to_chair = 0.0, in_chair = 0.0, consulting = 0.0, wasted = 0.0;
+    for (int id = 1; id <= n; id++) {
+        if (table->state[id] == STUDENT_SERVED || table->state[id] == STUDENT_ABANDONED) {
+            to_chair += table->seated[id] - table->arrival[id];
+        }
+    }
+    for (int id = 1; id <= n; id++) {
+        if (table->state[id] == STUDENT_SERVED) in_chair += table->called[id] - table->seated[id];
+        else if (table->state[id] == STUDENT_ABANDONED) wasted += table->finished[id] - table->seated[id];
+    }
+    for (int id = 1; id <= n; id++) {
+        if (table->state[id] == STUDENT_SERVED) consulting += table->finished[id] - table->called[id];
+    }
+    int served = count[STUDENT_SERVED], abandoned = count[STUDENT_ABANDONED], seated = served + abandoned;
 
-        sem_wait(&ta_ready_for_student_sem); // Wait for TA to be free and call this specific student 
+    printf("\n--- Student Phases ---\n");
+    printf("Served %d, turned away %d, gave up %d\n", served, count[STUDENT_BALKED], abandoned);
+    printf("Mean simulated time: arrival to chair %.3f s, chair to call %.3f s, call to leaving %.3f s\n",
+           seated > 0 ? to_chair / seated : 0.0, served > 0 ? in_chair / served : 0.0,
+           served > 0 ? consulting / served : 0.0);
+    if (config.patience_mean > 0.0) {
+        print_abandonment(abandoned, n, abandoned > 0 ? wasted / abandoned : 0.0);
+    }
+    printf("Student table: %zu bytes per student, %.1f KB in all\n", STUDENT_TABLE_BYTES,
+           (n + 1) * STUDENT_TABLE_BYTES / 1024.0);
+}
 
-        // Student is now with TA, so they leave their chair.
-        sem_post(&waiting_room_chairs_sem); // Free up the chair slot
+// Orders student IDs by arrival time (uniform arrivals are not drawn in order)
+int compare_arrivals(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    if (students.arrival[x] != students.arrival[y]) return students.arrival[x] < students.arrival[y] ? -1 : 1;
+    return x - y;
+}
 
-        pthread_mutex_lock(&count_mutex);
-        num_students_in_chairs--;
-        pthread_mutex_unlock(&count_mutex);
+// Runs the students as fibers, each created shortly before it arrives so that
+// only the students in or near the office hold a stack
+int run_student_fibers(void) {
+    if (fiber_runtime_start(config.fiber_workers, (size_t)config.fiber_stack_kb * 1024) != 0) {
+        perror("Failed to start the fiber workers");
+        return 1;
+    }
+    int* order = malloc(config.num_students * sizeof(int));
+    if (order == NULL) {
+        perror("Failed to allocate simulation state");
+        return 1;
+    }
+    for (int i = 0; i < config.num_tas; i++) {
+        if (fiber_spawn(ta_thread_func, (void*)(intptr_t)i, 1) != 0) {
+            perror("Failed to create TA fiber");
+            return 1;
+        }
+    }
+    for (int i = 0; i < config.num_students; i++) {
+        order[i] = i + 1;
+    }
+    qsort(order, config.num_students, sizeof(int), compare_arrivals);
+    for (int i = 0; i < config.num_students; i++) {
+        double until_spawn = students.arrival[order[i]] - FIBER_SPAWN_LEAD - elapsed_seconds() / config.time_scale;
+        if (until_spawn > 0.0) {
+            sleep_simulated(until_spawn); // Not on a fiber: sleeps this thread
+        }
+        if (fiber_spawn(student_thread_func, (void*)(intptr_t)order[i], 0) != 0) {
+            perror("Failed to create student fiber");
+            return 1;
+        }
+    }
+    fiber_runtime_wait();
+    fiber_runtime_stop(); // The TAs stay parked where they are
+    free(order);
+    return 0;
+}
 
-        printf("Student %d: Consulting with TA.\n", student_id);
-        sem_wait(&consultation_finished_sem); // Wait for TA to finish this consultation
+// Pins the TA thread per --pin-tas before it opens the office
+void* pinned_ta_thread_func(void* arg) {
+    pin_self(pinned_cpu(config.pin_ta_cpus, config.num_pin_ta_cpus, (int)(intptr_t)arg));
+    return ta_thread_func(arg);
+}
 
-        printf("Student %d: Consultation finished. Leaving the office.\n", student_id);
+// Student threads alive at once, and the slots that bound them under --max-student-threads
+sem_t student_thread_slots;
+int student_threads_alive;          // atomic
+int student_threads_peak;           // atomic
 
-    } else {
-        // No chairs available 
-        pthread_mutex_unlock(&count_mutex);
-        printf("Student %d: No chairs available. Leaving and will come back later.\n", student_id);
+void* counted_student_thread_func(void* arg) {
+    int alive = __atomic_add_fetch(&student_threads_alive, 1, __ATOMIC_RELAXED);
+    int peak = __atomic_load_n(&student_threads_peak, __ATOMIC_RELAXED);
+    while (alive > peak && !__atomic_compare_exchange_n(&student_threads_peak, &peak, alive, 1, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+        // Another thread raised the peak meanwhile: peak now holds its value
+    }
+    student_thread_func(arg);
+    __atomic_sub_fetch(&student_threads_alive, 1, __ATOMIC_RELAXED);
+    if (config.max_student_threads > 0) {
+        sem_post(&student_thread_slots); // Last touch of shared state: the thread is detached
+    }
+    return NULL;
+}
+
+// Thread attributes from --thread-stack and --thread-guard; returns the stack size the threads get
+size_t thread_attr_init(pthread_attr_t* attr, int detached) {
+    pthread_attr_init(attr);
+    if (config.thread_stack_kb > 0) {
+        pthread_attr_setstacksize(attr, (size_t)config.thread_stack_kb * 1024);
+    }
+    if (config.thread_guard_kb >= 0) {
+        pthread_attr_setguardsize(attr, (size_t)config.thread_guard_kb * 1024);
+    }
+    if (detached) {
+        pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED);
     }
+    size_t stack_bytes;
+    pthread_attr_getstacksize(attr, &stack_bytes);
+    return stack_bytes;
+}
+
+void print_thread_costs(const double* create_us, int created, size_t stack_bytes, int late, double lateness) {
+    pthread_attr_t attr;
+    size_t guard_bytes;
+    thread_attr_init(&attr, 0);
+    pthread_attr_getguardsize(&attr, &guard_bytes);
+    pthread_attr_destroy(&attr);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
 
-    pthread_exit(NULL);
+    printf("Student threads: %d created, at most %d alive, %zu KB stacks + %zu KB guard (%.1f MB reserved at peak)\n",
+           created, student_threads_peak, stack_bytes / 1024, guard_bytes / 1024,
+           student_threads_peak * (double)(stack_bytes + guard_bytes) / (1024 * 1024));
+    printf("Thread creation: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n", mean_of(create_us, created),
+           percentile_of(create_us, created, 0.50), percentile_of(create_us, created, 0.99),
+           percentile_of(create_us, created, 1.0));
+    if (config.max_student_threads > 0) {
+        printf("Spawn throttle (%d threads): %d students started after their arrival, %.3f s late on average\n",
+               config.max_student_threads, late, late > 0 ? lateness / late : 0.0);
+    }
+    printf("Peak RSS: %.1f MB\n", usage.ru_maxrss / 1024.0); // ru_maxrss is in KB on Linux
 }
 
-// --- Main Function ---
-int main() {
-    pthread_t ta_thread;
-    pthread_t student_threads[NUM_STUDENTS];
+int run_threaded_simulation(void) {
+    fiber_mode = config.student_model == STUDENTS_FIBERS;
+    pthread_t* ta_threads = calloc(config.num_tas, sizeof(pthread_t));
+    pthread_t* student_threads = calloc(config.num_students, sizeof(pthread_t));
+    ta_counters = aligned_alloc(CACHE_LINE, config.num_tas * sizeof(struct ta_counters));
     int i;
 
-    srand(time(NULL)); // Seed random number generator
+    wait_series = malloc(config.num_students * sizeof(double));
+    wait_series_class = malloc(config.num_students * sizeof(int));
+    wait_series_topic = malloc(config.num_students * sizeof(int));
+    ta_ready_for_student_sem = malloc((config.num_students + 1) * sizeof(struct office_sem));
+    consultation_finished_sem = malloc((config.num_students + 1) * sizeof(struct office_sem));
+    if (ta_threads == NULL || student_threads == NULL || ta_counters == NULL || wait_series == NULL || wait_series_class == NULL || wait_series_topic == NULL ||
+        ta_ready_for_student_sem == NULL || consultation_finished_sem == NULL ||
+        student_table_init(&students, config.num_students) != 0 ||
+        waiting_room_init(&waiting_room, config.max_chairs, config.num_students, NULL) != 0) {
+        perror("Failed to allocate simulation state");
+        return 1;
+    }
+    memset(ta_counters, 0, config.num_tas * sizeof(struct ta_counters));
+    draw_arrival_times(&config, config.seed, config.antithetic, students.arrival);
+    clock_gettime(CLOCK_MONOTONIC, &simulation_start);
 
     // Initialize semaphores
-    sem_init(&waiting_room_chairs_sem, 0, MAX_CHAIRS); // 0: shared between threads, MAX_CHAIRS initial value
-    sem_init(&student_present_for_ta_sem, 0, 0);
-    sem_init(&ta_ready_for_student_sem, 0, 0);
-    sem_init(&consultation_finished_sem, 0, 0);
+    office_sem_init(&sync_state.waiting_room_chairs_sem, config.max_chairs); // max_chairs initial value
+    office_sem_init(&sync_state.student_present_for_ta_sem, 0);
+    for (i = 1; i <= config.num_students; i++) {
+        office_sem_init(&ta_ready_for_student_sem[i], 0);
+        office_sem_init(&consultation_finished_sem[i], 0);
+    }
 
     // Initialize mutex 
-    pthread_mutex_init(&count_mutex, NULL);
+    office_mutex_init(&sync_state.count_mutex);
 
-    printf("TA Office Simulation Started. Total waiting chairs: %d\n", MAX_CHAIRS);
-    printf("Total number of students: %d\n\n", NUM_STUDENTS);
+    printf("TA Office Simulation Started. Total waiting chairs: %d\n", config.max_chairs);
+    printf("Total number of students: %d (seed %llu)\n", config.num_students, (unsigned long long)config.seed);
+    if (config.num_pin_ta_cpus > 0) {
+        print_pinning("TA threads", config.pin_ta_cpus, config.num_pin_ta_cpus, config.num_tas);
+    }
+    if (fiber_mode && config.num_pin_worker_cpus > 0) {
+        print_pinning("Fiber workers", config.pin_worker_cpus, config.num_pin_worker_cpus, config.fiber_workers);
+    }
+    printf("\n");
 
-    // Create TA thread 
-    if (pthread_create(&ta_thread, NULL, ta_thread_func, NULL) != 0) {
-        perror("Failed to create TA thread");
-        return 1;
+    if (config.topology == TOPOLOGY_PER_TA) {
+        ta_queues = aligned_alloc(CACHE_LINE, config.num_tas * sizeof(struct ta_queue)); // calloc only aligns to 16
+        seat_status = calloc(config.num_students + 1, 1);
+        if (ta_queues == NULL || seat_status == NULL) {
+            perror("Failed to allocate per-TA queues");
+            return 1;
+        }
+        memset(ta_queues, 0, config.num_tas * sizeof(struct ta_queue));
+        cpu_set_t home;
+        sched_getaffinity(0, sizeof(home), &home);
+        for (i = 0; i < config.num_tas; i++) {
+            ta_queues[i].chairs = chairs_for_queue(&config, config.max_chairs, i);
+            office_sem_init(&ta_queues[i].student_present_sem, 0);
+            // Abandoned entries stay in the ring until dequeued, so it is sized for every student.
+            // Filled in from the TA's CPU, so a pinned TA's ring lives on its own node.
+            pin_self(pinned_cpu(config.pin_ta_cpus, config.num_pin_ta_cpus, i));
+            if (mpmc_queue_init(&ta_queues[i].queue, config.num_students + 1) != 0) {
+                perror("Failed to allocate per-TA queues");
+                return 1;
+            }
+        }
+        sched_setaffinity(0, sizeof(home), &home);
+    }
+    if (config.num_topics > 1) {
+        topic_rooms = malloc(config.num_topics * sizeof(struct waiting_room));
+        ta_wake_sem = malloc(config.num_tas * sizeof(struct office_sem));
+        skill_busy = malloc(config.num_tas * sizeof(int));
+        skill_idle_since = calloc(config.num_tas, sizeof(double));
+        if (topic_rooms == NULL || ta_wake_sem == NULL || skill_busy == NULL || skill_idle_since == NULL) {
+            perror("Failed to allocate topic rooms");
+            return 1;
+        }
+        for (i = 0; i < config.num_topics; i++) {
+            if (waiting_room_init(&topic_rooms[i], config.max_chairs, config.num_students, NULL) != 0) {
+                perror("Failed to allocate topic rooms");
+                return 1;
+            }
+        }
+        for (i = 0; i < config.num_tas; i++) {
+            office_sem_init(&ta_wake_sem[i], 0);
+            skill_busy[i] = 1; // Until the TA thread is ready for hand-offs
+        }
     }
 
-    // Create student threads 
-    for (i = 0; i < NUM_STUDENTS; i++) {
-        int* student_id = malloc(sizeof(int));
-        if (student_id == NULL) {
-            perror("Failed to allocate memory for student ID");
-            continue; // Skip this student if allocation fails
+    if (fiber_mode) {
+        if (run_student_fibers() != 0) {
+            return 1;
         }
-        *student_id = i + 1; // Student IDs from 1 to N
+    }
+
+    // Create TA threads 
+    pthread_attr_t ta_attr;
+    thread_attr_init(&ta_attr, 0);
+    for (i = 0; i < config.num_tas && !fiber_mode; i++) {
+        if (pthread_create(&ta_threads[i], &ta_attr, pinned_ta_thread_func, (void*)(intptr_t)i) != 0) {
+            perror("Failed to create TA thread");
+            return 1;
+        }
+    }
 
-        if (pthread_create(&student_threads[i], NULL, student_thread_func, student_id) != 0) {
+    // Create student threads. Throttled, they are created in order of arrival as
+    // slots free up, detached so that each one's stack goes as soon as it leaves.
+    int throttled = config.max_student_threads > 0;
+    pthread_attr_t student_attr;
+    size_t stack_bytes = thread_attr_init(&student_attr, throttled);
+    double* create_us = malloc(config.num_students * sizeof(double));
+    int* order = malloc(config.num_students * sizeof(int));
+    if (create_us == NULL || order == NULL) {
+        perror("Failed to allocate simulation state");
+        return 1;
+    }
+    for (i = 0; i < config.num_students; i++) {
+        order[i] = i + 1; // Student IDs from 1 to N; everything else about the student lives in the student table
+    }
+    if (throttled) {
+        qsort(order, config.num_students, sizeof(int), compare_arrivals);
+        sem_init(&student_thread_slots, 0, config.max_student_threads);
+    }
+    int created = 0, late = 0;
+    double lateness = 0.0;
+    for (i = 0; i < config.num_students && !fiber_mode; i++) {
+        if (throttled) {
+            sem_wait(&student_thread_slots);
+            double behind = elapsed_seconds() / config.time_scale - students.arrival[order[i]];
+            if (behind > 0.0) {
+                late++;
+                lateness += behind;
+            }
+        }
+        struct timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        if (pthread_create(&student_threads[i], &student_attr, counted_student_thread_func,
+                           (void*)(intptr_t)order[i]) != 0) {
             perror("Failed to create student thread");
-            free(student_id); // Free memory if thread creation fails
+            if (throttled) sem_post(&student_thread_slots);
+            continue;
         }
-        // Small delay between student thread creations to slightly stagger arrivals further
-        // This is optional as random sleep is already in student_thread_func
-        // sleep(random_int(0,1));
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        create_us[created++] = (after.tv_sec - before.tv_sec) * 1e6 + (after.tv_nsec - before.tv_nsec) / 1e3;
     }
 
-    // Wait for all student threads to complete
-    for (i = 0; i < NUM_STUDENTS; i++) {
+    // Wait for all student threads to complete: detached ones by taking back every slot
+    for (i = 0; i < config.max_student_threads && !fiber_mode; i++) {
+        sem_wait(&student_thread_slots);
+    }
+    for (i = 0; i < config.num_students && !throttled; i++) {
         // A more robust check would be to see if pthread_create succeeded for student_threads[i]
         // For simplicity, assuming all intended threads were stored if no error printed.
          if (student_threads[i] != 0) { // Basic check if thread identifier is not null
             pthread_join(student_threads[i], NULL);
         }
     }
+    pthread_attr_destroy(&ta_attr);
+    pthread_attr_destroy(&student_attr);
 
+    double real_seconds = elapsed_seconds();
     printf("\nAll students have been processed or have left the office.\n");
+    printf("Real time: %.3f s (%.0f students/s, %s queue%s)\n", real_seconds, config.num_students / real_seconds,
+           config.topology == TOPOLOGY_PER_TA ? "per-TA" : "shared", config.topology == TOPOLOGY_PER_TA ? "s" : "");
+
+    struct ta_counters totals = ta_counters_sum();
+    if (config.work_stealing) {
+        printf("Students stolen by idle TAs: %d\n", totals.steals);
+    }
+    if (config.batch_size > 1) {
+        print_batch_sizes(totals.batch_sessions, config.batch_size);
+    }
+    if (config.wake_setup > 0.0 || config.break_every > 0.0) {
+        print_ta_availability(totals.wakeups, totals.breaks);
+    }
+    if (config.ta_wait != TA_WAIT_BLOCK) {
+        printf("TA waits for a student: %d ended while polling, %d asleep in the semaphore\n", totals.spun,
+               totals.parked);
+    }
+    if (fiber_mode) {
+        print_fiber_summary();
+    } else {
+        print_thread_costs(create_us, created, stack_bytes, late, lateness);
+    }
+
+    office_mutex_lock(&sync_state.count_mutex);
+    print_wait_statistics(wait_series, wait_series_class, config.priority_classes, wait_series_topic, config.num_topics,
+                          sync_state.wait_series_len);
+    office_mutex_unlock(&sync_state.count_mutex);
+    print_student_phases(&students, config.num_students);
     printf("TA will continue running (Press Ctrl+C to terminate or implement TA termination logic).\n");
 
     // In a real scenario, you might want a way to signal the TA thread to terminate.
@@ -161,11 +6443,376 @@ int main() {
 
 
     // Destroy semaphores and mutex
-    sem_destroy(&waiting_room_chairs_sem);
-    sem_destroy(&student_present_for_ta_sem);
-    sem_destroy(&ta_ready_for_student_sem);
-    sem_destroy(&consultation_finished_sem);
-    pthread_mutex_destroy(&count_mutex);
+    office_sem_destroy(&sync_state.waiting_room_chairs_sem);
+    office_sem_destroy(&sync_state.student_present_for_ta_sem);
+    for (i = 1; i <= config.num_students; i++) {
+        office_sem_destroy(&ta_ready_for_student_sem[i]);
+        office_sem_destroy(&consultation_finished_sem[i]);
+    }
+    office_mutex_destroy(&sync_state.count_mutex);
+    if (fiber_mode) {
+        fiber_runtime_free();
+    }
+    if (throttled) {
+        sem_destroy(&student_thread_slots);
+    }
+    free(create_us);
+    free(order);
+
+    free(student_threads);
+    free(ta_threads);
+    student_table_free(&students);
+    return 0;
+}
+
+// --- Coroutine Students ---
+// The threaded mode's student and TA logic, written as stackless coroutines and run
+// by a user-space executor on one thread in simulated time. A coroutine is a function
+// that saves the line to resume at (a switch over __LINE__, as in protothreads) and
+// returns whenever it has to wait: for a sleep to end, for a semaphore, or for one of
+// its own signals. Anything it needs across a wait lives in its state struct rather
+// than on a stack, so a student costs a few bytes instead of a thread's stack and a
+// kernel context switch per semaphore wait, and a million of them run at once.
+//
+// The executor resumes ready coroutines in the order they became ready, and when
+// none are left advances the clock to the next timer. Timers are ordered like the
+// virtual-time engine's events: a TA finishing first, then arrivals, then students
+// giving up, so the two agree on simultaneous events.
+#define CO_BEGIN(line) switch (line) { case 0:
+#define CO_YIELD(line) do { (line) = __LINE__; return 0; case __LINE__:; } while (0)
+#define CO_AWAIT(line, ready) do { if (!(ready)) CO_YIELD(line); } while (0)
+#define CO_EXIT(line) do { (line) = -1; return 1; } while (0)
+#define CO_END(line) } (line) = -1; return 1
+
+struct co_executor {
+    double now;               // Simulated seconds
+    struct event_queue timers; // Pending wake-ups; the event's student field holds the coroutine
+    int* ready;               // Ring of coroutines to resume, in order
+    int ready_head, ready_count, ready_capacity;
+    long resumes;
+};
+
+// Counting semaphore whose waiters are coroutines, woken first come, first served
+struct co_semaphore {
+    int count;
+    int* waiters;
+    int head, waiting, capacity;
+};
+
+struct co_student {
+    int line;               // Resume point
+    unsigned char signals;  // Posts not yet taken: the student's ta_ready and consultation_finished semaphores
+    unsigned char waiting;  // Suspended on a signal
+    unsigned char timed_out;
+    uint64_t timer;         // Live patience timer, 0: none
+};
+
+struct co_ta {
+    int line;
+    int group[MAX_BATCH_SIZE];
+    int k;
+};
+
+struct co_office {
+    struct co_executor ex;
+    struct co_student* students; // Coroutines 1..num_students
+    struct co_ta* tas;           // Coroutines num_students + 1 + ta
+    struct co_semaphore student_present;
+    int chairs_taken;
+};
+
+void co_ready(struct co_executor* ex, int co) {
+    ex->ready[(ex->ready_head + ex->ready_count++) % ex->ready_capacity] = co;
+}
+
+// Suspends until simulated time until; type orders simultaneous wake-ups
+uint64_t co_sleep_until(struct co_executor* ex, int co, double until, int type) {
+    return event_queue_push(&ex->timers, until, type, co, 0);
+}
+
+int co_sem_wait(struct co_semaphore* sem, int co) {
+    if (sem->count > 0) {
+        sem->count--;
+        return 1;
+    }
+    sem->waiters[(sem->head + sem->waiting++) % sem->capacity] = co;
+    return 0;
+}
+
+int co_sem_trywait(struct co_semaphore* sem) {
+    if (sem->count > 0) {
+        sem->count--;
+        return 1;
+    }
+    return 0;
+}
 
+// Hands the unit straight to the longest waiter, if any
+void co_sem_post(struct co_executor* ex, struct co_semaphore* sem) {
+    if (sem->waiting > 0) {
+        co_ready(ex, sem->waiters[sem->head]);
+        sem->head = (sem->head + 1) % sem->capacity;
+        sem->waiting--;
+    } else {
+        sem->count++;
+    }
+}
+
+// The student's own semaphores have a single waiter, the student, so a count and a flag do
+int co_signal_take(struct co_student* student) {
+    if (student->signals > 0) {
+        student->signals--;
+        return 1;
+    }
+    student->waiting = 1;
+    return 0;
+}
+
+void co_signal_post(struct co_office* office, int id) {
+    struct co_student* student = &office->students[id];
+    if (student->waiting) {
+        student->waiting = 0;
+        student->timer = 0; // Called in time: cancel the patience timer
+        co_ready(&office->ex, id);
+    } else {
+        student->signals++;
+    }
+}
+
+// student_thread_func, shared waiting room; returns 1 once the student has left
+int student_coroutine(struct co_office* office, int id) {
+    struct co_student* co = &office->students[id];
+    double now = office->ex.now;
+    CO_BEGIN(co->line);
+    co_sleep_until(&office->ex, id, students.arrival[id], EVENT_ARRIVAL);
+    CO_YIELD(co->line);
+    now = office->ex.now;
+    narrate("Student %d: Arrived at TA's office.\n", id);
+    if (office->chairs_taken >= config.max_chairs) {
+        students.finished[id] = now;
+        students.state[id] = STUDENT_BALKED;
+        narrate("Student %d: No chairs available. Leaving and will come back later.\n", id);
+        CO_EXIT(co->line);
+    }
+    office->chairs_taken++;
+    students.seated[id] = now;
+    students.state[id] = STUDENT_WAITING;
+    waiting_room_push(&waiting_room, id, draw_priority_class(&config, config.seed, config.antithetic, id), now,
+                      config.aging_rate);
+    narrate("Student %d: Took a chair. (Waiting students in chairs: %d)\n", id, office->chairs_taken);
+    co_sem_post(&office->ex, &office->student_present);
+    double patience = draw_patience(&config, config.seed, config.antithetic, id);
+    if (patience > 0.0) {
+        co->timer = co_sleep_until(&office->ex, id, now + patience, EVENT_RENEGE);
+    }
+
+    CO_AWAIT(co->line, co_signal_take(co)); // Wait for a TA to call this student, or for patience to run out
+    now = office->ex.now;
+    co->timer = 0;
+    if (co->timed_out && waiting_room_abandon(&waiting_room, id)) {
+        office->chairs_taken--;
+        students.finished[id] = now;
+        students.state[id] = STUDENT_ABANDONED;
+        narrate("Student %d: Waited %.3g seconds without being called. Giving up.\n", id, now - students.seated[id]);
+        CO_EXIT(co->line);
+    }
+    if (co->timed_out) {
+        co_signal_take(co); // Called in the same instant patience ran out: the call is already posted
+    }
+    office->chairs_taken--;
+    students.called[id] = now;
+    students.state[id] = STUDENT_CONSULTING;
+    wait_series_class[sync_state.wait_series_len] = draw_priority_class(&config, config.seed, config.antithetic, id);
+    wait_series_topic[sync_state.wait_series_len] = 0;
+    wait_series[sync_state.wait_series_len++] = now - students.seated[id];
+    narrate("Student %d: Consulting with TA.\n", id);
+
+    CO_AWAIT(co->line, co_signal_take(co)); // Wait for the TA to finish this consultation
+    students.finished[id] = office->ex.now;
+    students.state[id] = STUDENT_SERVED;
+    narrate("Student %d: Consultation finished. Leaving the office.\n", id);
+    CO_END(co->line);
+}
+
+// ta_thread_func, shared waiting room; never finishes
+int ta_coroutine(struct co_office* office, int ta) {
+    struct co_ta* co = &office->tas[ta];
+    int self = config.num_students + 1 + ta;
+    struct waiting_entry next;
+    CO_BEGIN(co->line);
+    while (1) {
+        narrate("TA %d: Checking for students or going to sleep...\n", ta);
+        CO_AWAIT(co->line, co_sem_wait(&office->student_present, self));
+
+        // Every seated student posted once, so each extra student called consumes one more post
+        co->k = 0;
+        while (co->k < config.batch_size && (co->k == 0 || co_sem_trywait(&office->student_present)) &&
+               waiting_room_pop(&waiting_room, &next)) {
+            co->group[co->k++] = next.student;
+            narrate("TA %d: Calling in student %d (class %d).\n", ta, next.student, next.priority_class);
+            co_signal_post(office, next.student);
+        }
+        if (co->k == 0) {
+            continue; // The student who signalled has already given up and left
+        }
+        ta_counters[ta].batch_sessions[co->k]++;
+
+        double help_duration = batch_session_time(&config, config.seed, config.antithetic, co->group[0], co->k);
+        narrate("TA %d: Helping %d student(s), led by student %d, for %.3g seconds...\n", ta, co->k, co->group[0],
+                help_duration);
+        co_sleep_until(&office->ex, self, office->ex.now + help_duration, EVENT_SERVICE_DONE);
+        CO_YIELD(co->line);
+
+        for (int i = 0; i < co->k; i++) {
+            narrate("TA %d: Finished helping student %d.\n", ta, co->group[i]);
+            co_signal_post(office, co->group[i]);
+        }
+    }
+    CO_END(co->line);
+}
+
+// Resumes ready coroutines until none is left, then moves the clock to the next timer
+void co_run(struct co_office* office) {
+    struct co_executor* ex = &office->ex;
+    struct event ev;
+    while (1) {
+        while (ex->ready_count > 0) {
+            int co = ex->ready[ex->ready_head];
+            ex->ready_head = (ex->ready_head + 1) % ex->ready_capacity;
+            ex->ready_count--;
+            ex->resumes++;
+            if (co <= config.num_students) student_coroutine(office, co);
+            else ta_coroutine(office, co - config.num_students - 1);
+        }
+        if (!event_queue_pop(&ex->timers, &ev)) {
+            return; // Every student has left; the TAs wait for more forever
+        }
+        ex->now = ev.time;
+        if (ev.type == EVENT_RENEGE) {
+            struct co_student* student = &office->students[ev.student];
+            if (ev.seq != student->timer) continue; // Called before patience ran out
+            student->timer = 0;
+            student->waiting = 0;
+            student->timed_out = 1;
+        }
+        co_ready(ex, ev.student);
+    }
+}
+
+int run_coroutine_simulation(void) {
+    int n = config.num_students, coroutines = n + config.num_tas;
+    struct co_office office;
+    memset(&office, 0, sizeof(office));
+    office.ex.timers.next_seq = 1; // Sequence numbers double as timer handles, and 0 means no timer
+    office.ex.timers.kind = config.calendar;
+    office.ex.ready_capacity = coroutines;
+    office.ex.ready = malloc(coroutines * sizeof(int));
+    office.students = calloc(n + 1, sizeof(struct co_student));
+    office.tas = calloc(config.num_tas, sizeof(struct co_ta));
+    office.student_present.capacity = config.num_tas;
+    office.student_present.waiters = malloc(config.num_tas * sizeof(int));
+    ta_counters = aligned_alloc(CACHE_LINE, config.num_tas * sizeof(struct ta_counters));
+    wait_series = malloc(n * sizeof(double));
+    wait_series_class = malloc(n * sizeof(int));
+    wait_series_topic = malloc(n * sizeof(int));
+    if (office.ex.ready == NULL || office.students == NULL || office.tas == NULL ||
+        office.student_present.waiters == NULL || ta_counters == NULL || wait_series == NULL ||
+        wait_series_class == NULL || wait_series_topic == NULL || student_table_init(&students, n) != 0 ||
+        waiting_room_init(&waiting_room, config.max_chairs, n, NULL) != 0) {
+        perror("Failed to allocate coroutine state");
+        return 1;
+    }
+    memset(ta_counters, 0, config.num_tas * sizeof(struct ta_counters));
+    draw_arrival_times(&config, config.seed, config.antithetic, students.arrival);
+
+    printf("TA Office Simulation Started (coroutines). Total waiting chairs: %d\n", config.max_chairs);
+    printf("Total number of students: %d (seed %llu)\n\n", n, (unsigned long long)config.seed);
+    clock_gettime(CLOCK_MONOTONIC, &simulation_start);
+    for (int ta = 0; ta < config.num_tas; ta++) {
+        co_ready(&office.ex, n + 1 + ta);
+    }
+    for (int id = 1; id <= n; id++) {
+        co_ready(&office.ex, id);
+    }
+    co_run(&office);
+    double real_seconds = elapsed_seconds();
+
+    size_t default_stack = 0;
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) == 0) {
+        pthread_attr_getstacksize(&attr, &default_stack);
+        pthread_attr_destroy(&attr);
+    }
+    printf("\nAll students have been processed or have left the office.\n");
+    printf("Simulated time: %.3f s, real time: %.3f s (%.0f students/s)\n", office.ex.now, real_seconds,
+           real_seconds > 0.0 ? n / real_seconds : 0.0);
+    printf("Coroutines: %d, resumed %ld times; %zu bytes of state per student (a thread reserves %zu KB of stack)\n",
+           coroutines, office.ex.resumes, sizeof(struct co_student), default_stack / 1024);
+    struct ta_counters totals = ta_counters_sum();
+    if (config.batch_size > 1) {
+        print_batch_sizes(totals.batch_sessions, config.batch_size);
+    }
+    print_wait_statistics(wait_series, wait_series_class, config.priority_classes, wait_series_topic, config.num_topics,
+                          sync_state.wait_series_len);
+    print_student_phases(&students, n);
+
+    event_queue_free(&office.ex.timers);
+    free(office.ex.ready);
+    free(office.students);
+    free(office.tas);
+    free(office.student_present.waiters);
     return 0;
 }
+
+// --- Main Function ---
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv, &config) != 0) {
+        return 1;
+    }
+    if (config.calendar_benchmark) {
+        return run_calendar_benchmark(&config);
+    }
+    if (config.sharing_benchmark) {
+        return run_sharing_benchmark(&config);
+    }
+    if (config.handoff_benchmark) {
+        return run_handoff_benchmark(&config);
+    }
+    if (config.arena_stats) {
+        atexit(print_arena_summary); // Whichever experiment runs, report once it has finished
+    }
+
+    if (config.analytic) {
+        struct mmck_metrics metrics;
+        if (analytic_model_applies(&config)) {
+            if (mmck_for_config(&config, config.num_tas, config.max_chairs, &metrics) != 0) {
+                return 1;
+            }
+            print_mmck_metrics(&config, &metrics);
+            return 0;
+        }
+        printf("Closed form needs exponential arrivals and service, at least one chair, no reneging, a shared "
+               "waiting room, no group consultations, always-available TAs and a single topic; simulating instead.\n\n");
+    }
+    if (config.validate) {
+        clock_gettime(CLOCK_MONOTONIC, &simulation_start);
+        return run_validation(&config);
+    }
+    if (config.optimize) {
+        clock_gettime(CLOCK_MONOTONIC, &simulation_start);
+        return run_staffing_optimizer(&config);
+    }
+    if (config.closed_horizon > 0.0) {
+        return run_closed_experiment(&config);
+    }
+    if (config.num_offices > 0) {
+        return run_network_experiment(&config);
+    }
+    if (config.virtual_time) {
+        return run_virtual_experiment(&config);
+    }
+    if (config.student_model == STUDENTS_COROUTINES) {
+        return run_coroutine_simulation();
+    }
+    return run_threaded_simulation();
+}